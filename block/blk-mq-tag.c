@@ -0,0 +1,122 @@
+/*
+ * Tag allocation for the multiqueue block layer
+ *
+ * Every hardware queue owns a bitmap with one bit per request it can have
+ * outstanding.  Allocation takes no lock: each CPU starts looking after
+ * the tag it was given last, so CPUs mostly work on different words of
+ * the bitmap, and a bit is claimed with test_and_set_bit().
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blk-mq.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+
+#include "blk-mq.h"
+
+struct blk_mq_tags {
+	unsigned int nr_tags;
+	unsigned int __percpu *hint;	/* where to look next on this CPU */
+	wait_queue_head_t wait;
+	unsigned long map[];
+};
+
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node)
+{
+	struct blk_mq_tags *tags;
+	unsigned int cpu;
+
+	tags = kzalloc_node(sizeof(*tags) +
+			    BITS_TO_LONGS(nr_tags) * sizeof(unsigned long),
+			    GFP_KERNEL, node);
+	if (!tags)
+		return NULL;
+
+	tags->hint = alloc_percpu(unsigned int);
+	if (!tags->hint) {
+		kfree(tags);
+		return NULL;
+	}
+
+	/* spread the starting points over the bitmap */
+	for_each_possible_cpu(cpu)
+		*per_cpu_ptr(tags->hint, cpu) = cpu * nr_tags / nr_cpu_ids;
+
+	tags->nr_tags = nr_tags;
+	init_waitqueue_head(&tags->wait);
+	return tags;
+}
+
+void blk_mq_free_tags(struct blk_mq_tags *tags)
+{
+	free_percpu(tags->hint);
+	kfree(tags);
+}
+
+static int __blk_mq_get_tag(struct blk_mq_tags *tags)
+{
+	unsigned int start, tag;
+
+	start = this_cpu_read(*tags->hint);
+	if (start >= tags->nr_tags)
+		start = 0;
+
+	tag = start;
+	for (;;) {
+		tag = find_next_zero_bit(tags->map, tags->nr_tags, tag);
+		if (tag >= tags->nr_tags) {
+			if (!start)
+				return -1;
+			/* wrap around once */
+			tag = start = 0;
+			continue;
+		}
+		if (!test_and_set_bit(tag, tags->map))
+			break;
+	}
+
+	this_cpu_write(*tags->hint, tag + 1);
+	return tag;
+}
+
+/*
+ * Returns a free tag, or -1 if there is none and @gfp doesn't allow
+ * waiting for one.
+ */
+int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp)
+{
+	DEFINE_WAIT(wait);
+	int tag;
+
+	tag = __blk_mq_get_tag(tags);
+	if (tag >= 0 || !(gfp & __GFP_WAIT))
+		return tag;
+
+	for (;;) {
+		prepare_to_wait(&tags->wait, &wait, TASK_UNINTERRUPTIBLE);
+		tag = __blk_mq_get_tag(tags);
+		if (tag >= 0)
+			break;
+		/* sleeping also dispatches the requests we have plugged */
+		io_schedule();
+	}
+	finish_wait(&tags->wait, &wait);
+
+	return tag;
+}
+
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag)
+{
+	BUG_ON(tag >= tags->nr_tags);
+
+	clear_bit(tag, tags->map);
+	smp_mb__after_clear_bit();
+	if (waitqueue_active(&tags->wait))
+		wake_up(&tags->wait);
+}
+
+unsigned int blk_mq_tags_busy(struct blk_mq_tags *tags)
+{
+	return bitmap_weight(tags->map, tags->nr_tags);
+}
@@ -0,0 +1,706 @@
+/*
+ * Multiqueue block layer
+ *
+ * A request_queue set up with blk_mq_init_queue() has no queue_lock
+ * protected request list.  Each CPU stages requests on its own software
+ * queue, and each software queue maps to one of the driver's hardware
+ * queues.  Requests are preallocated per hardware queue and handed out by
+ * tag, so neither allocation nor submission touches state shared by all
+ * CPUs.  There is no I/O scheduler and no merging.
+ *
+ * Flushes are passed to the driver as empty REQ_FLUSH requests; a bio
+ * that carries data together with REQ_FLUSH, or REQ_FUA on a device that
+ * can't do FUA, is split into its steps by the submitter, which waits for
+ * each of them.
+ */
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+
+#include "blk.h"
+#include "blk-mq.h"
+
+static struct blk_mq_ctx *blk_mq_get_ctx(struct request_queue *q)
+{
+	return per_cpu_ptr(q->queue_ctx, raw_smp_processor_id());
+}
+
+static struct blk_mq_hw_ctx *blk_mq_map_queue(struct request_queue *q,
+					      unsigned int cpu)
+{
+	return q->queue_hw_ctx[q->mq_map[cpu]];
+}
+
+static struct request *blk_mq_alloc_rq(struct blk_mq_hw_ctx *hctx,
+				       struct blk_mq_ctx *ctx,
+				       unsigned int rw_flags, gfp_t gfp)
+{
+	struct request *rq;
+	int tag;
+
+	tag = blk_mq_get_tag(hctx->tags, gfp);
+	if (tag < 0)
+		return NULL;
+
+	rq = hctx->rqs[tag];
+	blk_rq_init(hctx->queue, rq);
+	rq->tag = tag;
+	rq->mq_ctx = ctx;
+	rq->cmd_flags = rw_flags;
+	if (blk_queue_io_stat(hctx->queue))
+		rq->cmd_flags |= REQ_IO_STAT;
+	return rq;
+}
+
+/**
+ * blk_mq_alloc_request - allocate a request on a multiqueue device
+ * @q:		the queue
+ * @rw:		READ or WRITE, optionally with more REQ_* flags
+ * @gfp:	__GFP_WAIT to sleep until a tag is free
+ *
+ * The request is filled in and queued like one from blk_get_request(),
+ * which calls this for multiqueue devices.
+ */
+struct request *blk_mq_alloc_request(struct request_queue *q, int rw,
+				     gfp_t gfp)
+{
+	struct blk_mq_ctx *ctx = blk_mq_get_ctx(q);
+
+	return blk_mq_alloc_rq(blk_mq_map_queue(q, ctx->cpu), ctx, rw, gfp);
+}
+EXPORT_SYMBOL(blk_mq_alloc_request);
+
+void blk_mq_free_request(struct request *rq)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, ctx->cpu);
+
+	ctx->rq_completed[rq_is_sync(rq)]++;
+	blk_mq_put_tag(hctx->tags, rq->tag);
+}
+EXPORT_SYMBOL(blk_mq_free_request);
+
+/**
+ * blk_mq_end_io - complete all of a request
+ * @rq:		the request
+ * @error:	0 or a negative errno
+ *
+ * May be called from interrupt context.
+ */
+void blk_mq_end_io(struct request *rq, int error)
+{
+	if (blk_update_request(rq, error, blk_rq_bytes(rq)))
+		BUG();
+
+	if (blk_queue_add_random(rq->q))
+		add_disk_randomness(rq->rq_disk);
+
+	blk_account_io_done(rq);
+
+	if (rq->end_io)
+		rq->end_io(rq, error);
+	else
+		blk_mq_free_request(rq);
+}
+EXPORT_SYMBOL(blk_mq_end_io);
+
+/*
+ * Move the requests of all software queues with work pending to the
+ * driver.  Whatever it is too busy for waits on hctx->dispatch, ahead of
+ * anything queued later, until the queue is started again.
+ */
+static void __blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	LIST_HEAD(rq_list);
+	unsigned int i;
+	int ret;
+
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	hctx->run++;
+
+	for (i = find_first_bit(hctx->ctx_map, hctx->nr_ctx); i < hctx->nr_ctx;
+	     i = find_next_bit(hctx->ctx_map, hctx->nr_ctx, i + 1)) {
+		clear_bit(i, hctx->ctx_map);
+		ctx = hctx->ctxs[i];
+
+		spin_lock(&ctx->lock);
+		list_splice_tail_init(&ctx->rq_list, &rq_list);
+		spin_unlock(&ctx->lock);
+	}
+
+	if (!list_empty_careful(&hctx->dispatch)) {
+		spin_lock(&hctx->lock);
+		list_splice_init(&hctx->dispatch, &rq_list);
+		spin_unlock(&hctx->lock);
+	}
+
+	while (!list_empty(&rq_list)) {
+		rq = list_first_entry(&rq_list, struct request, queuelist);
+		list_del_init(&rq->queuelist);
+
+		ret = hctx->queue->mq_ops->queue_rq(hctx, rq);
+		if (ret == BLK_MQ_RQ_QUEUE_OK) {
+			hctx->queued++;
+			continue;
+		}
+		if (ret == BLK_MQ_RQ_QUEUE_ERROR) {
+			rq->errors = -EIO;
+			blk_mq_end_io(rq, rq->errors);
+			continue;
+		}
+
+		list_add(&rq->queuelist, &rq_list);
+		break;
+	}
+
+	if (list_empty(&rq_list))
+		return;
+
+	spin_lock(&hctx->lock);
+	list_splice(&rq_list, &hctx->dispatch);
+	spin_unlock(&hctx->lock);
+
+	/*
+	 * The driver stops the queue before returning BUSY.  If it has been
+	 * started again in the meantime, nobody will run it for the requests
+	 * we just put back, so try again shortly.
+	 */
+	if (!test_bit(BLK_MQ_S_STOPPED, &hctx->state))
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->run_work, 1);
+}
+
+void blk_mq_run_hw_queue(struct blk_mq_hw_ctx *hctx, bool async)
+{
+	if (unlikely(test_bit(BLK_MQ_S_STOPPED, &hctx->state)))
+		return;
+
+	/* the software queue locks are not irq safe */
+	if (async || in_interrupt())
+		kblockd_schedule_delayed_work(hctx->queue, &hctx->run_work, 0);
+	else
+		__blk_mq_run_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_run_hw_queue);
+
+void blk_mq_run_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_run_queues);
+
+void blk_mq_stop_hw_queue(struct blk_mq_hw_ctx *hctx)
+{
+	set_bit(BLK_MQ_S_STOPPED, &hctx->state);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queue);
+
+void blk_mq_stop_hw_queues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i)
+		blk_mq_stop_hw_queue(hctx);
+}
+EXPORT_SYMBOL(blk_mq_stop_hw_queues);
+
+void blk_mq_start_stopped_hw_queues(struct request_queue *q, bool async)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!test_and_clear_bit(BLK_MQ_S_STOPPED, &hctx->state))
+			continue;
+		blk_mq_run_hw_queue(hctx, async);
+	}
+}
+EXPORT_SYMBOL(blk_mq_start_stopped_hw_queues);
+
+static void blk_mq_run_work_fn(struct work_struct *work)
+{
+	struct blk_mq_hw_ctx *hctx;
+
+	hctx = container_of(work, struct blk_mq_hw_ctx, run_work.work);
+	__blk_mq_run_hw_queue(hctx);
+}
+
+static void __blk_mq_insert_request(struct blk_mq_hw_ctx *hctx,
+				    struct request *rq, bool at_head)
+{
+	struct blk_mq_ctx *ctx = rq->mq_ctx;
+
+	spin_lock(&ctx->lock);
+	if (at_head)
+		list_add(&rq->queuelist, &ctx->rq_list);
+	else
+		list_add_tail(&rq->queuelist, &ctx->rq_list);
+	ctx->rq_dispatched[rq_is_sync(rq)]++;
+	spin_unlock(&ctx->lock);
+
+	/* the runner clears the bit before it empties the list */
+	set_bit(ctx->index_hw, hctx->ctx_map);
+}
+
+/**
+ * blk_mq_insert_request - queue a request from blk_mq_alloc_request()
+ * @rq:		the request
+ * @at_head:	queue in front of the requests of the same CPU
+ * @run_queue:	hand it to the driver now
+ * @async:	do that from kblockd instead of the caller's context
+ */
+void blk_mq_insert_request(struct request *rq, bool at_head, bool run_queue,
+			   bool async)
+{
+	struct blk_mq_hw_ctx *hctx = blk_mq_map_queue(rq->q, rq->mq_ctx->cpu);
+
+	__blk_mq_insert_request(hctx, rq, at_head);
+	if (run_queue)
+		blk_mq_run_hw_queue(hctx, async);
+}
+EXPORT_SYMBOL(blk_mq_insert_request);
+
+/*
+ * Requests of a plugged submitter are queued without running the
+ * hardware queue, which is run once when the plug is flushed.
+ */
+struct blk_mq_plug_cb {
+	struct blk_plug_cb cb;
+	struct request_queue *q;
+	unsigned int count;
+};
+
+static void blk_mq_unplug(struct blk_plug_cb *cb)
+{
+	struct blk_mq_plug_cb *mcb = container_of(cb, struct blk_mq_plug_cb, cb);
+
+	blk_mq_run_queues(mcb->q, false);
+	kfree(mcb);
+}
+
+static bool blk_mq_plug_request(struct request_queue *q, struct request *rq)
+{
+	struct blk_plug *plug = current->plug;
+	struct blk_mq_plug_cb *mcb;
+	struct blk_plug_cb *cb;
+	bool run;
+
+	if (!plug)
+		return false;
+
+	list_for_each_entry(cb, &plug->cb_list, list) {
+		if (cb->callback != blk_mq_unplug)
+			continue;
+		mcb = container_of(cb, struct blk_mq_plug_cb, cb);
+		if (mcb->q == q)
+			goto found;
+	}
+
+	mcb = kmalloc(sizeof(*mcb), GFP_NOIO);
+	if (!mcb)
+		return false;
+	mcb->cb.callback = blk_mq_unplug;
+	mcb->q = q;
+	mcb->count = 0;
+	list_add(&mcb->cb.list, &plug->cb_list);
+found:
+	/* don't hold back too much, dispatch a batch at a time */
+	run = ++mcb->count >= BLK_MAX_REQUEST_COUNT;
+	if (run)
+		mcb->count = 0;
+	blk_mq_insert_request(rq, false, run, false);
+	return true;
+}
+
+static void blk_mq_queue_bio(struct request_queue *q, struct bio *bio,
+			     bool may_plug)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	struct request *rq;
+	unsigned int rw_flags;
+
+	rw_flags = bio_data_dir(bio);
+	if (rw_is_sync(bio->bi_rw))
+		rw_flags |= REQ_SYNC;
+
+	/* the caller may move to another CPU while it waits for a tag */
+	ctx = blk_mq_get_ctx(q);
+	hctx = blk_mq_map_queue(q, ctx->cpu);
+	rq = blk_mq_alloc_rq(hctx, ctx, rw_flags, GFP_NOIO);
+
+	init_request_from_bio(rq, bio);
+	drive_stat_acct(rq, 1);
+
+	if (may_plug && blk_mq_plug_request(q, rq))
+		return;
+
+	blk_mq_insert_request(rq, false, true, false);
+}
+
+struct blk_mq_flush_wait {
+	struct completion done;
+	int error;
+};
+
+static void blk_mq_flush_end_io(struct request *rq, int error)
+{
+	struct blk_mq_flush_wait *w = rq->end_io_data;
+
+	w->error = error;
+	blk_mq_free_request(rq);
+	complete(&w->done);
+}
+
+static int blk_mq_issue_flush(struct request_queue *q, struct gendisk *disk)
+{
+	struct blk_mq_flush_wait w;
+	struct request *rq;
+
+	rq = blk_mq_alloc_request(q, WRITE_FLUSH, GFP_NOIO);
+	rq->cmd_type = REQ_TYPE_FS;
+	rq->cmd_flags |= REQ_FLUSH_SEQ;
+	rq->rq_disk = disk;
+	rq->end_io = blk_mq_flush_end_io;
+	rq->end_io_data = &w;
+
+	init_completion(&w.done);
+	blk_mq_insert_request(rq, false, true, false);
+	wait_for_completion(&w.done);
+
+	return w.error;
+}
+
+static void blk_mq_flush_bio_end_io(struct bio *bio, int error)
+{
+	struct blk_mq_flush_wait *w = bio->bi_private;
+
+	w->error = error;
+	complete(&w->done);
+}
+
+/*
+ * Run a flush bio as pre-flush, data and post-flush, waiting for each
+ * step.  Only a post-flush needs the data to complete first, so without
+ * one the data request is queued like any other.
+ */
+static void blk_mq_flush_bio(struct request_queue *q, struct bio *bio)
+{
+	struct gendisk *disk = bio->bi_bdev->bd_disk;
+	bool post = (bio->bi_rw & REQ_FUA) && !(q->flush_flags & REQ_FUA);
+	struct blk_mq_flush_wait w;
+	bio_end_io_t *end_io;
+	void *private;
+	int error;
+
+	if (bio->bi_rw & REQ_FLUSH) {
+		error = blk_mq_issue_flush(q, disk);
+		if (error)
+			goto out;
+		bio->bi_rw &= ~REQ_FLUSH;
+	}
+
+	if (!post) {
+		blk_mq_queue_bio(q, bio, false);
+		return;
+	}
+
+	bio->bi_rw &= ~REQ_FUA;
+	end_io = bio->bi_end_io;
+	private = bio->bi_private;
+	bio->bi_end_io = blk_mq_flush_bio_end_io;
+	bio->bi_private = &w;
+
+	init_completion(&w.done);
+	blk_mq_queue_bio(q, bio, false);
+	wait_for_completion(&w.done);
+
+	bio->bi_end_io = end_io;
+	bio->bi_private = private;
+	error = w.error;
+	if (!error)
+		error = blk_mq_issue_flush(q, disk);
+out:
+	bio_endio(bio, error);
+}
+
+static void blk_mq_make_request(struct request_queue *q, struct bio *bio)
+{
+	blk_queue_bounce(q, &bio);
+
+	if (unlikely(blk_queue_dead(q))) {
+		bio_endio(bio, -ENODEV);
+		return;
+	}
+
+	/* empty flushes go to the driver as they are */
+	if (unlikely(bio->bi_rw & (REQ_FLUSH | REQ_FUA)) && bio->bi_size &&
+	    ((bio->bi_rw & REQ_FLUSH) || !(q->flush_flags & REQ_FUA))) {
+		blk_mq_flush_bio(q, bio);
+		return;
+	}
+
+	blk_mq_queue_bio(q, bio, true);
+}
+
+/*
+ * Spread the possible CPUs evenly over the hardware queues, neighbouring
+ * CPU numbers sharing a queue.
+ */
+static void blk_mq_map_swqueues(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		q->mq_map[cpu] = cpu * q->nr_hw_queues / nr_cpu_ids;
+
+		ctx = per_cpu_ptr(q->queue_ctx, cpu);
+		memset(ctx, 0, sizeof(*ctx));
+		spin_lock_init(&ctx->lock);
+		INIT_LIST_HEAD(&ctx->rq_list);
+		ctx->cpu = cpu;
+		ctx->queue = q;
+
+		hctx = blk_mq_map_queue(q, cpu);
+		ctx->index_hw = hctx->nr_ctx;
+		hctx->ctxs[hctx->nr_ctx++] = ctx;
+	}
+}
+
+static void blk_mq_free_hw_ctx(struct blk_mq_hw_ctx *hctx)
+{
+	unsigned int i;
+
+	if (hctx->rqs) {
+		for (i = 0; i < hctx->queue_depth; i++)
+			kfree(hctx->rqs[i]);
+		kfree(hctx->rqs);
+	}
+	if (hctx->tags)
+		blk_mq_free_tags(hctx->tags);
+	kfree(hctx->ctx_map);
+	kfree(hctx->ctxs);
+	kfree(hctx);
+}
+
+static struct blk_mq_hw_ctx *blk_mq_alloc_hw_ctx(struct request_queue *q,
+						 struct blk_mq_reg *reg,
+						 unsigned int index)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i, rq_size;
+
+	hctx = kzalloc_node(sizeof(*hctx), GFP_KERNEL, reg->numa_node);
+	if (!hctx)
+		return NULL;
+
+	spin_lock_init(&hctx->lock);
+	INIT_LIST_HEAD(&hctx->dispatch);
+	INIT_DELAYED_WORK(&hctx->run_work, blk_mq_run_work_fn);
+	hctx->queue = q;
+	hctx->queue_num = index;
+	hctx->numa_node = reg->numa_node;
+	hctx->queue_depth = reg->queue_depth;
+
+	hctx->ctxs = kzalloc_node(nr_cpu_ids * sizeof(void *), GFP_KERNEL,
+				  reg->numa_node);
+	hctx->ctx_map = kzalloc_node(BITS_TO_LONGS(nr_cpu_ids) *
+				     sizeof(unsigned long), GFP_KERNEL,
+				     reg->numa_node);
+	hctx->tags = blk_mq_init_tags(reg->queue_depth, reg->numa_node);
+	hctx->rqs = kzalloc_node(reg->queue_depth * sizeof(void *), GFP_KERNEL,
+				 reg->numa_node);
+	if (!hctx->ctxs || !hctx->ctx_map || !hctx->tags || !hctx->rqs)
+		goto fail;
+
+	rq_size = sizeof(struct request) + reg->cmd_size;
+	for (i = 0; i < reg->queue_depth; i++) {
+		hctx->rqs[i] = kzalloc_node(rq_size, GFP_KERNEL, reg->numa_node);
+		if (!hctx->rqs[i])
+			goto fail;
+	}
+
+	return hctx;
+
+fail:
+	blk_mq_free_hw_ctx(hctx);
+	return NULL;
+}
+
+/**
+ * blk_mq_init_queue - set up a multiqueue request_queue
+ * @reg:	the driver's operations and queue geometry
+ * @driver_data: passed to ->init_hctx
+ *
+ * Returns the queue, or an ERR_PTR().  It is torn down with
+ * blk_cleanup_queue() like any other.
+ */
+struct request_queue *blk_mq_init_queue(struct blk_mq_reg *reg,
+					void *driver_data)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct request_queue *q;
+	unsigned int i;
+	int ret = -ENOMEM;
+
+	if (!reg->nr_hw_queues || !reg->ops->queue_rq ||
+	    !reg->queue_depth || reg->queue_depth > BLK_MQ_MAX_DEPTH)
+		return ERR_PTR(-EINVAL);
+
+	q = blk_alloc_queue_node(GFP_KERNEL, reg->numa_node);
+	if (!q)
+		return ERR_PTR(-ENOMEM);
+
+	q->nr_hw_queues = min_t(unsigned int, reg->nr_hw_queues, nr_cpu_ids);
+	q->queue_ctx = alloc_percpu(struct blk_mq_ctx);
+	q->mq_map = kzalloc_node(nr_cpu_ids * sizeof(*q->mq_map), GFP_KERNEL,
+				 reg->numa_node);
+	q->queue_hw_ctx = kzalloc_node(q->nr_hw_queues * sizeof(void *),
+				       GFP_KERNEL, reg->numa_node);
+	if (!q->queue_ctx || !q->mq_map || !q->queue_hw_ctx)
+		goto fail;
+
+	for (i = 0; i < q->nr_hw_queues; i++) {
+		q->queue_hw_ctx[i] = blk_mq_alloc_hw_ctx(q, reg, i);
+		if (!q->queue_hw_ctx[i])
+			goto fail;
+	}
+
+	blk_mq_map_swqueues(q);
+
+	blk_queue_make_request(q, blk_mq_make_request);
+	q->queue_flags |= QUEUE_FLAG_MQ_DEFAULT;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		if (!reg->ops->init_hctx)
+			break;
+		ret = reg->ops->init_hctx(hctx, driver_data, i);
+		if (ret) {
+			while (i--)
+				if (reg->ops->exit_hctx)
+					reg->ops->exit_hctx(q->queue_hw_ctx[i], i);
+			goto fail;
+		}
+	}
+
+	/* set last, it tells blk_cleanup_queue() to call ->exit_hctx */
+	q->mq_ops = reg->ops;
+	return q;
+
+fail:
+	blk_mq_free_queue(q);
+	blk_cleanup_queue(q);
+	return ERR_PTR(ret);
+}
+EXPORT_SYMBOL(blk_mq_init_queue);
+
+/*
+ * Called by blk_cleanup_queue() once the queue is dead: wait for the
+ * requests in flight.
+ *
+ * A driver that stops a hardware queue starts it again from its
+ * completion path, which never runs if the requests that made it stop
+ * have completed already and the rest still wait on hctx->dispatch.
+ * Start stopped queues on every pass, so that those get issued; if the
+ * driver is still busy it simply stops the queue again.
+ */
+void blk_mq_drain_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i, busy;
+
+	for (;;) {
+		busy = 0;
+		queue_for_each_hw_ctx(q, hctx, i) {
+			busy += blk_mq_tags_busy(hctx->tags);
+			clear_bit(BLK_MQ_S_STOPPED, &hctx->state);
+			blk_mq_run_hw_queue(hctx, false);
+		}
+		if (!busy)
+			break;
+		msleep(10);
+	}
+}
+
+/*
+ * The driver may go away after blk_cleanup_queue(), so it is done with
+ * the hardware queues before the queue itself is released.
+ */
+void blk_mq_exit_queue(struct request_queue *q)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned int i;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		cancel_delayed_work_sync(&hctx->run_work);
+		if (q->mq_ops->exit_hctx)
+			q->mq_ops->exit_hctx(hctx, i);
+	}
+}
+
+void blk_mq_free_queue(struct request_queue *q)
+{
+	unsigned int i;
+
+	if (q->queue_hw_ctx) {
+		for (i = 0; i < q->nr_hw_queues; i++)
+			if (q->queue_hw_ctx[i])
+				blk_mq_free_hw_ctx(q->queue_hw_ctx[i]);
+		kfree(q->queue_hw_ctx);
+	}
+	kfree(q->mq_map);
+	free_percpu(q->queue_ctx);
+
+	q->queue_hw_ctx = NULL;
+	q->mq_map = NULL;
+	q->queue_ctx = NULL;
+	q->nr_hw_queues = 0;
+}
+
+/*
+ * Per hardware queue: requests handed to the driver, times the queue was
+ * run and tags in use; then per CPU: requests queued and completed.
+ */
+ssize_t blk_mq_stats_show(struct request_queue *q, char *page)
+{
+	struct blk_mq_hw_ctx *hctx;
+	struct blk_mq_ctx *ctx;
+	unsigned int i, j;
+	ssize_t ret = 0;
+
+	queue_for_each_hw_ctx(q, hctx, i) {
+		ret += snprintf(page + ret, PAGE_SIZE - ret,
+				"hctx%u: queued=%lu run=%lu busy=%u/%u\n",
+				i, hctx->queued, hctx->run,
+				blk_mq_tags_busy(hctx->tags), hctx->queue_depth);
+		for (j = 0; j < hctx->nr_ctx; j++) {
+			ctx = hctx->ctxs[j];
+			ret += snprintf(page + ret, PAGE_SIZE - ret,
+					"  cpu%u: dispatched=%lu/%lu completed=%lu/%lu\n",
+					ctx->cpu,
+					ctx->rq_dispatched[BLK_RW_ASYNC],
+					ctx->rq_dispatched[BLK_RW_SYNC],
+					ctx->rq_completed[BLK_RW_ASYNC],
+					ctx->rq_completed[BLK_RW_SYNC]);
+		}
+	}
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef INT_BLK_MQ_H
+#define INT_BLK_MQ_H
+
+/*
+ * Per-CPU software queue.  Submitters add requests here under a lock
+ * that is only contended when a hardware queue is run on another CPU.
+ */
+struct blk_mq_ctx {
+	struct {
+		spinlock_t		lock;
+		struct list_head	rq_list;
+	} ____cacheline_aligned_in_smp;
+
+	unsigned int		cpu;
+	unsigned int		index_hw;	/* bit in hctx->ctx_map */
+	struct request_queue	*queue;
+
+	unsigned long		rq_dispatched[2];
+	unsigned long		rq_completed[2];
+};
+
+void blk_mq_drain_queue(struct request_queue *q);
+void blk_mq_exit_queue(struct request_queue *q);
+void blk_mq_free_queue(struct request_queue *q);
+ssize_t blk_mq_stats_show(struct request_queue *q, char *page);
+
+/*
+ * Tag allocation, blk-mq-tag.c
+ */
+struct blk_mq_tags *blk_mq_init_tags(unsigned int nr_tags, int node);
+void blk_mq_free_tags(struct blk_mq_tags *tags);
+int blk_mq_get_tag(struct blk_mq_tags *tags, gfp_t gfp);
+void blk_mq_put_tag(struct blk_mq_tags *tags, unsigned int tag);
+unsigned int blk_mq_tags_busy(struct blk_mq_tags *tags);
+
+#endif
@@ -9,6 +9,7 @@
 #include <linux/blktrace_api.h>
 
 #include "blk.h"
+#include "blk-mq.h"
 
 struct queue_sysfs_entry {
 	struct attribute attr;
@@ -387,6 +388,18 @@ static struct queue_sysfs_entry queue_random_entry = {
 	.store = queue_store_random,
 };
 
+static ssize_t queue_mq_stats_show(struct request_queue *q, char *page)
+{
+	if (!q->mq_ops)
+		return 0;
+	return blk_mq_stats_show(q, page);
+}
+
+static struct queue_sysfs_entry queue_mq_stats_entry = {
+	.attr = {.name = "mq_stats", .mode = S_IRUGO },
+	.show = queue_mq_stats_show,
+};
+
 static struct attribute *default_attrs[] = {
 	&queue_requests_entry.attr,
 	&queue_ra_entry.attr,
@@ -409,6 +422,7 @@ static struct attribute *default_attrs[] = {
 	&queue_rq_affinity_entry.attr,
 	&queue_iostats_entry.attr,
 	&queue_random_entry.attr,
+	&queue_mq_stats_entry.attr,
 	NULL,
 };
 
@@ -494,6 +508,9 @@ static void blk_release_queue(struct kobject *kobj)
 	if (q->queue_tags)
 		__blk_queue_free_tags(q);
 
+	if (q->mq_ops)
+		blk_mq_free_queue(q);
+
 	blk_throtl_release(q);
 	blk_trace_shutdown(q);
 
@@ -76,6 +76,8 @@
 #include <linux/sysfs.h>
 #include <linux/miscdevice.h>
 #include <linux/falloc.h>
+#include <linux/pagemap.h>
+#include <linux/mempool.h>
 
 #include <asm/uaccess.h>
 
@@ -85,6 +87,28 @@ static DEFINE_MUTEX(loop_index_mutex);
 static int max_part;
 static int part_shift;
 
+/*
+ * Number of bios of one device handled concurrently, read when a backing
+ * file is attached.  0 handles them one at a time in the "loopN" thread,
+ * which is also the only mode that batches direct mode backing I/O.
+ */
+#define LOOP_MIN_CMDS		16
+
+static int max_workers = CONFIG_BLK_DEV_LOOP_MAX_WORKERS;
+module_param(max_workers, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_workers,
+	"Concurrent bios per loop device, 0 for a single thread (default "
+	__stringify(CONFIG_BLK_DEV_LOOP_MAX_WORKERS) ")");
+
+/* work item of one bio in workqueue mode */
+struct loop_cmd {
+	struct work_struct work;
+	struct loop_device *lo;
+	struct bio *bio;
+};
+
+static mempool_t *loop_cmd_pool;
+
 /*
  * Transfer functions
  */
@@ -403,6 +427,83 @@ lo_receive(struct loop_device *lo, struct bio *bio, int bsize, loff_t pos)
 	return 0;
 }
 
+/*
+ * Direct mode read: copy from the backing page cache, waiting for reads
+ * started by lo_start_read(), then drop the backing pages again.
+ */
+static int
+lo_receive_direct(struct loop_device *lo, struct bio *bio, loff_t pos)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping = file->f_mapping;
+	pgoff_t start = pos >> PAGE_CACHE_SHIFT;
+	struct bio_vec *bvec;
+	struct page *page;
+	int i, ret = 0;
+
+	bio_for_each_segment(bvec, bio, i) {
+		unsigned done = 0;
+
+		while (done < bvec->bv_len) {
+			unsigned offset = pos & (PAGE_CACHE_SIZE - 1);
+			unsigned len = min_t(unsigned, bvec->bv_len - done,
+					     PAGE_CACHE_SIZE - offset);
+
+			page = read_mapping_page(mapping,
+						 pos >> PAGE_CACHE_SHIFT, file);
+			if (IS_ERR(page)) {
+				ret = PTR_ERR(page);
+				goto out;
+			}
+			ret = lo_do_transfer(lo, READ, page, offset,
+					     bvec->bv_page,
+					     bvec->bv_offset + done, len,
+					     pos >> 9);
+			page_cache_release(page);
+			if (ret) {
+				printk(KERN_ERR "loop: transfer error block %llu\n",
+				       (unsigned long long)pos >> 9);
+				ret = -EIO;
+				goto out;
+			}
+			flush_dcache_page(bvec->bv_page);
+			done += len;
+			pos += len;
+		}
+	}
+out:
+	if (pos > 0)
+		invalidate_mapping_pages(mapping, start,
+					 (pos - 1) >> PAGE_CACHE_SHIFT);
+	return ret;
+}
+
+/*
+ * Direct mode: start reading the backing pages of a read bio without
+ * waiting for them.  Pages already in the page cache are left alone.
+ */
+static void lo_start_read(struct loop_device *lo, struct bio *bio)
+{
+	struct file *file = lo->lo_backing_file;
+	struct address_space *mapping = file->f_mapping;
+	loff_t pos = ((loff_t)bio->bi_sector << 9) + lo->lo_offset;
+	pgoff_t index = pos >> PAGE_CACHE_SHIFT;
+	pgoff_t last = (pos + bio->bi_size - 1) >> PAGE_CACHE_SHIFT;
+	struct page *page;
+
+	if (!bio->bi_size)
+		return;
+
+	for (; index <= last; index++) {
+		page = find_get_page(mapping, index);
+		if (!page)
+			page = read_cache_page_async(mapping, index,
+				(filler_t *)mapping->a_ops->readpage, file);
+		if (!IS_ERR(page))
+			page_cache_release(page);
+	}
+}
+
 static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 {
 	loff_t pos;
@@ -451,7 +552,9 @@ static int do_bio_filebacked(struct loop_device *lo, struct bio *bio)
 			if (unlikely(ret && ret != -EINVAL))
 				ret = -EIO;
 		}
-	} else
+	} else if (lo->lo_flags & LO_FLAGS_DIRECT_IO)
+		ret = lo_receive_direct(lo, bio, pos);
+	else
 		ret = lo_receive(lo, bio, lo->lo_blocksize, pos);
 
 out:
@@ -474,9 +577,12 @@ static struct bio *loop_get_bio(struct loop_device *lo)
 	return bio_list_pop(&lo->lo_bio_list);
 }
 
+static void loop_queue_work(struct work_struct *work);
+
 static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 {
 	struct loop_device *lo = q->queuedata;
+	struct loop_cmd *cmd = NULL;
 	int rw = bio_rw(old_bio);
 
 	if (rw == READA)
@@ -484,18 +590,39 @@ static void loop_make_request(struct request_queue *q, struct bio *old_bio)
 
 	BUG_ON(!lo || (rw != READ && rw != WRITE));
 
+	/* lo_wq doesn't change while the device is bound */
+	if (ACCESS_ONCE(lo->lo_wq))
+		cmd = mempool_alloc(loop_cmd_pool, GFP_NOIO);
+
 	spin_lock_irq(&lo->lo_lock);
 	if (lo->lo_state != Lo_bound)
 		goto out;
 	if (unlikely(rw == WRITE && (lo->lo_flags & LO_FLAGS_READ_ONLY)))
 		goto out;
-	loop_add_bio(lo, old_bio);
-	wake_up(&lo->lo_event);
+	if (lo->lo_wq) {
+		/* only if the device was bound after the check above */
+		if (unlikely(!cmd))
+			cmd = mempool_alloc(loop_cmd_pool, GFP_ATOMIC);
+		if (unlikely(!cmd))
+			goto out;
+		INIT_WORK(&cmd->work, loop_queue_work);
+		cmd->lo = lo;
+		cmd->bio = old_bio;
+		queue_work(lo->lo_wq, &cmd->work);
+		cmd = NULL;
+	} else {
+		loop_add_bio(lo, old_bio);
+		wake_up(&lo->lo_event);
+	}
 	spin_unlock_irq(&lo->lo_lock);
+	if (cmd)
+		mempool_free(cmd, loop_cmd_pool);
 	return;
 
 out:
 	spin_unlock_irq(&lo->lo_lock);
+	if (cmd)
+		mempool_free(cmd, loop_cmd_pool);
 	bio_io_error(old_bio);
 }
 
@@ -517,6 +644,128 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 	}
 }
 
+/*
+ * Direct mode: wait for the writeback started by loop_handle_batch() and
+ * complete the written bios.
+ */
+static void loop_finish_writes(struct loop_device *lo, struct bio_list *written)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	struct bio *bio;
+	loff_t pos, end;
+	int ret;
+
+	while ((bio = bio_list_pop(written))) {
+		pos = ((loff_t)bio->bi_sector << 9) + lo->lo_offset;
+		end = pos + bio->bi_size - 1;
+		ret = filemap_fdatawait_range(mapping, pos, end);
+		invalidate_mapping_pages(mapping, pos >> PAGE_CACHE_SHIFT,
+					 end >> PAGE_CACHE_SHIFT);
+		bio_endio(bio, ret ? -EIO : 0);
+	}
+}
+
+/*
+ * Direct mode: handle all bios queued so far.  The backing reads of every
+ * read bio are started first, so that they are all in flight while the
+ * bios are served in order.  Writes go through the page cache as usual,
+ * but their writeback is started right away and they only complete once
+ * it has finished, like O_DIRECT writes.
+ */
+static void loop_handle_batch(struct loop_device *lo, struct bio_list *batch)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	struct bio_list written;
+	struct blk_plug plug;
+	struct bio *bio;
+	loff_t pos;
+	int ret;
+
+	blk_start_plug(&plug);
+	bio_list_for_each(bio, batch)
+		if (bio->bi_bdev && bio_rw(bio) != WRITE)
+			lo_start_read(lo, bio);
+	blk_finish_plug(&plug);
+
+	bio_list_init(&written);
+	blk_start_plug(&plug);
+	while ((bio = bio_list_pop(batch))) {
+		if (unlikely(!bio->bi_bdev)) {
+			/* a switch waits for everything queued before it */
+			loop_finish_writes(lo, &written);
+			loop_handle_bio(lo, bio);
+			mapping = lo->lo_backing_file->f_mapping;
+			continue;
+		}
+		if (bio_rw(bio) != WRITE) {
+			loop_handle_bio(lo, bio);
+			continue;
+		}
+
+		ret = do_bio_filebacked(lo, bio);
+		if (ret || !bio->bi_size || (bio->bi_rw & REQ_DISCARD)) {
+			bio_endio(bio, ret);
+			continue;
+		}
+		pos = ((loff_t)bio->bi_sector << 9) + lo->lo_offset;
+		filemap_fdatawrite_range(mapping, pos, pos + bio->bi_size - 1);
+		bio_list_add(&written, bio);
+	}
+	blk_finish_plug(&plug);
+
+	loop_finish_writes(lo, &written);
+}
+
+/*
+ * Direct mode write in workqueue mode: write the bio back and drop it from
+ * the backing page cache before completing it.
+ */
+static int lo_write_wait(struct loop_device *lo, struct bio *bio)
+{
+	struct address_space *mapping = lo->lo_backing_file->f_mapping;
+	loff_t pos, end;
+	int ret;
+
+	if (!bio->bi_size || (bio->bi_rw & REQ_DISCARD))
+		return 0;
+
+	pos = ((loff_t)bio->bi_sector << 9) + lo->lo_offset;
+	end = pos + bio->bi_size - 1;
+	ret = filemap_write_and_wait_range(mapping, pos, end);
+	invalidate_mapping_pages(mapping, pos >> PAGE_CACHE_SHIFT,
+				 end >> PAGE_CACHE_SHIFT);
+	return ret ? -EIO : 0;
+}
+
+/*
+ * Workqueue mode: handle one bio.  Up to lo_workers of these run at once.
+ *
+ * Ordering of flushes is kept because each bio is handled start to finish
+ * by one work item: the pre-flush, the data and the FUA fsync of a bio are
+ * done in that order, and a REQ_FLUSH only has to cover writes completed
+ * before it was issued, which are already in the backing file's page cache
+ * when vfs_fsync() runs.  Switching the backing file takes lo_wq_sem for
+ * write, so no bio is handled while lo_backing_file changes.
+ */
+static void loop_queue_work(struct work_struct *work)
+{
+	struct loop_cmd *cmd = container_of(work, struct loop_cmd, work);
+	struct loop_device *lo = cmd->lo;
+	struct bio *bio = cmd->bio;
+	int ret;
+
+	mempool_free(cmd, loop_cmd_pool);
+
+	down_read(&lo->lo_wq_sem);
+	ret = do_bio_filebacked(lo, bio);
+	if (!ret && bio_rw(bio) == WRITE &&
+	    (lo->lo_flags & LO_FLAGS_DIRECT_IO))
+		ret = lo_write_wait(lo, bio);
+	up_read(&lo->lo_wq_sem);
+
+	bio_endio(bio, ret);
+}
+
 /*
  * worker thread that handles reads/writes to file backed loop devices,
  * to avoid blocking in our make_request_fn. it also does loop decrypting
@@ -532,6 +781,7 @@ static inline void loop_handle_bio(struct loop_device *lo, struct bio *bio)
 static int loop_thread(void *data)
 {
 	struct loop_device *lo = data;
+	struct bio_list batch;
 	struct bio *bio;
 
 	set_user_nice(current, -20);
@@ -544,6 +794,17 @@ static int loop_thread(void *data)
 
 		if (bio_list_empty(&lo->lo_bio_list))
 			continue;
+
+		if (lo->lo_flags & LO_FLAGS_DIRECT_IO) {
+			spin_lock_irq(&lo->lo_lock);
+			batch = lo->lo_bio_list;
+			bio_list_init(&lo->lo_bio_list);
+			spin_unlock_irq(&lo->lo_lock);
+
+			loop_handle_batch(lo, &batch);
+			continue;
+		}
+
 		spin_lock_irq(&lo->lo_lock);
 		bio = loop_get_bio(lo);
 		spin_unlock_irq(&lo->lo_lock);
@@ -563,11 +824,23 @@ static int loop_thread(void *data)
 static int loop_switch(struct loop_device *lo, struct file *file)
 {
 	struct switch_request w;
-	struct bio *bio = bio_alloc(GFP_KERNEL, 0);
-	if (!bio)
-		return -ENOMEM;
+	struct bio *bio;
+
 	init_completion(&w.wait);
 	w.file = file;
+
+	/* workqueue mode: wait for queued bios, then switch directly */
+	if (lo->lo_wq) {
+		flush_workqueue(lo->lo_wq);
+		down_write(&lo->lo_wq_sem);
+		do_loop_switch(lo, &w);
+		up_write(&lo->lo_wq_sem);
+		return 0;
+	}
+
+	bio = bio_alloc(GFP_KERNEL, 0);
+	if (!bio)
+		return -ENOMEM;
 	bio->bi_private = &w;
 	bio->bi_bdev = NULL;
 	loop_make_request(lo->lo_queue, bio);
@@ -581,7 +854,7 @@ static int loop_switch(struct loop_device *lo, struct file *file)
 static int loop_flush(struct loop_device *lo)
 {
 	/* loop not yet configured, no running thread, nothing to flush */
-	if (!lo->lo_thread)
+	if (!lo->lo_thread && !lo->lo_wq)
 		return 0;
 
 	return loop_switch(lo, NULL);
@@ -743,11 +1016,25 @@ static ssize_t loop_attr_partscan_show(struct loop_device *lo, char *buf)
 	return sprintf(buf, "%s\n", partscan ? "1" : "0");
 }
 
+static ssize_t loop_attr_workers_show(struct loop_device *lo, char *buf)
+{
+	return sprintf(buf, "%d\n", lo->lo_workers);
+}
+
+static ssize_t loop_attr_dio_show(struct loop_device *lo, char *buf)
+{
+	int dio = (lo->lo_flags & LO_FLAGS_DIRECT_IO);
+
+	return sprintf(buf, "%s\n", dio ? "1" : "0");
+}
+
 LOOP_ATTR_RO(backing_file);
 LOOP_ATTR_RO(offset);
 LOOP_ATTR_RO(sizelimit);
 LOOP_ATTR_RO(autoclear);
 LOOP_ATTR_RO(partscan);
+LOOP_ATTR_RO(dio);
+LOOP_ATTR_RO(workers);
 
 static struct attribute *loop_attrs[] = {
 	&loop_attr_backing_file.attr,
@@ -755,6 +1042,8 @@ static struct attribute *loop_attrs[] = {
 	&loop_attr_sizelimit.attr,
 	&loop_attr_autoclear.attr,
 	&loop_attr_partscan.attr,
+	&loop_attr_dio.attr,
+	&loop_attr_workers.attr,
 	NULL,
 };
 
@@ -896,14 +1185,26 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 
 	set_blocksize(bdev, lo_blocksize);
 
-	lo->lo_thread = kthread_create(loop_thread, lo, "loop%d",
-						lo->lo_number);
-	if (IS_ERR(lo->lo_thread)) {
-		error = PTR_ERR(lo->lo_thread);
-		goto out_clr;
+	lo->lo_workers = max(ACCESS_ONCE(max_workers), 0);
+	if (lo->lo_workers) {
+		lo->lo_wq = alloc_workqueue("loop%d",
+					    WQ_MEM_RECLAIM | WQ_UNBOUND,
+					    lo->lo_workers, lo->lo_number);
+		if (!lo->lo_wq) {
+			error = -ENOMEM;
+			goto out_clr;
+		}
+		lo->lo_state = Lo_bound;
+	} else {
+		lo->lo_thread = kthread_create(loop_thread, lo, "loop%d",
+					       lo->lo_number);
+		if (IS_ERR(lo->lo_thread)) {
+			error = PTR_ERR(lo->lo_thread);
+			goto out_clr;
+		}
+		lo->lo_state = Lo_bound;
+		wake_up_process(lo->lo_thread);
 	}
-	lo->lo_state = Lo_bound;
-	wake_up_process(lo->lo_thread);
 	if (part_shift)
 		lo->lo_flags |= LO_FLAGS_PARTSCAN;
 	if (lo->lo_flags & LO_FLAGS_PARTSCAN)
@@ -913,6 +1214,7 @@ static int loop_set_fd(struct loop_device *lo, fmode_t mode,
 out_clr:
 	loop_sysfs_exit(lo);
 	lo->lo_thread = NULL;
+	lo->lo_workers = 0;
 	lo->lo_device = NULL;
 	lo->lo_backing_file = NULL;
 	lo->lo_flags = 0;
@@ -986,7 +1288,11 @@ static int loop_clr_fd(struct loop_device *lo)
 	lo->lo_state = Lo_rundown;
 	spin_unlock_irq(&lo->lo_lock);
 
-	kthread_stop(lo->lo_thread);
+	if (lo->lo_wq) {
+		destroy_workqueue(lo->lo_wq);
+		lo->lo_wq = NULL;
+	} else
+		kthread_stop(lo->lo_thread);
 
 	spin_lock_irq(&lo->lo_lock);
 	lo->lo_backing_file = NULL;
@@ -1001,6 +1307,7 @@ static int loop_clr_fd(struct loop_device *lo)
 	lo->lo_sizelimit = 0;
 	lo->lo_encrypt_key_size = 0;
 	lo->lo_thread = NULL;
+	lo->lo_workers = 0;
 	memset(lo->lo_encrypt_key, 0, LO_KEY_SIZE);
 	memset(lo->lo_crypt_name, 0, LO_NAME_SIZE);
 	memset(lo->lo_file_name, 0, LO_NAME_SIZE);
@@ -1048,6 +1355,10 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 		return -ENXIO;
 	if ((unsigned int) info->lo_encrypt_key_size > LO_KEY_SIZE)
 		return -EINVAL;
+	/* direct mode reads through ->readpage of the backing file */
+	if ((info->lo_flags & LO_FLAGS_DIRECT_IO) &&
+	    !lo->lo_backing_file->f_mapping->a_ops->readpage)
+		return -EINVAL;
 
 	err = loop_release_xfer(lo);
 	if (err)
@@ -1089,6 +1400,10 @@ loop_set_status(struct loop_device *lo, const struct loop_info64 *info)
 	     (info->lo_flags & LO_FLAGS_AUTOCLEAR))
 		lo->lo_flags ^= LO_FLAGS_AUTOCLEAR;
 
+	if ((lo->lo_flags & LO_FLAGS_DIRECT_IO) !=
+	     (info->lo_flags & LO_FLAGS_DIRECT_IO))
+		lo->lo_flags ^= LO_FLAGS_DIRECT_IO;
+
 	if ((info->lo_flags & LO_FLAGS_PARTSCAN) &&
 	     !(lo->lo_flags & LO_FLAGS_PARTSCAN)) {
 		lo->lo_flags |= LO_FLAGS_PARTSCAN;
@@ -1662,6 +1977,7 @@ static int loop_add(struct loop_device **l, int i)
 	lo->lo_number		= i;
 	lo->lo_thread		= NULL;
 	init_waitqueue_head(&lo->lo_event);
+	init_rwsem(&lo->lo_wq_sem);
 	spin_lock_init(&lo->lo_lock);
 	disk->major		= LOOP_MAJOR;
 	disk->first_minor	= i << part_shift;
@@ -1818,9 +2134,14 @@ static int __init loop_init(void)
 	struct loop_device *lo;
 	int err;
 
+	loop_cmd_pool = mempool_create_kmalloc_pool(LOOP_MIN_CMDS,
+						    sizeof(struct loop_cmd));
+	if (!loop_cmd_pool)
+		return -ENOMEM;
+
 	err = misc_register(&loop_misc);
 	if (err < 0)
-		return err;
+		goto out_pool;
 
 	part_shift = 0;
 	if (max_part > 0) {
@@ -1837,11 +2158,12 @@ static int __init loop_init(void)
 		max_part = (1UL << part_shift) - 1;
 	}
 
+	err = -EINVAL;
 	if ((1UL << part_shift) > DISK_MAX_PARTS)
-		return -EINVAL;
+		goto out_misc;
 
 	if (max_loop > 1UL << (MINORBITS - part_shift))
-		return -EINVAL;
+		goto out_misc;
 
 	/*
 	 * If max_loop is specified, create that many devices upfront.
@@ -1859,8 +2181,9 @@ static int __init loop_init(void)
 		range = 1UL << MINORBITS;
 	}
 
+	err = -EIO;
 	if (register_blkdev(LOOP_MAJOR, "loop"))
-		return -EIO;
+		goto out_misc;
 
 	blk_register_region(MKDEV(LOOP_MAJOR, 0), range,
 				  THIS_MODULE, loop_probe, NULL, NULL);
@@ -1873,6 +2196,12 @@ static int __init loop_init(void)
 
 	printk(KERN_INFO "loop: module loaded\n");
 	return 0;
+
+out_misc:
+	misc_deregister(&loop_misc);
+out_pool:
+	mempool_destroy(loop_cmd_pool);
+	return err;
 }
 
 static int loop_exit_cb(int id, void *ptr, void *data)
@@ -1897,6 +2226,7 @@ static void __exit loop_exit(void)
 	unregister_blkdev(LOOP_MAJOR, "loop");
 
 	misc_deregister(&loop_misc);
+	mempool_destroy(loop_cmd_pool);
 }
 
 module_init(loop_init);
@@ -0,0 +1,252 @@
+/*
+ * Null block device
+ *
+ * A block device without storage: every read and write succeeds at once
+ * and no data is moved.  What is left is the cost of the block layer
+ * itself, which the queue_mode parameter selects: plain bios, the
+ * request_fn queue, or the multiqueue block layer.  Running the same
+ * load against each shows what the submission path costs.
+ *
+ * This file is released under the GPL.
+ */
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/fs.h>
+#include <linux/genhd.h>
+#include <linux/init.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+enum {
+	NULL_Q_BIO		= 0,
+	NULL_Q_RQ		= 1,
+	NULL_Q_MQ		= 2,
+
+	NULL_IRQ_NONE		= 0,
+	NULL_IRQ_SOFTIRQ	= 1,
+};
+
+struct nullb {
+	struct list_head list;
+	unsigned int index;
+	struct request_queue *q;
+	struct gendisk *disk;
+	spinlock_t lock;	/* queue_lock of NULL_Q_RQ */
+};
+
+static LIST_HEAD(nullb_list);
+static DEFINE_MUTEX(nullb_lock);
+static int null_major;
+
+static int queue_mode = NULL_Q_MQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "0 for bios, 1 for request_fn, 2 for multiqueue (default)");
+
+static int irqmode = NULL_IRQ_SOFTIRQ;
+module_param(irqmode, int, S_IRUGO);
+MODULE_PARM_DESC(irqmode, "Complete requests 0: when queued, 1: from softirq (default)");
+
+static unsigned int submit_queues = 1;
+module_param(submit_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Hardware queues of a multiqueue device (default 1)");
+
+static unsigned int hw_queue_depth = 64;
+module_param(hw_queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Requests per hardware queue (default 64)");
+
+static unsigned int nr_devices = 2;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of devices (default 2)");
+
+static unsigned int gb = 250;
+module_param(gb, uint, S_IRUGO);
+MODULE_PARM_DESC(gb, "Size of each device in GiB (default 250)");
+
+static unsigned int bs = 512;
+module_param(bs, uint, S_IRUGO);
+MODULE_PARM_DESC(bs, "Logical block size (default 512)");
+
+static void null_queue_bio(struct request_queue *q, struct bio *bio)
+{
+	bio_endio(bio, 0);
+}
+
+static void null_request_fn(struct request_queue *q)
+{
+	struct request *rq;
+
+	while ((rq = blk_fetch_request(q)) != NULL) {
+		if (irqmode == NULL_IRQ_SOFTIRQ) {
+			spin_unlock_irq(q->queue_lock);
+			blk_complete_request(rq);
+			spin_lock_irq(q->queue_lock);
+		} else {
+			__blk_end_request_all(rq, 0);
+		}
+	}
+}
+
+static void null_softirq_done_fn(struct request *rq)
+{
+	if (rq->q->mq_ops)
+		blk_mq_end_io(rq, 0);
+	else
+		blk_end_request_all(rq, 0);
+}
+
+static int null_queue_rq(struct blk_mq_hw_ctx *hctx, struct request *rq)
+{
+	if (irqmode == NULL_IRQ_SOFTIRQ)
+		blk_complete_request(rq);
+	else
+		blk_mq_end_io(rq, 0);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+static struct blk_mq_ops null_mq_ops = {
+	.queue_rq	= null_queue_rq,
+};
+
+static const struct block_device_operations null_fops = {
+	.owner		= THIS_MODULE,
+};
+
+static struct request_queue *null_alloc_queue(struct nullb *nullb)
+{
+	struct blk_mq_reg reg;
+	struct request_queue *q;
+
+	switch (queue_mode) {
+	case NULL_Q_MQ:
+		memset(&reg, 0, sizeof(reg));
+		reg.ops = &null_mq_ops;
+		reg.nr_hw_queues = submit_queues;
+		reg.queue_depth = hw_queue_depth;
+		reg.numa_node = NUMA_NO_NODE;
+		q = blk_mq_init_queue(&reg, nullb);
+		if (IS_ERR(q))
+			return NULL;
+		blk_queue_softirq_done(q, null_softirq_done_fn);
+		return q;
+	case NULL_Q_RQ:
+		q = blk_init_queue_node(null_request_fn, &nullb->lock,
+					NUMA_NO_NODE);
+		if (q)
+			blk_queue_softirq_done(q, null_softirq_done_fn);
+		return q;
+	default:
+		q = blk_alloc_queue_node(GFP_KERNEL, NUMA_NO_NODE);
+		if (q)
+			blk_queue_make_request(q, null_queue_bio);
+		return q;
+	}
+}
+
+static int null_add_dev(unsigned int index)
+{
+	struct gendisk *disk;
+	struct nullb *nullb;
+	sector_t size;
+
+	nullb = kzalloc(sizeof(*nullb), GFP_KERNEL);
+	if (!nullb)
+		return -ENOMEM;
+	spin_lock_init(&nullb->lock);
+	nullb->index = index;
+
+	nullb->q = null_alloc_queue(nullb);
+	if (!nullb->q)
+		goto out_free;
+	nullb->q->queuedata = nullb;
+	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, nullb->q);
+	blk_queue_logical_block_size(nullb->q, bs);
+	blk_queue_physical_block_size(nullb->q, bs);
+
+	disk = nullb->disk = alloc_disk(1);
+	if (!disk)
+		goto out_cleanup;
+
+	size = (sector_t)gb << (30 - 9);
+	set_capacity(disk, size);
+
+	disk->flags |= GENHD_FL_EXT_DEVT;
+	disk->major = null_major;
+	disk->first_minor = index;
+	disk->fops = &null_fops;
+	disk->private_data = nullb;
+	disk->queue = nullb->q;
+	sprintf(disk->disk_name, "nullb%u", index);
+	add_disk(disk);
+
+	mutex_lock(&nullb_lock);
+	list_add_tail(&nullb->list, &nullb_list);
+	mutex_unlock(&nullb_lock);
+	return 0;
+
+out_cleanup:
+	blk_cleanup_queue(nullb->q);
+out_free:
+	kfree(nullb);
+	return -ENOMEM;
+}
+
+static void null_del_dev(struct nullb *nullb)
+{
+	list_del(&nullb->list);
+	del_gendisk(nullb->disk);
+	blk_cleanup_queue(nullb->q);
+	put_disk(nullb->disk);
+	kfree(nullb);
+}
+
+static void null_exit(void)
+{
+	struct nullb *nullb, *next;
+
+	mutex_lock(&nullb_lock);
+	list_for_each_entry_safe(nullb, next, &nullb_list, list)
+		null_del_dev(nullb);
+	mutex_unlock(&nullb_lock);
+
+	unregister_blkdev(null_major, "nullb");
+}
+
+static int __init null_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	if (bs < 512 || bs > PAGE_SIZE || !is_power_of_2(bs)) {
+		pr_err("null_blk: invalid block size %u\n", bs);
+		return -EINVAL;
+	}
+	if (queue_mode < NULL_Q_BIO || queue_mode > NULL_Q_MQ ||
+	    irqmode < NULL_IRQ_NONE || irqmode > NULL_IRQ_SOFTIRQ)
+		return -EINVAL;
+
+	null_major = register_blkdev(0, "nullb");
+	if (null_major < 0)
+		return null_major;
+
+	for (i = 0; i < nr_devices; i++) {
+		ret = null_add_dev(i);
+		if (ret) {
+			null_exit();
+			return ret;
+		}
+	}
+
+	pr_info("null_blk: %u devices, queue mode %d\n", nr_devices, queue_mode);
+	return 0;
+}
+
+module_init(null_init);
+module_exit(null_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Null block device for block layer benchmarks");
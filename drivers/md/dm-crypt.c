@@ -13,9 +13,12 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/kthread.h>
 #include <linux/mempool.h>
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/crypto.h>
+#include <linux/rbtree.h>
 #include <linux/workqueue.h>
 #include <linux/backing-dev.h>
 #include <asm/atomic.h>
@@ -40,6 +43,10 @@ struct convert_context {
 	unsigned int idx_out;
 	sector_t sector;
 	atomic_t pending;
+
+	/* transform used for this conversion and the next request to send */
+	struct crypto_ablkcipher *tfm;
+	struct ablkcipher_request *req;
 };
 
 /*
@@ -58,6 +65,15 @@ struct dm_crypt_io {
 	struct dm_crypt_io *base_io;
 };
 
+/*
+ * Every clone is allocated with an rb_node in front of it, used to sort
+ * encrypted writes by sector in cc->write_tree.
+ */
+struct dm_crypt_clone {
+	struct rb_node rb_node;
+	struct bio bio;
+};
+
 struct dm_crypt_request {
 	struct convert_context *ctx;
 	struct scatterlist sg_in;
@@ -85,6 +101,27 @@ struct iv_benbi_private {
 	int shift;
 };
 
+/*
+ * Per-CPU state.  Every CPU has its own copy of the cipher transform so that
+ * conversions running in parallel don't share the cipher context.  Any of
+ * the transforms may be used from any CPU; the local one is just cache hot.
+ */
+struct crypt_cpu {
+	struct crypto_ablkcipher *tfm;
+};
+
+/*
+ * Where kcryptd runs:
+ * SINGLE_THREAD: one thread for the whole device (default)
+ * SAME_CPU: on the CPU that queued the work
+ * ANY_CPU: on any online CPU, picked by the scheduler
+ */
+enum crypt_mode {
+	DM_CRYPT_SINGLE_THREAD,
+	DM_CRYPT_SAME_CPU,
+	DM_CRYPT_ANY_CPU,
+};
+
 /*
  * Crypt: maps a linear range of a block device
  * and encrypts / decrypts at the same time.
@@ -105,6 +142,16 @@ struct crypt_config {
 
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
+	enum crypt_mode crypt_mode;
+
+	/*
+	 * Encrypted write clones waiting for submission, sorted by sector.
+	 * write_thread takes the whole tree at once and submits it in order.
+	 */
+	struct task_struct *write_thread;
+	wait_queue_head_t write_wait;
+	spinlock_t write_lock;
+	struct rb_root write_tree;
 
 	char *cipher;
 	char *cipher_string;
@@ -131,9 +178,8 @@ struct crypt_config {
 	 * correctly aligned.
 	 */
 	unsigned int dmreq_start;
-	struct ablkcipher_request *req;
 
-	struct crypto_ablkcipher *tfm;
+	struct crypt_cpu __percpu *cpu;
 	unsigned long flags;
 	unsigned int key_size;
 	u8 key[0];
@@ -147,6 +193,15 @@ static struct kmem_cache *_crypt_io_pool;
 static void clone_init(struct dm_crypt_io *, struct bio *);
 static void kcryptd_queue_crypt(struct dm_crypt_io *io);
 
+/*
+ * The transform of the current CPU.  The caller may be preempted and moved
+ * to another CPU afterwards, which is harmless.
+ */
+static struct crypto_ablkcipher *any_tfm(struct crypt_config *cc)
+{
+	return per_cpu_ptr(cc->cpu, raw_smp_processor_id())->tfm;
+}
+
 /*
  * Different IV generation algorithms:
  *
@@ -268,7 +323,7 @@ static int crypt_iv_essiv_ctr(struct crypt_config *cc, struct dm_target *ti,
 		goto bad;
 	}
 	if (crypto_cipher_blocksize(essiv_tfm) !=
-	    crypto_ablkcipher_ivsize(cc->tfm)) {
+	    crypto_ablkcipher_ivsize(any_tfm(cc))) {
 		ti->error = "Block size of ESSIV cipher does "
 			    "not match IV size of block cipher";
 		err = -EINVAL;
@@ -301,7 +356,7 @@ static int crypt_iv_essiv_gen(struct crypt_config *cc, u8 *iv, sector_t sector)
 static int crypt_iv_benbi_ctr(struct crypt_config *cc, struct dm_target *ti,
 			      const char *opts)
 {
-	unsigned bs = crypto_ablkcipher_blocksize(cc->tfm);
+	unsigned bs = crypto_ablkcipher_blocksize(any_tfm(cc));
 	int log = ilog2(bs);
 
 	/* we need to calculate how far we must shift the sector count
@@ -383,6 +438,8 @@ static void crypt_convert_init(struct crypt_config *cc,
 	ctx->idx_in = bio_in ? bio_in->bi_idx : 0;
 	ctx->idx_out = bio_out ? bio_out->bi_idx : 0;
 	ctx->sector = sector + cc->iv_offset;
+	ctx->tfm = any_tfm(cc);
+	ctx->req = NULL;
 	init_completion(&ctx->restart);
 }
 
@@ -410,7 +467,7 @@ static int crypt_convert_block(struct crypt_config *cc,
 
 	dmreq = dmreq_of_req(cc, req);
 	iv = (u8 *)ALIGN((unsigned long)(dmreq + 1),
-			 crypto_ablkcipher_alignmask(cc->tfm) + 1);
+			 crypto_ablkcipher_alignmask(ctx->tfm) + 1);
 
 	dmreq->ctx = ctx;
 	sg_init_table(&dmreq->sg_in, 1);
@@ -455,13 +512,13 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 static void crypt_alloc_req(struct crypt_config *cc,
 			    struct convert_context *ctx)
 {
-	if (!cc->req)
-		cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
-	ablkcipher_request_set_tfm(cc->req, cc->tfm);
-	ablkcipher_request_set_callback(cc->req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+	if (!ctx->req)
+		ctx->req = mempool_alloc(cc->req_pool, GFP_NOIO);
+	ablkcipher_request_set_tfm(ctx->req, ctx->tfm);
+	ablkcipher_request_set_callback(ctx->req, CRYPTO_TFM_REQ_MAY_BACKLOG |
 					CRYPTO_TFM_REQ_MAY_SLEEP,
 					kcryptd_async_done,
-					dmreq_of_req(cc, cc->req));
+					dmreq_of_req(cc, ctx->req));
 }
 
 /*
@@ -481,7 +538,7 @@ static int crypt_convert(struct crypt_config *cc,
 
 		atomic_inc(&ctx->pending);
 
-		r = crypt_convert_block(cc, ctx, cc->req);
+		r = crypt_convert_block(cc, ctx, ctx->req);
 
 		switch (r) {
 		/* async */
@@ -490,7 +547,7 @@ static int crypt_convert(struct crypt_config *cc,
 			INIT_COMPLETION(ctx->restart);
 			/* fall through*/
 		case -EINPROGRESS:
-			cc->req = NULL;
+			ctx->req = NULL;
 			ctx->sector++;
 			continue;
 
@@ -504,11 +561,19 @@ static int crypt_convert(struct crypt_config *cc,
 		/* error */
 		default:
 			atomic_dec(&ctx->pending);
-			return r;
+			goto out;
 		}
 	}
+	r = 0;
 
-	return 0;
+out:
+	/* the last request was not handed to the cipher */
+	if (ctx->req) {
+		mempool_free(ctx->req, cc->req_pool);
+		ctx->req = NULL;
+	}
+
+	return r;
 }
 
 static void dm_crypt_bio_destructor(struct bio *bio)
@@ -643,11 +708,25 @@ static void crypt_dec_pending(struct dm_crypt_io *io)
  *
  * kcryptd performs the actual encryption or decryption.
  *
- * kcryptd_io performs the IO submission.
+ * kcryptd_io submits reads for which crypt_map could not allocate a
+ * clone without blocking.
  *
  * They must be separated as otherwise the final stages could be
  * starved by new requests which can block in the first stages due
  * to memory allocation.
+ *
+ * dmcrypt_write submits encrypted writes.  Writes finish encryption in
+ * random order; it collects them, sorted by sector, and submits each batch
+ * under one plug so that the elevator can merge them into sequential runs.
+ *
+ * With "same_cpu_crypt" or "any_cpu_crypt" several bios are converted at
+ * once and their clones may be submitted in a different order than the
+ * bios arrived.  This is allowed: the base bio is only completed once all
+ * its clones are, and clones keep the REQ_FUA bit of the base bio.  Nothing
+ * drains the bios in flight before a REQ_FLUSH, which device-mapper clones
+ * to the target straight away, and nothing needs to: a flush only has to
+ * cover the writes that had completed when it was issued, and a write is
+ * not completed before all of its clones are on the device.
  */
 static void crypt_endio(struct bio *clone, int error)
 {
@@ -688,25 +767,26 @@ static void clone_init(struct dm_crypt_io *io, struct bio *clone)
 	clone->bi_destructor = dm_crypt_bio_destructor;
 }
 
-static void kcryptd_io_read(struct dm_crypt_io *io)
+/*
+ * Submit the read clone of an io.  Returns nonzero if the clone could not be
+ * allocated with the given gfp mask.
+ */
+static int kcryptd_io_read(struct dm_crypt_io *io, gfp_t gfp)
 {
 	struct crypt_config *cc = io->target->private;
 	struct bio *base_bio = io->base_bio;
 	struct bio *clone;
 
-	crypt_inc_pending(io);
-
 	/*
 	 * The block layer might modify the bvec array, so always
 	 * copy the required bvecs because we need the original
 	 * one in order to decrypt the whole bio data *afterwards*.
 	 */
-	clone = bio_alloc_bioset(GFP_NOIO, bio_segments(base_bio), cc->bs);
-	if (unlikely(!clone)) {
-		io->error = -ENOMEM;
-		crypt_dec_pending(io);
-		return;
-	}
+	clone = bio_alloc_bioset(gfp, bio_segments(base_bio), cc->bs);
+	if (unlikely(!clone))
+		return 1;
+
+	crypt_inc_pending(io);
 
 	clone_init(io, clone);
 	clone->bi_idx = 0;
@@ -717,22 +797,17 @@ static void kcryptd_io_read(struct dm_crypt_io *io)
 	       sizeof(struct bio_vec) * clone->bi_vcnt);
 
 	generic_make_request(clone);
-}
-
-static void kcryptd_io_write(struct dm_crypt_io *io)
-{
-	struct bio *clone = io->ctx.bio_out;
-	generic_make_request(clone);
+	return 0;
 }
 
 static void kcryptd_io(struct work_struct *work)
 {
 	struct dm_crypt_io *io = container_of(work, struct dm_crypt_io, work);
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_io_read(io);
-	else
-		kcryptd_io_write(io);
+	crypt_inc_pending(io);
+	if (kcryptd_io_read(io, GFP_NOIO))
+		io->error = -ENOMEM;
+	crypt_dec_pending(io);
 }
 
 static void kcryptd_queue_io(struct dm_crypt_io *io)
@@ -743,7 +818,78 @@ static void kcryptd_queue_io(struct dm_crypt_io *io)
 	queue_work(cc->io_queue, &io->work);
 }
 
-static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io, int async)
+static struct dm_crypt_clone *crypt_clone(struct bio *clone)
+{
+	return container_of(clone, struct dm_crypt_clone, bio);
+}
+
+static int dmcrypt_write(void *data)
+{
+	struct crypt_config *cc = data;
+	struct dm_crypt_clone *c;
+	struct rb_root write_tree;
+	struct blk_plug plug;
+
+	for (;;) {
+		wait_event_interruptible(cc->write_wait,
+					 !RB_EMPTY_ROOT(&cc->write_tree) ||
+					 kthread_should_stop());
+
+		spin_lock_irq(&cc->write_lock);
+		write_tree = cc->write_tree;
+		cc->write_tree = RB_ROOT;
+		spin_unlock_irq(&cc->write_lock);
+
+		if (RB_EMPTY_ROOT(&write_tree)) {
+			if (kthread_should_stop())
+				break;
+			continue;
+		}
+
+		blk_start_plug(&plug);
+		do {
+			c = rb_entry(rb_first(&write_tree),
+				     struct dm_crypt_clone, rb_node);
+			rb_erase(&c->rb_node, &write_tree);
+			generic_make_request(&c->bio);
+		} while (!RB_EMPTY_ROOT(&write_tree));
+		blk_finish_plug(&plug);
+	}
+
+	return 0;
+}
+
+/*
+ * Queue an encrypted clone for dmcrypt_write.  May be called from the
+ * completion of an asynchronous cipher.
+ *
+ * A REQ_FLUSH may overtake the clones waiting here.  That is fine: their
+ * base bios have not completed, so the flush doesn't have to cover them.
+ */
+static void crypt_queue_write(struct crypt_config *cc, struct bio *clone)
+{
+	struct dm_crypt_clone *c = crypt_clone(clone);
+	struct rb_node **rbp, *parent = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cc->write_lock, flags);
+	rbp = &cc->write_tree.rb_node;
+	while (*rbp) {
+		parent = *rbp;
+		if (clone->bi_sector <
+		    rb_entry(parent, struct dm_crypt_clone, rb_node)->bio.bi_sector)
+			rbp = &parent->rb_left;
+		else
+			rbp = &parent->rb_right;
+	}
+	rb_link_node(&c->rb_node, parent, rbp);
+	rb_insert_color(&c->rb_node, &cc->write_tree);
+	spin_unlock_irqrestore(&cc->write_lock, flags);
+
+	wake_up(&cc->write_wait);
+}
+
+static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io)
 {
 	struct bio *clone = io->ctx.bio_out;
 	struct crypt_config *cc = io->target->private;
@@ -760,10 +906,7 @@ static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io, int async)
 
 	clone->bi_sector = cc->start + io->sector;
 
-	if (async)
-		kcryptd_queue_io(io);
-	else
-		generic_make_request(clone);
+	crypt_queue_write(cc, clone);
 }
 
 static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
@@ -810,7 +953,7 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 
 		/* Encryption was already finished, submit io now */
 		if (crypt_finished) {
-			kcryptd_crypt_write_io_submit(io, 0);
+			kcryptd_crypt_write_io_submit(io);
 
 			/*
 			 * If there was an error, do not try next fragments.
@@ -907,7 +1050,7 @@ static void kcryptd_async_done(struct crypto_async_request *async_req,
 	if (bio_data_dir(io->base_bio) == READ)
 		kcryptd_crypt_read_done(io);
 	else
-		kcryptd_crypt_write_io_submit(io, 1);
+		kcryptd_crypt_write_io_submit(io);
 }
 
 static void kcryptd_crypt(struct work_struct *work)
@@ -969,6 +1112,59 @@ static void crypt_encode_key(char *hex, u8 *key, unsigned int size)
 	}
 }
 
+static int crypt_setkey_allcpus(struct crypt_config *cc)
+{
+	int cpu, err = 0, r;
+
+	for_each_possible_cpu(cpu) {
+		r = crypto_ablkcipher_setkey(per_cpu_ptr(cc->cpu, cpu)->tfm,
+					     cc->key, cc->key_size);
+		if (r)
+			err = r;
+	}
+
+	return err;
+}
+
+static void crypt_free_tfms(struct crypt_config *cc)
+{
+	struct crypto_ablkcipher *tfm;
+	int cpu;
+
+	if (!cc->cpu)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		tfm = per_cpu_ptr(cc->cpu, cpu)->tfm;
+		if (tfm && !IS_ERR(tfm))
+			crypto_free_ablkcipher(tfm);
+	}
+
+	free_percpu(cc->cpu);
+	cc->cpu = NULL;
+}
+
+static int crypt_alloc_tfms(struct crypt_config *cc, char *ciphermode)
+{
+	struct crypto_ablkcipher *tfm;
+	int cpu;
+
+	cc->cpu = alloc_percpu(struct crypt_cpu);
+	if (!cc->cpu)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		tfm = crypto_alloc_ablkcipher(ciphermode, 0, 0);
+		if (IS_ERR(tfm)) {
+			crypt_free_tfms(cc);
+			return PTR_ERR(tfm);
+		}
+		per_cpu_ptr(cc->cpu, cpu)->tfm = tfm;
+	}
+
+	return 0;
+}
+
 static int crypt_set_key(struct crypt_config *cc, char *key)
 {
 	/* The key size may not be changed. */
@@ -984,14 +1180,14 @@ static int crypt_set_key(struct crypt_config *cc, char *key)
 
 	set_bit(DM_CRYPT_KEY_VALID, &cc->flags);
 
-	return crypto_ablkcipher_setkey(cc->tfm, cc->key, cc->key_size);
+	return crypt_setkey_allcpus(cc);
 }
 
 static int crypt_wipe_key(struct crypt_config *cc)
 {
 	clear_bit(DM_CRYPT_KEY_VALID, &cc->flags);
 	memset(&cc->key, 0, cc->key_size * sizeof(u8));
-	return crypto_ablkcipher_setkey(cc->tfm, cc->key, cc->key_size);
+	return crypt_setkey_allcpus(cc);
 }
 
 static void crypt_dtr(struct dm_target *ti)
@@ -1003,6 +1199,9 @@ static void crypt_dtr(struct dm_target *ti)
 	if (!cc)
 		return;
 
+	if (cc->write_thread)
+		kthread_stop(cc->write_thread);
+
 	if (cc->io_queue)
 		destroy_workqueue(cc->io_queue);
 	if (cc->crypt_queue)
@@ -1021,8 +1220,7 @@ static void crypt_dtr(struct dm_target *ti)
 	if (cc->iv_gen_ops && cc->iv_gen_ops->dtr)
 		cc->iv_gen_ops->dtr(cc);
 
-	if (cc->tfm && !IS_ERR(cc->tfm))
-		crypto_free_ablkcipher(cc->tfm);
+	crypt_free_tfms(cc);
 
 	if (cc->dev)
 		dm_put_device(ti, cc->dev);
@@ -1096,9 +1294,8 @@ static int crypt_ctr_cipher(struct dm_target *ti,
 	}
 
 	/* Allocate cipher */
-	cc->tfm = crypto_alloc_ablkcipher(cipher_api, 0, 0);
-	if (IS_ERR(cc->tfm)) {
-		ret = PTR_ERR(cc->tfm);
+	ret = crypt_alloc_tfms(cc, cipher_api);
+	if (ret < 0) {
 		ti->error = "Error allocating crypto tfm";
 		goto bad;
 	}
@@ -1111,7 +1308,7 @@ static int crypt_ctr_cipher(struct dm_target *ti,
 	}
 
 	/* Initialize IV */
-	cc->iv_size = crypto_ablkcipher_ivsize(cc->tfm);
+	cc->iv_size = crypto_ablkcipher_ivsize(any_tfm(cc));
 	if (cc->iv_size)
 		/* at least a 64 bit sector number should fit in our buffer */
 		cc->iv_size = max(cc->iv_size,
@@ -1168,9 +1365,38 @@ bad_mem:
 	return -ENOMEM;
 }
 
+static int crypt_alloc_queues(struct crypt_config *cc)
+{
+	switch (cc->crypt_mode) {
+	case DM_CRYPT_SINGLE_THREAD:
+		cc->io_queue = create_singlethread_workqueue("kcryptd_io");
+		cc->crypt_queue = create_singlethread_workqueue("kcryptd");
+		break;
+	case DM_CRYPT_SAME_CPU:
+		cc->io_queue = alloc_workqueue("kcryptd_io",
+					       WQ_NON_REENTRANT |
+					       WQ_MEM_RECLAIM, 1);
+		cc->crypt_queue = alloc_workqueue("kcryptd",
+						  WQ_NON_REENTRANT |
+						  WQ_CPU_INTENSIVE |
+						  WQ_MEM_RECLAIM, 1);
+		break;
+	case DM_CRYPT_ANY_CPU:
+		cc->io_queue = alloc_workqueue("kcryptd_io",
+					       WQ_NON_REENTRANT |
+					       WQ_MEM_RECLAIM, 1);
+		cc->crypt_queue = alloc_workqueue("kcryptd",
+						  WQ_UNBOUND | WQ_MEM_RECLAIM,
+						  num_online_cpus());
+		break;
+	}
+
+	return cc->io_queue && cc->crypt_queue ? 0 : -ENOMEM;
+}
+
 /*
  * Construct an encryption mapping:
- * <cipher> <key> <iv_offset> <dev_path> <start>
+ * <cipher> <key> <iv_offset> <dev_path> <start> [<#opt_params> <opt_params>]
  */
 static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
@@ -1183,7 +1409,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	char dummy;
 
 	static struct dm_arg _args[] = {
-		{0, 1, "Invalid number of feature args"},
+		{0, 2, "Invalid number of feature args"},
 	};
 
 	if (argc < 5) {
@@ -1213,9 +1439,9 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 
 	cc->dmreq_start = sizeof(struct ablkcipher_request);
-	cc->dmreq_start += crypto_ablkcipher_reqsize(cc->tfm);
+	cc->dmreq_start += crypto_ablkcipher_reqsize(any_tfm(cc));
 	cc->dmreq_start = ALIGN(cc->dmreq_start, crypto_tfm_ctx_alignment());
-	cc->dmreq_start += crypto_ablkcipher_alignmask(cc->tfm) &
+	cc->dmreq_start += crypto_ablkcipher_alignmask(any_tfm(cc)) &
 			   ~(crypto_tfm_ctx_alignment() - 1);
 
 	cc->req_pool = mempool_create_kmalloc_pool(MIN_IOS, cc->dmreq_start +
@@ -1224,7 +1450,6 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		ti->error = "Cannot allocate crypt request mempool";
 		goto bad;
 	}
-	cc->req = NULL;
 
 	cc->page_pool = mempool_create_page_pool(MIN_POOL_PAGES, 0);
 	if (!cc->page_pool) {
@@ -1232,7 +1457,7 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
-	cc->bs = bioset_create(MIN_IOS, 0);
+	cc->bs = bioset_create(MIN_IOS, offsetof(struct dm_crypt_clone, bio));
 	if (!cc->bs) {
 		ti->error = "Cannot allocate crypt bioset";
 		goto bad;
@@ -1268,28 +1493,39 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		if (ret)
 			goto bad;
 
-		opt_string = dm_shift_arg(&as);
-
-		if (opt_params == 1 && opt_string &&
-		    !strcasecmp(opt_string, "allow_discards"))
-			ti->num_discard_requests = 1;
-		else if (opt_params) {
-			ret = -EINVAL;
-			ti->error = "Invalid feature arguments";
-			goto bad;
+		while (opt_params--) {
+			opt_string = dm_shift_arg(&as);
+
+			if (!strcasecmp(opt_string, "allow_discards"))
+				ti->num_discard_requests = 1;
+			else if (!strcasecmp(opt_string, "same_cpu_crypt") &&
+				 cc->crypt_mode == DM_CRYPT_SINGLE_THREAD)
+				cc->crypt_mode = DM_CRYPT_SAME_CPU;
+			else if (!strcasecmp(opt_string, "any_cpu_crypt") &&
+				 cc->crypt_mode == DM_CRYPT_SINGLE_THREAD)
+				cc->crypt_mode = DM_CRYPT_ANY_CPU;
+			else {
+				ret = -EINVAL;
+				ti->error = "Invalid feature arguments";
+				goto bad;
+			}
 		}
 	}
 
-	ret = -ENOMEM;
-	cc->io_queue = create_singlethread_workqueue("kcryptd_io");
-	if (!cc->io_queue) {
-		ti->error = "Couldn't create kcryptd io queue";
+	ret = crypt_alloc_queues(cc);
+	if (ret < 0) {
+		ti->error = "Couldn't create kcryptd queues";
 		goto bad;
 	}
 
-	cc->crypt_queue = create_singlethread_workqueue("kcryptd");
-	if (!cc->crypt_queue) {
-		ti->error = "Couldn't create kcryptd queue";
+	init_waitqueue_head(&cc->write_wait);
+	spin_lock_init(&cc->write_lock);
+	cc->write_tree = RB_ROOT;
+	cc->write_thread = kthread_run(dmcrypt_write, cc, "dmcrypt_write");
+	if (IS_ERR(cc->write_thread)) {
+		ret = PTR_ERR(cc->write_thread);
+		cc->write_thread = NULL;
+		ti->error = "Couldn't spawn write thread";
 		goto bad;
 	}
 
@@ -1311,7 +1547,8 @@ static int crypt_map(struct dm_target *ti, struct bio *bio,
 
 	/*
 	 * If bio is REQ_FLUSH or REQ_DISCARD, just bypass crypt queues.
-	 * - for REQ_FLUSH device-mapper core ensures that no IO is in-flight
+	 * - REQ_FLUSH only covers writes already completed, and those are
+	 *   no longer in the queues
 	 * - for REQ_DISCARD caller must use flush if IO ordering matters
 	 */
 	if (unlikely(bio->bi_rw & (REQ_FLUSH | REQ_DISCARD))) {
@@ -1324,9 +1561,11 @@ static int crypt_map(struct dm_target *ti, struct bio *bio,
 
 	io = crypt_io_alloc(ti, bio, dm_target_offset(ti, bio->bi_sector));
 
-	if (bio_data_dir(io->base_bio) == READ)
-		kcryptd_queue_io(io);
-	else
+	/* reads are submitted right away unless that would have to wait */
+	if (bio_data_dir(io->base_bio) == READ) {
+		if (kcryptd_io_read(io, GFP_NOWAIT))
+			kcryptd_queue_io(io);
+	} else
 		kcryptd_queue_crypt(io);
 
 	return DM_MAPIO_SUBMITTED;
@@ -1336,7 +1575,7 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 			char *result, unsigned int maxlen)
 {
 	struct crypt_config *cc = ti->private;
-	unsigned int sz = 0;
+	unsigned int sz = 0, opt_params;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
@@ -1361,8 +1600,16 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 		DMEMIT(" %llu %s %llu", (unsigned long long)cc->iv_offset,
 				cc->dev->name, (unsigned long long)cc->start);
 
+		opt_params = !!ti->num_discard_requests +
+			     (cc->crypt_mode != DM_CRYPT_SINGLE_THREAD);
+		if (opt_params)
+			DMEMIT(" %u", opt_params);
 		if (ti->num_discard_requests)
-			DMEMIT(" 1 allow_discards");
+			DMEMIT(" allow_discards");
+		if (cc->crypt_mode == DM_CRYPT_SAME_CPU)
+			DMEMIT(" same_cpu_crypt");
+		else if (cc->crypt_mode == DM_CRYPT_ANY_CPU)
+			DMEMIT(" any_cpu_crypt");
 
 		break;
 	}
@@ -1460,7 +1707,7 @@ static int crypt_iterate_devices(struct dm_target *ti,
 
 static struct target_type crypt_target = {
 	.name   = "crypt",
-	.version = {1, 8, 0},
+	.version = {1, 10, 0},
 	.module = THIS_MODULE,
 	.ctr    = crypt_ctr,
 	.dtr    = crypt_dtr,
@@ -12,12 +12,25 @@
  * hash device. Setting this greatly improves performance when data and hash
  * are on the same disk on different partitions on devices with poor random
  * access behavior.
+ *
+ * In the file "/sys/module/dm_verity/parameters/parallel_blocks" you can set
+ * the smallest number of data blocks hashed by one CPU.  Bios of at least
+ * twice that many blocks are split into chunks verified on different CPUs.
+ * Zero verifies every bio on a single CPU.
+ *
+ * In the file "/sys/module/dm_verity/parameters/bitmap_limit" you can set
+ * the most memory, in bytes, a newly created "check_at_most_once" target
+ * may use for the bitmaps of blocks already verified.  Bitmaps that don't
+ * fit are not allocated.
  */
 
 #include "dm-bufio.h"
 
 #include <linux/module.h>
 #include <linux/device-mapper.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
 #include <crypto/hash.h>
 
 #define DM_MSG_PREFIX			"verity"
@@ -25,13 +38,41 @@
 #define DM_VERITY_IO_VEC_INLINE		16
 #define DM_VERITY_MEMPOOL_SIZE		4
 #define DM_VERITY_DEFAULT_PREFETCH_SIZE	262144
+#define DM_VERITY_DEFAULT_PARALLEL_BLOCKS	8
+#define DM_VERITY_DEFAULT_BITMAP_LIMIT	(1 << 20)
 
 #define DM_VERITY_MAX_LEVELS		63
 
+#define DM_VERITY_OPT_MEASURE		"measure"
+#define DM_VERITY_OPT_AT_MOST_ONCE	"check_at_most_once"
+#define DM_VERITY_OPTS_MAX		2
+
 static unsigned dm_verity_prefetch_cluster = DM_VERITY_DEFAULT_PREFETCH_SIZE;
 
 module_param_named(prefetch_cluster, dm_verity_prefetch_cluster, uint, S_IRUGO | S_IWUSR);
 
+static unsigned dm_verity_parallel_blocks = DM_VERITY_DEFAULT_PARALLEL_BLOCKS;
+
+module_param_named(parallel_blocks, dm_verity_parallel_blocks, uint, S_IRUGO | S_IWUSR);
+
+static unsigned long dm_verity_bitmap_limit = DM_VERITY_DEFAULT_BITMAP_LIMIT;
+
+module_param_named(bitmap_limit, dm_verity_bitmap_limit, ulong, S_IRUGO | S_IWUSR);
+
+/*
+ * Verification statistics, collected if the target was created with the
+ * "measure" option.
+ */
+struct dm_verity_stats {
+	spinlock_t lock;
+	u64 bios;
+	u64 bytes;
+	u64 verify_ns;		/* data read completion to verification done */
+	u64 max_verify_ns;
+	u64 total_ns;		/* map to bio completion */
+	u64 max_total_ns;
+};
+
 struct dm_verity {
 	struct dm_dev *data_dev;
 	struct dm_dev *hash_dev;
@@ -53,7 +94,10 @@ struct dm_verity {
 	unsigned char version;
 	unsigned digest_size;	/* digest size for the current hash algorithm */
 	unsigned shash_descsize;/* the size of temporary space for crypto */
+	unsigned chunk_size;	/* struct dm_verity_chunk plus hashing space */
 	int hash_failed;	/* set to 1 if hash of any block failed */
+	bool measure;		/* collect stats */
+	bool at_most_once;	/* check_at_most_once was requested */
 
 	mempool_t *io_mempool;	/* mempool of struct dm_verity_io */
 	mempool_t *vec_mempool;	/* mempool of bio vector */
@@ -62,6 +106,17 @@ struct dm_verity {
 
 	/* starting blocks for each tree level. 0 is the lowest level. */
 	sector_t hash_level_block[DM_VERITY_MAX_LEVELS];
+
+	/*
+	 * Bitmaps of hash blocks (indexed from hash_start) and data blocks
+	 * whose hash has already been checked.  Both are only allocated for
+	 * "check_at_most_once", and not if they would exceed "bitmap_limit".
+	 */
+	unsigned long *verified_hash_blocks;
+	unsigned long *verified_data_blocks;
+	size_t bitmap_bytes;	/* memory used by the two bitmaps */
+
+	struct dm_verity_stats stats;
 };
 
 struct dm_verity_io {
@@ -81,9 +136,39 @@ struct dm_verity_io {
 
 	struct work_struct work;
 
+	/* chunks still being verified and the first error they returned */
+	atomic_t chunks_pending;
+	int error;
+
+	/* chunks beyond the first one, allocated only for large bios */
+	void *chunks;
+
+	/* for the "measure" option */
+	ktime_t start_time;
+	ktime_t verify_time;
+
 	/* A space for short vectors; longer vectors are allocated separately. */
 	struct bio_vec io_vec_inline[DM_VERITY_IO_VEC_INLINE];
 
+	/*
+	 * The first struct dm_verity_chunk follows this struct.
+	 */
+};
+
+/*
+ * A run of consecutive data blocks of one io, verified by one CPU.
+ */
+struct dm_verity_chunk {
+	struct dm_verity_io *io;
+	sector_t block;
+	unsigned n_blocks;
+
+	/* position of the first block in io->io_vec */
+	unsigned vector;
+	unsigned offset;
+
+	struct work_struct work;
+
 	/*
 	 * Three variably-size fields follow this struct:
 	 *
@@ -91,23 +176,34 @@ struct dm_verity_io {
 	 * u8 real_digest[v->digest_size];
 	 * u8 want_digest[v->digest_size];
 	 *
-	 * To access them use: io_hash_desc(), io_real_digest() and io_want_digest().
+	 * To access them use: chunk_hash_desc(), chunk_real_digest() and
+	 * chunk_want_digest().
 	 */
 };
 
-static struct shash_desc *io_hash_desc(struct dm_verity *v, struct dm_verity_io *io)
+static struct shash_desc *chunk_hash_desc(struct dm_verity *v,
+					  struct dm_verity_chunk *chunk)
+{
+	return (struct shash_desc *)(chunk + 1);
+}
+
+static u8 *chunk_real_digest(struct dm_verity *v, struct dm_verity_chunk *chunk)
 {
-	return (struct shash_desc *)(io + 1);
+	return (u8 *)(chunk + 1) + v->shash_descsize;
 }
 
-static u8 *io_real_digest(struct dm_verity *v, struct dm_verity_io *io)
+static u8 *chunk_want_digest(struct dm_verity *v, struct dm_verity_chunk *chunk)
 {
-	return (u8 *)(io + 1) + v->shash_descsize;
+	return (u8 *)(chunk + 1) + v->shash_descsize + v->digest_size;
 }
 
-static u8 *io_want_digest(struct dm_verity *v, struct dm_verity_io *io)
+static struct dm_verity_chunk *io_chunk(struct dm_verity *v,
+					struct dm_verity_io *io, unsigned i)
 {
-	return (u8 *)(io + 1) + v->shash_descsize + v->digest_size;
+	if (!i)
+		return (struct dm_verity_chunk *)(io + 1);
+
+	return io->chunks + (i - 1) * v->chunk_size;
 }
 
 /*
@@ -121,6 +217,10 @@ static u8 *io_want_digest(struct dm_verity *v, struct dm_verity_io *io)
  * that multiple processes verify the hash of the same buffer simultaneously
  * and write 1 to hash_verified simultaneously.
  * This condition is harmless, so we don't need locking.
+ *
+ * hash_verified is lost when dm-bufio evicts the buffer, and the block is
+ * hashed again when it is read back, unless "check_at_most_once" keeps its
+ * bit set in v->verified_hash_blocks.
  */
 struct buffer_aux {
 	int hash_verified;
@@ -178,17 +278,17 @@ static void verity_hash_at_level(struct dm_verity *v, sector_t block, int level,
  * Verify hash of a metadata block pertaining to the specified data block
  * ("block" argument) at a specified level ("level" argument).
  *
- * On successful return, io_want_digest(v, io) contains the hash value for
- * a lower tree level or for the data block (if we're at the lowest leve).
+ * On successful return, chunk_want_digest(v, chunk) contains the hash value
+ * for a lower tree level or for the data block (if we're at the lowest leve).
  *
  * If "skip_unverified" is true, unverified buffer is skipped and 1 is returned.
  * If "skip_unverified" is false, unverified buffer is hashed and verified
- * against current value of io_want_digest(v, io).
+ * against current value of chunk_want_digest(v, chunk).
  */
-static int verity_verify_level(struct dm_verity_io *io, sector_t block,
+static int verity_verify_level(struct dm_verity_chunk *chunk, sector_t block,
 			       int level, bool skip_unverified)
 {
-	struct dm_verity *v = io->v;
+	struct dm_verity *v = chunk->io->v;
 	struct dm_buffer *buf;
 	struct buffer_aux *aux;
 	u8 *data;
@@ -204,6 +304,10 @@ static int verity_verify_level(struct dm_verity_io *io, sector_t block,
 
 	aux = dm_bufio_get_aux_data(buf);
 
+	if (!aux->hash_verified && v->verified_hash_blocks &&
+	    test_bit(hash_block - v->hash_start, v->verified_hash_blocks))
+		aux->hash_verified = 1;
+
 	if (!aux->hash_verified) {
 		struct shash_desc *desc;
 		u8 *result;
@@ -213,7 +317,7 @@ static int verity_verify_level(struct dm_verity_io *io, sector_t block,
 			goto release_ret_r;
 		}
 
-		desc = io_hash_desc(v, io);
+		desc = chunk_hash_desc(v, chunk);
 		desc->tfm = v->tfm;
 		desc->flags = CRYPTO_TFM_REQ_MAY_SLEEP;
 		r = crypto_shash_init(desc);
@@ -244,25 +348,29 @@ static int verity_verify_level(struct dm_verity_io *io, sector_t block,
 			}
 		}
 
-		result = io_real_digest(v, io);
+		result = chunk_real_digest(v, chunk);
 		r = crypto_shash_final(desc, result);
 		if (r < 0) {
 			DMERR("crypto_shash_final failed: %d", r);
 			goto release_ret_r;
 		}
-		if (unlikely(memcmp(result, io_want_digest(v, io), v->digest_size))) {
+		if (unlikely(memcmp(result, chunk_want_digest(v, chunk), v->digest_size))) {
 			DMERR_LIMIT("metadata block %llu is corrupted",
 				(unsigned long long)hash_block);
 			v->hash_failed = 1;
 			r = -EIO;
 			goto release_ret_r;
-		} else
+		} else {
 			aux->hash_verified = 1;
+			if (v->verified_hash_blocks)
+				set_bit(hash_block - v->hash_start,
+					v->verified_hash_blocks);
+		}
 	}
 
 	data += offset;
 
-	memcpy(io_want_digest(v, io), data, v->digest_size);
+	memcpy(chunk_want_digest(v, chunk), data, v->digest_size);
 
 	dm_bufio_release(buf);
 	return 0;
@@ -274,21 +382,52 @@ release_ret_r:
 }
 
 /*
- * Verify one "dm_verity_io" structure.
+ * Advance the position in io->io_vec past one data block without hashing it.
+ */
+static void verity_skip_block(struct dm_verity_io *io, unsigned *vector,
+			      unsigned *offset)
+{
+	unsigned todo = 1 << io->v->data_dev_block_bits;
+
+	do {
+		struct bio_vec *bv;
+		unsigned len;
+
+		BUG_ON(*vector >= io->io_vec_size);
+		bv = &io->io_vec[*vector];
+		len = min(bv->bv_len - *offset, todo);
+		*offset += len;
+		if (likely(*offset == bv->bv_len)) {
+			*offset = 0;
+			(*vector)++;
+		}
+		todo -= len;
+	} while (todo);
+}
+
+/*
+ * Verify the blocks of one "dm_verity_chunk" structure.
  */
-static int verity_verify_io(struct dm_verity_io *io)
+static int verity_verify_chunk(struct dm_verity_chunk *chunk)
 {
+	struct dm_verity_io *io = chunk->io;
 	struct dm_verity *v = io->v;
 	unsigned b;
 	int i;
-	unsigned vector = 0, offset = 0;
+	unsigned vector = chunk->vector, offset = chunk->offset;
 
-	for (b = 0; b < io->n_blocks; b++) {
+	for (b = 0; b < chunk->n_blocks; b++) {
 		struct shash_desc *desc;
 		u8 *result;
 		int r;
 		unsigned todo;
 
+		if (v->verified_data_blocks &&
+		    test_bit(chunk->block + b, v->verified_data_blocks)) {
+			verity_skip_block(io, &vector, &offset);
+			continue;
+		}
+
 		if (likely(v->levels)) {
 			/*
 			 * First, we try to get the requested hash for
@@ -297,23 +436,23 @@ static int verity_verify_io(struct dm_verity_io *io)
 			 * function returns 0 and we fall back to whole
 			 * chain verification.
 			 */
-			int r = verity_verify_level(io, io->block + b, 0, true);
+			int r = verity_verify_level(chunk, chunk->block + b, 0, true);
 			if (likely(!r))
 				goto test_block_hash;
 			if (r < 0)
 				return r;
 		}
 
-		memcpy(io_want_digest(v, io), v->root_digest, v->digest_size);
+		memcpy(chunk_want_digest(v, chunk), v->root_digest, v->digest_size);
 
 		for (i = v->levels - 1; i >= 0; i--) {
-			int r = verity_verify_level(io, io->block + b, i, false);
+			int r = verity_verify_level(chunk, chunk->block + b, i, false);
 			if (unlikely(r))
 				return r;
 		}
 
 test_block_hash:
-		desc = io_hash_desc(v, io);
+		desc = chunk_hash_desc(v, chunk);
 		desc->tfm = v->tfm;
 		desc->flags = CRYPTO_TFM_REQ_MAY_SLEEP;
 		r = crypto_shash_init(desc);
@@ -365,21 +504,26 @@ test_block_hash:
 			}
 		}
 
-		result = io_real_digest(v, io);
+		result = chunk_real_digest(v, chunk);
 		r = crypto_shash_final(desc, result);
 		if (r < 0) {
 			DMERR("crypto_shash_final failed: %d", r);
 			return r;
 		}
-		if (unlikely(memcmp(result, io_want_digest(v, io), v->digest_size))) {
+		if (unlikely(memcmp(result, chunk_want_digest(v, chunk), v->digest_size))) {
 			DMERR_LIMIT("data block %llu is corrupted",
-				(unsigned long long)(io->block + b));
+				(unsigned long long)(chunk->block + b));
 			v->hash_failed = 1;
 			return -EIO;
 		}
+
+		if (v->verified_data_blocks)
+			set_bit(chunk->block + b, v->verified_data_blocks);
+	}
+	if (chunk->block + chunk->n_blocks == io->block + io->n_blocks) {
+		BUG_ON(vector != io->io_vec_size);
+		BUG_ON(offset);
 	}
-	BUG_ON(vector != io->io_vec_size);
-	BUG_ON(offset);
 
 	return 0;
 }
@@ -387,6 +531,28 @@ test_block_hash:
 /*
  * End one "io" structure with a given error.
  */
+static void verity_account_io(struct dm_verity_io *io)
+{
+	struct dm_verity *v = io->v;
+	struct dm_verity_stats *stats = &v->stats;
+	ktime_t now = ktime_get();
+	u64 total_ns = ktime_to_ns(ktime_sub(now, io->start_time));
+	u64 verify_ns = 0;
+	unsigned long flags;
+
+	if (io->verify_time.tv64)
+		verify_ns = ktime_to_ns(ktime_sub(now, io->verify_time));
+
+	spin_lock_irqsave(&stats->lock, flags);
+	stats->bios++;
+	stats->bytes += (u64)io->n_blocks << v->data_dev_block_bits;
+	stats->verify_ns += verify_ns;
+	stats->max_verify_ns = max(stats->max_verify_ns, verify_ns);
+	stats->total_ns += total_ns;
+	stats->max_total_ns = max(stats->max_total_ns, total_ns);
+	spin_unlock_irqrestore(&stats->lock, flags);
+}
+
 static void verity_finish_io(struct dm_verity_io *io, int error)
 {
 	struct bio *bio = io->bio;
@@ -395,19 +561,103 @@ static void verity_finish_io(struct dm_verity_io *io, int error)
 	bio->bi_end_io = io->orig_bi_end_io;
 	bio->bi_private = io->orig_bi_private;
 
+	if (v->measure)
+		verity_account_io(io);
+
 	if (io->io_vec != io->io_vec_inline)
 		mempool_free(io->io_vec, v->vec_mempool);
 
+	kfree(io->chunks);
 	mempool_free(io, v->io_mempool);
 
 	bio_endio(bio, error);
 }
 
+static void verity_chunk_done(struct dm_verity_chunk *chunk, int error)
+{
+	struct dm_verity_io *io = chunk->io;
+
+	if (unlikely(error))
+		cmpxchg(&io->error, 0, error);
+
+	if (atomic_dec_and_test(&io->chunks_pending))
+		verity_finish_io(io, io->error);
+}
+
+static void verity_chunk_work(struct work_struct *w)
+{
+	struct dm_verity_chunk *chunk =
+		container_of(w, struct dm_verity_chunk, work);
+
+	verity_chunk_done(chunk, verity_verify_chunk(chunk));
+}
+
+/*
+ * Split the blocks of an io into chunks of at least "parallel_blocks" blocks,
+ * at most one per online CPU, and return the number of chunks.  If the extra
+ * chunks cannot be allocated, the whole io is verified as one chunk.
+ */
+static unsigned verity_split_io(struct dm_verity_io *io)
+{
+	struct dm_verity *v = io->v;
+	unsigned min_blocks = ACCESS_ONCE(dm_verity_parallel_blocks);
+	unsigned n = 1, i, vector = 0, offset = 0;
+	unsigned long pos = 0;
+	sector_t block = io->block;
+
+	if (min_blocks && io->n_blocks >= 2 * min_blocks)
+		n = min(io->n_blocks / min_blocks, num_online_cpus());
+
+	if (n > 1) {
+		io->chunks = kmalloc((n - 1) * v->chunk_size,
+				     GFP_NOIO | __GFP_NOWARN);
+		if (!io->chunks)
+			n = 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct dm_verity_chunk *chunk = io_chunk(v, io, i);
+
+		if (i) {
+			unsigned long start = (unsigned long)(block - io->block)
+						<< v->data_dev_block_bits;
+
+			/* pos is the io offset of io_vec[vector] */
+			while (pos + io->io_vec[vector].bv_len <= start)
+				pos += io->io_vec[vector++].bv_len;
+			offset = start - pos;
+		}
+
+		chunk->io = io;
+		chunk->block = block;
+		chunk->n_blocks = io->n_blocks / n + (i < io->n_blocks % n);
+		chunk->vector = vector;
+		chunk->offset = offset;
+		block += chunk->n_blocks;
+	}
+
+	return n;
+}
+
 static void verity_work(struct work_struct *w)
 {
 	struct dm_verity_io *io = container_of(w, struct dm_verity_io, work);
+	struct dm_verity *v = io->v;
+	struct dm_verity_chunk *chunk;
+	unsigned n = verity_split_io(io);
+	unsigned i;
 
-	verity_finish_io(io, verity_verify_io(io));
+	atomic_set(&io->chunks_pending, n);
+
+	/* the other chunks go to other CPUs, the first one is verified here */
+	for (i = 1; i < n; i++) {
+		chunk = io_chunk(v, io, i);
+		INIT_WORK(&chunk->work, verity_chunk_work);
+		queue_work(v->verify_wq, &chunk->work);
+	}
+
+	chunk = io_chunk(v, io, 0);
+	verity_chunk_done(chunk, verity_verify_chunk(chunk));
 }
 
 static void verity_end_io(struct bio *bio, int error)
@@ -419,6 +669,9 @@ static void verity_end_io(struct bio *bio, int error)
 		return;
 	}
 
+	if (io->v->measure)
+		io->verify_time = ktime_get();
+
 	INIT_WORK(&io->work, verity_work);
 	queue_work(io->v->verify_wq, &io->work);
 }
@@ -493,6 +746,11 @@ static int verity_map(struct dm_target *ti, struct bio *bio,
 	io->orig_bi_private = bio->bi_private;
 	io->block = bio->bi_sector >> (v->data_dev_block_bits - SECTOR_SHIFT);
 	io->n_blocks = bio->bi_size >> v->data_dev_block_bits;
+	io->error = 0;
+	io->chunks = NULL;
+	io->verify_time.tv64 = 0;
+	if (v->measure)
+		io->start_time = ktime_get();
 
 	bio->bi_end_io = verity_end_io;
 	bio->bi_private = io;
@@ -512,18 +770,41 @@ static int verity_map(struct dm_target *ti, struct bio *bio,
 }
 
 /*
- * Status: V (valid) or C (corruption found)
+ * Status: V (valid) or C (corruption found).  With "check_at_most_once" this
+ * is followed by the number of bytes used by the bitmaps of verified blocks.
+ *
+ * With the "measure" option this is followed by the number of bios verified,
+ * the verification throughput in MB/s, and the average and maximum
+ * verification and total latencies per bio in microseconds.
  */
 static int verity_status(struct dm_target *ti, status_type_t type,
 			 char *result, unsigned maxlen)
 {
 	struct dm_verity *v = ti->private;
+	struct dm_verity_stats stats;
 	unsigned sz = 0;
-	unsigned x;
+	unsigned x, opt_params;
 
 	switch (type) {
 	case STATUSTYPE_INFO:
 		DMEMIT("%c", v->hash_failed ? 'C' : 'V');
+		if (v->at_most_once)
+			DMEMIT(" %lu", (unsigned long)v->bitmap_bytes);
+		if (!v->measure)
+			break;
+		spin_lock_irq(&v->stats.lock);
+		stats = v->stats;
+		spin_unlock_irq(&v->stats.lock);
+		DMEMIT(" %llu %llu %llu %llu %llu %llu",
+			(unsigned long long)stats.bios,
+			(unsigned long long)div64_u64(stats.bytes * NSEC_PER_USEC,
+						      stats.verify_ns ? : 1),
+			(unsigned long long)div64_u64(stats.verify_ns,
+					(stats.bios ? : 1) * NSEC_PER_USEC),
+			(unsigned long long)stats.max_verify_ns / NSEC_PER_USEC,
+			(unsigned long long)div64_u64(stats.total_ns,
+					(stats.bios ? : 1) * NSEC_PER_USEC),
+			(unsigned long long)stats.max_total_ns / NSEC_PER_USEC);
 		break;
 	case STATUSTYPE_TABLE:
 		DMEMIT("%u %s %s %u %u %llu %llu %s ",
@@ -544,6 +825,14 @@ static int verity_status(struct dm_target *ti, status_type_t type,
 		else
 			for (x = 0; x < v->salt_size; x++)
 				DMEMIT("%02x", v->salt[x]);
+		opt_params = v->measure + v->at_most_once;
+		if (!opt_params)
+			break;
+		DMEMIT(" %u", opt_params);
+		if (v->measure)
+			DMEMIT(" " DM_VERITY_OPT_MEASURE);
+		if (v->at_most_once)
+			DMEMIT(" " DM_VERITY_OPT_AT_MOST_ONCE);
 		break;
 	}
 
@@ -607,6 +896,9 @@ static void verity_dtr(struct dm_target *ti)
 	if (v->verify_wq)
 		destroy_workqueue(v->verify_wq);
 
+	vfree(v->verified_data_blocks);
+	vfree(v->verified_hash_blocks);
+
 	if (v->vec_mempool)
 		mempool_destroy(v->vec_mempool);
 
@@ -633,6 +925,43 @@ static void verity_dtr(struct dm_target *ti)
 	kfree(v);
 }
 
+/*
+ * Allocate the bitmaps of verified blocks for "check_at_most_once", within
+ * "bitmap_limit" bytes.  The hash block bitmap, which is smaller by the
+ * number of hashes per block and saves the most work, is tried first.  The
+ * bitmaps only avoid repeated hashing, so running without them is not an
+ * error.
+ *
+ * A hash block with its bit set is trusted when it is read back from the
+ * hash device, so this must stay tied to the option that gives up on
+ * detecting blocks rewritten after their first check.
+ */
+static void verity_alloc_bitmaps(struct dm_verity *v)
+{
+	size_t limit = ACCESS_ONCE(dm_verity_bitmap_limit);
+	size_t size;
+
+	if (!v->at_most_once)
+		return;
+
+	size = BITS_TO_LONGS(v->hash_blocks - v->hash_start) * sizeof(long);
+	if (size && size <= limit) {
+		v->verified_hash_blocks = vzalloc(size);
+		if (v->verified_hash_blocks)
+			v->bitmap_bytes += size;
+	}
+
+	size = BITS_TO_LONGS(v->data_blocks) * sizeof(long);
+	if (size && v->bitmap_bytes + size <= limit) {
+		v->verified_data_blocks = vzalloc(size);
+		if (v->verified_data_blocks) {
+			v->bitmap_bytes += size;
+			return;
+		}
+	}
+	DMWARN("not enough memory for check_at_most_once, data blocks will be verified on every read");
+}
+
 /*
  * Target parameters:
  *	<version>	The current format is version 1.
@@ -646,17 +975,31 @@ static void verity_dtr(struct dm_target *ti)
  *	<algorithm>
  *	<digest>
  *	<salt>		Hex string or "-" if no salt.
+ *
+ * Optional parameters:
+ *	<#opt_params>	The number of optional parameters that follow.
+ *	measure		Collect verification throughput and latency, and
+ *			report it in the status line.
+ *	check_at_most_once
+ *			Remember verified data and hash blocks in bitmaps and
+ *			don't hash them again.
  */
 static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 {
 	struct dm_verity *v;
-	unsigned num;
+	struct dm_arg_set as;
+	const char *opt_string;
+	unsigned num, opt_params;
 	unsigned long long num_ll;
 	int r;
 	int i;
 	sector_t hash_position;
 	char dummy;
 
+	static struct dm_arg _args[] = {
+		{0, DM_VERITY_OPTS_MAX, "Invalid number of feature args"},
+	};
+
 	v = kzalloc(sizeof(struct dm_verity), GFP_KERNEL);
 	if (!v) {
 		ti->error = "Cannot allocate verity structure";
@@ -664,6 +1007,7 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 	}
 	ti->private = v;
 	v->ti = ti;
+	spin_lock_init(&v->stats.lock);
 
 	if ((dm_table_get_mode(ti->table) & ~FMODE_READ)) {
 		ti->error = "Device must be readonly";
@@ -671,8 +1015,8 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto bad;
 	}
 
-	if (argc != 10) {
-		ti->error = "Invalid argument count: exactly 10 arguments required";
+	if (argc < 10) {
+		ti->error = "Invalid argument count: at least 10 arguments required";
 		r = -EINVAL;
 		goto bad;
 	}
@@ -793,6 +1137,31 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		}
 	}
 
+	/* Optional parameters */
+	as.argc = argc - 10;
+	as.argv = argv + 10;
+	if (as.argc) {
+		r = dm_read_arg_group(_args, &as, &opt_params, &ti->error);
+		if (r)
+			goto bad;
+
+		while (opt_params--) {
+			opt_string = dm_shift_arg(&as);
+			if (!strcasecmp(opt_string, DM_VERITY_OPT_MEASURE)) {
+				v->measure = true;
+				continue;
+			}
+			if (!strcasecmp(opt_string, DM_VERITY_OPT_AT_MOST_ONCE)) {
+				v->at_most_once = true;
+				continue;
+			}
+
+			ti->error = "Unrecognized verity feature request";
+			r = -EINVAL;
+			goto bad;
+		}
+	}
+
 	v->hash_per_block_bits =
 		fls((1 << v->hash_dev_block_bits) / v->digest_size) - 1;
 
@@ -841,8 +1210,13 @@ static int verity_ctr(struct dm_target *ti, unsigned argc, char **argv)
 		goto bad;
 	}
 
+	verity_alloc_bitmaps(v);
+
+	v->chunk_size = ALIGN(sizeof(struct dm_verity_chunk) +
+			      v->shash_descsize + v->digest_size * 2,
+			      __alignof__(struct dm_verity_chunk));
 	v->io_mempool = mempool_create_kmalloc_pool(DM_VERITY_MEMPOOL_SIZE,
-	  sizeof(struct dm_verity_io) + v->shash_descsize + v->digest_size * 2);
+				sizeof(struct dm_verity_io) + v->chunk_size);
 	if (!v->io_mempool) {
 		ti->error = "Cannot allocate io mempool";
 		r = -ENOMEM;
@@ -875,7 +1249,7 @@ bad:
 
 static struct target_type verity_target = {
 	.name		= "verity",
-	.version	= {1, 0, 0},
+	.version	= {1, 2, 0},
 	.module		= THIS_MODULE,
 	.ctr		= verity_ctr,
 	.dtr		= verity_dtr,
@@ -144,6 +144,40 @@ TRACE_EVENT(binder_transaction_received,
 	TP_printk("transaction=%d", __entry->debug_id)
 );
 
+TRACE_EVENT(binder_transaction_delivered,
+	TP_PROTO(struct binder_transaction *t, s64 queue_ns, s64 wakeup_ns),
+	TP_ARGS(t, queue_ns, wakeup_ns),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, queue_ns)
+		__field(s64, wakeup_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->queue_ns = queue_ns;
+		__entry->wakeup_ns = wakeup_ns;
+	),
+	TP_printk("transaction=%d queue_ns=%lld wakeup_ns=%lld",
+		  __entry->debug_id, __entry->queue_ns, __entry->wakeup_ns)
+);
+
+TRACE_EVENT(binder_transaction_handled,
+	TP_PROTO(struct binder_transaction *t, s64 handler_ns),
+	TP_ARGS(t, handler_ns),
+
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(s64, handler_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->handler_ns = handler_ns;
+	),
+	TP_printk("transaction=%d handler_ns=%lld",
+		  __entry->debug_id, __entry->handler_ns)
+);
+
 TRACE_EVENT(binder_transaction_node_to_ref,
 	TP_PROTO(struct binder_transaction *t, struct binder_node *node,
 		 struct binder_ref *ref),
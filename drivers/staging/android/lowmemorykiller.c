@@ -17,6 +17,13 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * With CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_BUCKETS every process is kept on
+ * a list for its oom_score_adj, maintained at fork, exit and when
+ * oom_score_adj is written, and only the processes on the highest non-empty
+ * list at or above the threshold are looked at.  Without it every process
+ * is.  scan_count, scan_tasks and scan_time_ns in the same directory count
+ * the victim searches, the processes they looked at and the time they took.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -37,6 +44,11 @@
 #include <linux/sched.h>
 #include <linux/rcupdate.h>
 #include <linux/notifier.h>
+#include <linux/bitops.h>
+#include <linux/list.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/err.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -56,18 +68,333 @@ static int lowmem_minfree_size = 4;
 
 static unsigned long lowmem_deathpending_timeout;
 
+static unsigned long lowmem_scan_count;
+static unsigned long lowmem_scan_tasks;
+static unsigned long lowmem_scan_time_ns;
+static DEFINE_SPINLOCK(lowmem_scan_lock);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
 			printk(x);			\
 	} while (0)
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static void lowmem_account_scan(int tasks, ktime_t start)
+{
+	s64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&lowmem_scan_lock);
+	lowmem_scan_count++;
+	lowmem_scan_tasks += tasks;
+	lowmem_scan_time_ns += ns;
+	spin_unlock(&lowmem_scan_lock);
+}
+
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_BUCKETS
+
+#define LOWMEM_ADJ_BUCKETS	(OOM_SCORE_ADJ_MAX - OOM_SCORE_ADJ_MIN + 1)
+
+/*
+ * Thread groups by oom_score_adj, with a bit set for every non-empty
+ * bucket.  lowmem_adj_lock nests inside tasklist_lock and siglock, which
+ * are held when fork and exit call in.  It is taken with interrupts off
+ * since tasklist_lock can be read-locked from them.  task_lock nests
+ * outside siglock, so it must never be taken under lowmem_adj_lock.
+ */
+static DEFINE_SPINLOCK(lowmem_adj_lock);
+static struct hlist_head lowmem_adj_buckets[LOWMEM_ADJ_BUCKETS];
+static DECLARE_BITMAP(lowmem_adj_map, LOWMEM_ADJ_BUCKETS);
+static struct task_struct *lowmem_deathpending;
+
+static void __lowmem_adj_add(struct signal_struct *sig)
+{
+	int i = sig->oom_score_adj - OOM_SCORE_ADJ_MIN;
+
+	sig->lowmem_adj_bucket = i;
+	hlist_add_head(&sig->lowmem_adj_node, &lowmem_adj_buckets[i]);
+	__set_bit(i, lowmem_adj_map);
+}
+
+static void __lowmem_adj_del(struct signal_struct *sig)
+{
+	int i = sig->lowmem_adj_bucket;
+
+	hlist_del_init(&sig->lowmem_adj_node);
+	if (hlist_empty(&lowmem_adj_buckets[i]))
+		__clear_bit(i, lowmem_adj_map);
+}
+
+void lowmem_adj_add(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	__lowmem_adj_add(p->signal);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+void lowmem_adj_del(struct task_struct *p)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (!hlist_unhashed(&p->signal->lowmem_adj_node))
+		__lowmem_adj_del(p->signal);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/*
+ * The new value is read here rather than passed in, so that of two racing
+ * writers the one to get here last files the group under the value that
+ * stuck.  A group that has already exited is left alone.
+ */
+void lowmem_adj_update(struct task_struct *p)
+{
+	struct signal_struct *sig = p->signal;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	if (!hlist_unhashed(&sig->lowmem_adj_node) &&
+	    sig->lowmem_adj_bucket != sig->oom_score_adj - OOM_SCORE_ADJ_MIN) {
+		__lowmem_adj_del(sig);
+		__lowmem_adj_add(sig);
+	}
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+}
+
+/* Leaders held at a time while their mm is looked at */
+#define LOWMEM_ADJ_BATCH	16
+
+/*
+ * Take a reference on up to LOWMEM_ADJ_BATCH group leaders of bucket @i.
+ * The walk starts after @cursor, a leader still held from the previous
+ * batch, if its group is still filed in the bucket, or else at the head.
+ * The leader is looked up through leader_pid so that a thread already
+ * unhashed from the group is never returned.
+ */
+static int lowmem_adj_snapshot(unsigned int i, struct task_struct *cursor,
+			       struct task_struct **batch, int *scanned)
+{
+	struct hlist_node *pos = lowmem_adj_buckets[i].first;
+	struct signal_struct *sig;
+	struct task_struct *p;
+	int n = 0;
+
+	if (cursor) {
+		sig = cursor->signal;
+		if (!hlist_unhashed(&sig->lowmem_adj_node) &&
+		    sig->lowmem_adj_bucket == i)
+			pos = sig->lowmem_adj_node.next;
+	}
+
+	for (; pos && n < LOWMEM_ADJ_BATCH; pos = pos->next) {
+		sig = hlist_entry(pos, struct signal_struct, lowmem_adj_node);
+		(*scanned)++;
+		p = pid_task(sig->leader_pid, PIDTYPE_PID);
+		if (!p || (p->flags & PF_KTHREAD))
+			continue;
+		get_task_struct(p);
+		batch[n++] = p;
+	}
+	return n;
+}
+
+/*
+ * True while the last process killed still has its mm, for up to a
+ * second.  Once it is gone or has timed out it is forgotten.
+ */
+static bool lowmem_deathpending_busy(void)
+{
+	struct task_struct *p;
+	unsigned long flags;
+	bool busy = false;
+	bool drop = false;
+
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	p = lowmem_deathpending;
+	if (p)
+		get_task_struct(p);
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	if (!p)
+		return false;
+
+	if (time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+		task_lock(p);
+		busy = p->mm != NULL;
+		task_unlock(p);
+	}
+	if (!busy) {
+		spin_lock_irqsave(&lowmem_adj_lock, flags);
+		if (lowmem_deathpending == p) {
+			lowmem_deathpending = NULL;
+			drop = true;
+		}
+		spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	}
+
+	if (drop)
+		put_task_struct(p);
+	put_task_struct(p);
+	return busy;
+}
+
+/*
+ * Only the highest bucket at or above @min_score_adj holding a process
+ * with memory is searched, for the one with the largest rss.  The leaders
+ * are collected in batches under lowmem_adj_lock and their mms looked at
+ * after dropping it.  The task returned is not pinned; the caller's
+ * rcu_read_lock() keeps it around.
+ */
+static struct task_struct *lowmem_select(int min_score_adj,
+					 int *selected_tasksize,
+					 int *selected_oom_score_adj,
+					 int *scanned)
+{
+	struct task_struct *batch[LOWMEM_ADJ_BATCH];
+	struct task_struct *selected = NULL;
+	struct task_struct *cursor;
+	struct task_struct *p;
+	unsigned long flags;
+	unsigned int min_bucket = 0;
+	unsigned int bound = LOWMEM_ADJ_BUCKETS;
+	unsigned int i;
+	int tasksize;
+	int n, j;
+
+	if (min_score_adj > OOM_SCORE_ADJ_MIN)
+		min_bucket = min_score_adj - OOM_SCORE_ADJ_MIN;
+	if (lowmem_deathpending_busy())
+		return ERR_PTR(-EBUSY);
+
+	for (;;) {
+		spin_lock_irqsave(&lowmem_adj_lock, flags);
+		i = find_last_bit(lowmem_adj_map, bound);
+		if (i >= bound || i < min_bucket) {
+			spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+			break;
+		}
+
+		cursor = NULL;
+		for (;;) {
+			n = lowmem_adj_snapshot(i, cursor, batch, scanned);
+			spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+
+			if (cursor)
+				put_task_struct(cursor);
+			/* a full batch keeps its last leader to resume from */
+			cursor = n == LOWMEM_ADJ_BATCH ? batch[n - 1] : NULL;
+
+			for (j = 0; j < n; j++) {
+				p = find_lock_task_mm(batch[j]);
+				if (p) {
+					tasksize = get_mm_rss(p->mm);
+					task_unlock(p);
+					if (tasksize > 0 &&
+					    tasksize > *selected_tasksize) {
+						selected = p;
+						*selected_tasksize = tasksize;
+					}
+				}
+				if (batch[j] != cursor)
+					put_task_struct(batch[j]);
+			}
+			if (!cursor)
+				break;
+			spin_lock_irqsave(&lowmem_adj_lock, flags);
+		}
+
+		if (selected) {
+			*selected_oom_score_adj = i + OOM_SCORE_ADJ_MIN;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+				     selected->pid, selected->comm,
+				     *selected_oom_score_adj, *selected_tasksize);
+			break;
+		}
+		bound = i;
+	}
+
+	return selected;
+}
+
+static void lowmem_set_deathpending(struct task_struct *p)
+{
+	struct task_struct *old;
+	unsigned long flags;
+
+	get_task_struct(p);
+	spin_lock_irqsave(&lowmem_adj_lock, flags);
+	old = lowmem_deathpending;
+	lowmem_deathpending = p;
+	spin_unlock_irqrestore(&lowmem_adj_lock, flags);
+	if (old)
+		put_task_struct(old);
+}
+
+#else
+
+static struct task_struct *lowmem_select(int min_score_adj,
+					 int *selected_tasksize,
+					 int *selected_oom_score_adj,
+					 int *scanned)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
-	int rem = 0;
 	int tasksize;
+
+	for_each_process(tsk) {
+		struct task_struct *p;
+		int oom_score_adj;
+
+		(*scanned)++;
+		if (tsk->flags & PF_KTHREAD)
+			continue;
+
+		p = find_lock_task_mm(tsk);
+		if (!p)
+			continue;
+
+		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
+		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
+			task_unlock(p);
+			return ERR_PTR(-EBUSY);
+		}
+		oom_score_adj = p->signal->oom_score_adj;
+		if (oom_score_adj < min_score_adj) {
+			task_unlock(p);
+			continue;
+		}
+		tasksize = get_mm_rss(p->mm);
+		task_unlock(p);
+		if (tasksize <= 0)
+			continue;
+		if (selected) {
+			if (oom_score_adj < *selected_oom_score_adj)
+				continue;
+			if (oom_score_adj == *selected_oom_score_adj &&
+			    tasksize <= *selected_tasksize)
+				continue;
+		}
+		selected = p;
+		*selected_tasksize = tasksize;
+		*selected_oom_score_adj = oom_score_adj;
+		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
+			     p->pid, p->comm, oom_score_adj, tasksize);
+	}
+	return selected;
+}
+
+static inline void lowmem_set_deathpending(struct task_struct *p)
+{
+}
+
+#endif /* CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_BUCKETS */
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	struct task_struct *selected;
+	int rem = 0;
+	int scanned = 0;
+	ktime_t start;
 	int i;
 	int min_score_adj = OOM_SCORE_ADJ_MAX + 1;
 	int selected_tasksize = 0;
@@ -103,45 +430,14 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	}
 	selected_oom_score_adj = min_score_adj;
 
+	start = ktime_get();
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_score_adj;
-
-		if (tsk->flags & PF_KTHREAD)
-			continue;
-
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
-
-		if (test_tsk_thread_flag(p, TIF_MEMDIE) &&
-		    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
-			task_unlock(p);
-			rcu_read_unlock();
-			return 0;
-		}
-		oom_score_adj = p->signal->oom_score_adj;
-		if (oom_score_adj < min_score_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_score_adj < selected_oom_score_adj)
-				continue;
-			if (oom_score_adj == selected_oom_score_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_score_adj = oom_score_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_score_adj, tasksize);
+	selected = lowmem_select(min_score_adj, &selected_tasksize,
+				 &selected_oom_score_adj, &scanned);
+	lowmem_account_scan(scanned, start);
+	if (IS_ERR(selected)) {
+		rcu_read_unlock();
+		return 0;
 	}
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
@@ -150,6 +446,7 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 		lowmem_deathpending_timeout = jiffies + HZ;
 		send_sig(SIGKILL, selected, 0);
 		set_tsk_thread_flag(selected, TIF_MEMDIE);
+		lowmem_set_deathpending(selected);
 		rem -= selected_tasksize;
 	}
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
@@ -180,6 +477,9 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(scan_count, lowmem_scan_count, ulong, S_IRUGO);
+module_param_named(scan_tasks, lowmem_scan_tasks, ulong, S_IRUGO);
+module_param_named(scan_time_ns, lowmem_scan_time_ns, ulong, S_IRUGO);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
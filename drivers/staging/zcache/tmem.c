@@ -704,6 +704,49 @@ out:
 	return ret;
 }
 
+/*
+ * Like tmem_replace, but only if the handle still maps to old_pampd: it
+ * may have been flushed, gotten or re-put while the caller was preparing
+ * data.  The new pampd is created from data, in the same way as for a
+ * put; if data is NULL or creation fails, the page is flushed instead.
+ * Returns 0 if old_pampd was found (and freed), else -1.
+ */
+int tmem_replace_pampd(struct tmem_pool *pool, struct tmem_oid *oidp,
+			uint32_t index, void *old_pampd, char *data,
+			size_t size, bool raw)
+{
+	struct tmem_obj *obj;
+	void *new_pampd = NULL;
+	int ret = -1;
+	struct tmem_hashbucket *hb;
+
+	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
+	spin_lock(&hb->lock);
+	obj = tmem_obj_find(hb, oidp);
+	if (obj == NULL)
+		goto out;
+	if (tmem_pampd_lookup_in_obj(obj, index) != old_pampd)
+		goto out;
+	if (data != NULL)
+		new_pampd = (*tmem_pamops.create)(data, size, raw,
+					is_ephemeral(pool), pool,
+					&obj->oid, index);
+	if (new_pampd != NULL) {
+		(void)tmem_pampd_replace_in_obj(obj, index, new_pampd);
+	} else {
+		(void)tmem_pampd_delete_from_obj(obj, index);
+		(*tmem_pamops.free)(old_pampd, pool, oidp, index);
+		if (obj->pampd_count == 0) {
+			tmem_obj_free(obj, hb);
+			(*tmem_hostops.obj_free)(obj, pool);
+		}
+	}
+	ret = 0;
+out:
+	spin_unlock(&hb->lock);
+	return ret;
+}
+
 /*
  * "Flush" all pages in tmem matching this oid.
  */
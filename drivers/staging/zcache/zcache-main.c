@@ -31,10 +31,14 @@
 #include <linux/math64.h>
 #include <linux/crypto.h>
 #include <linux/string.h>
+#include <linux/workqueue.h>
 #include "tmem.h"
 
 #include "../zsmalloc/zsmalloc.h"
 
+#define CREATE_TRACE_POINTS
+#include "zcache_trace.h"
+
 #if (!defined(CONFIG_CLEANCACHE) && !defined(CONFIG_FRONTSWAP))
 #error "zcache is useless without CONFIG_CLEANCACHE or CONFIG_FRONTSWAP"
 #endif
@@ -709,7 +713,7 @@ static struct zv_hdr *zv_create(struct zs_pool *pool, uint32_t pool_id,
 		goto out;
 	atomic_inc(&zv_curr_dist_counts[chunks]);
 	atomic_inc(&zv_cumul_dist_counts[chunks]);
-	zv = zs_map_object(pool, handle);
+	zv = zs_map_object(pool, handle, ZS_MM_WO);
 	zv->index = index;
 	zv->oid = *oid;
 	zv->pool_id = pool_id;
@@ -728,7 +732,7 @@ static void zv_free(struct zs_pool *pool, void *handle)
 	uint16_t size;
 	int chunks;
 
-	zv = zs_map_object(pool, handle);
+	zv = zs_map_object(pool, handle, ZS_MM_RW);
 	ASSERT_SENTINEL(zv, ZVH);
 	size = zv->size + sizeof(struct zv_hdr);
 	INVERT_SENTINEL(zv, ZVH);
@@ -750,7 +754,7 @@ static void zv_decompress(struct page *page, void *handle)
 	int ret;
 	struct zv_hdr *zv;
 
-	zv = zs_map_object(zcache_host.zspool, handle);
+	zv = zs_map_object(zcache_host.zspool, handle, ZS_MM_RO);
 	BUG_ON(zv->size == 0);
 	ASSERT_SENTINEL(zv, ZVH);
 	to_va = kmap_atomic(page);
@@ -1158,6 +1162,124 @@ static struct tmem_hostops zcache_hostops = {
 	.objnode_free = zcache_objnode_free,
 };
 
+/*
+ * Batched ephemeral puts: cleancache puts come from reclaim with interrupts
+ * disabled, so rather than compressing there, the page is copied into a
+ * per-cpu staging slot and a worker compresses the queued slots in batches.
+ * Until then tmem holds a "pending" pampd, the slot address with the low
+ * bit set, which gets, flushes and dup puts handle like any other pampd.
+ * The worker swaps the zbud in only if tmem still holds the pending pampd
+ * (see tmem_replace_pampd), so a flush or get racing with it wins.
+ */
+#define ZCACHE_BATCH_PAGES	16
+#define ZCACHE_PENDING_TAG	1UL
+
+enum zcache_slot_state {
+	ZCACHE_SLOT_FREE,
+	ZCACHE_SLOT_QUEUED,	/* in tmem, waiting for the worker */
+	ZCACHE_SLOT_BUSY,	/* in tmem, being compressed */
+	ZCACHE_SLOT_DEAD,	/* gone from tmem while being compressed */
+};
+
+struct zcache_batch;
+
+struct zcache_slot {
+	struct page *page;
+	struct zcache_batch *batch;
+	enum zcache_slot_state state;
+	uint16_t client_id;
+	uint16_t pool_id;
+	uint32_t index;
+	struct tmem_oid oid;
+};
+
+struct zcache_batch {
+	spinlock_t lock;	/* protects slot state and contents */
+	struct work_struct work;
+	struct zcache_slot slot[ZCACHE_BATCH_PAGES];
+};
+static DEFINE_PER_CPU(struct zcache_batch, zcache_batches);
+
+static bool zcache_batch_enabled = true;
+static unsigned long zcache_batch_puts;
+static unsigned long zcache_batch_full;
+static unsigned long zcache_batch_stale;
+
+static inline bool zcache_pampd_is_pending(void *pampd)
+{
+	return (unsigned long)pampd & ZCACHE_PENDING_TAG;
+}
+
+static inline struct zcache_slot *zcache_pending_slot(void *pampd)
+{
+	return (struct zcache_slot *)((unsigned long)pampd &
+					~ZCACHE_PENDING_TAG);
+}
+
+/*
+ * Copy page into a free slot of this cpu's batch and queue it for the
+ * worker.  Returns the pending pampd, or NULL if batching is off or the
+ * batch is full, in which case the caller compresses synchronously.
+ * zcache_batch_full only counts the puts that found every slot in use.
+ */
+static void *zcache_batch_queue(struct tmem_pool *pool, struct tmem_oid *oid,
+				uint32_t index, struct page *page)
+{
+	struct zcache_batch *batch = &__get_cpu_var(zcache_batches);
+	struct zcache_slot *slot = NULL;
+	bool full = true;
+	char *from_va;
+	int i;
+
+	BUG_ON(!irqs_disabled());
+	if (!zcache_batch_enabled)
+		return NULL;
+	spin_lock(&batch->lock);
+	for (i = 0; i < ZCACHE_BATCH_PAGES; i++) {
+		if (batch->slot[i].page == NULL) {
+			/* no staging page: not in use, just unusable */
+			full = false;
+			continue;
+		}
+		if (batch->slot[i].state == ZCACHE_SLOT_FREE) {
+			slot = &batch->slot[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		spin_unlock(&batch->lock);
+		if (full)
+			zcache_batch_full++;
+		return NULL;
+	}
+	slot->client_id = get_client_id_from_client(pool->client);
+	slot->pool_id = pool->pool_id;
+	slot->oid = *oid;
+	slot->index = index;
+	from_va = kmap_atomic(page);
+	copy_page(page_address(slot->page), from_va);
+	kunmap_atomic(from_va);
+	slot->state = ZCACHE_SLOT_QUEUED;
+	spin_unlock(&batch->lock);
+
+	zcache_batch_puts++;
+	schedule_work_on(smp_processor_id(), &batch->work);
+	return (void *)((unsigned long)slot | ZCACHE_PENDING_TAG);
+}
+
+/* tmem no longer points to slot: free it, unless the worker has it */
+static void zcache_batch_release(struct zcache_slot *slot)
+{
+	struct zcache_batch *batch = slot->batch;
+
+	spin_lock(&batch->lock);
+	if (slot->state == ZCACHE_SLOT_BUSY)
+		slot->state = ZCACHE_SLOT_DEAD;
+	else
+		slot->state = ZCACHE_SLOT_FREE;
+	spin_unlock(&batch->lock);
+}
+
 /*
  * zcache implementations for PAM page descriptor ops
  */
@@ -1186,15 +1308,25 @@ static void *zcache_pampd_create(char *data, size_t size, bool raw, int eph,
 	u64 total_zsize;
 
 	if (eph) {
-		ret = zcache_compress(page, &cdata, &clen);
-		if (ret == 0)
-			goto out;
+		if (raw) {
+			/* from the batch worker, data is already compressed */
+			cdata = data;
+			clen = size;
+		} else {
+			pampd = zcache_batch_queue(pool, oid, index, page);
+			if (pampd != NULL)
+				goto eph_count;
+			ret = zcache_compress(page, &cdata, &clen);
+			if (ret == 0)
+				goto out;
+		}
 		if (clen == 0 || clen > zbud_max_buddy_size()) {
 			zcache_compress_poor++;
 			goto out;
 		}
 		pampd = (void *)zbud_create(client_id, pool->pool_id, oid,
 						index, page, cdata, clen);
+eph_count:
 		if (pampd != NULL) {
 			count = atomic_inc_return(&zcache_curr_eph_pampd_count);
 			if (count > zcache_curr_eph_pampd_count_max)
@@ -1259,11 +1391,21 @@ static int zcache_pampd_get_data_and_free(char *data, size_t *bufsize, bool raw,
 					void *pampd, struct tmem_pool *pool,
 					struct tmem_oid *oid, uint32_t index)
 {
+	struct zcache_slot *slot;
+	char *to_va;
 	int ret = 0;
 
 	BUG_ON(!is_ephemeral(pool));
-	zbud_decompress((struct page *)(data), pampd);
-	zbud_free_and_delist((struct zbud_hdr *)pampd);
+	if (zcache_pampd_is_pending(pampd)) {
+		slot = zcache_pending_slot(pampd);
+		to_va = kmap_atomic((struct page *)(data));
+		copy_page(to_va, page_address(slot->page));
+		kunmap_atomic(to_va);
+		zcache_batch_release(slot);
+	} else {
+		zbud_decompress((struct page *)(data), pampd);
+		zbud_free_and_delist((struct zbud_hdr *)pampd);
+	}
 	atomic_dec(&zcache_curr_eph_pampd_count);
 	return ret;
 }
@@ -1278,7 +1420,10 @@ static void zcache_pampd_free(void *pampd, struct tmem_pool *pool,
 	struct zcache_client *cli = pool->client;
 
 	if (is_ephemeral(pool)) {
-		zbud_free_and_delist((struct zbud_hdr *)pampd);
+		if (zcache_pampd_is_pending(pampd))
+			zcache_batch_release(zcache_pending_slot(pampd));
+		else
+			zbud_free_and_delist((struct zbud_hdr *)pampd);
 		atomic_dec(&zcache_curr_eph_pampd_count);
 		BUG_ON(atomic_read(&zcache_curr_eph_pampd_count) < 0);
 	} else {
@@ -1366,6 +1511,97 @@ static void zcache_comp_cpu_down(int cpu)
 	*per_cpu_ptr(zcache_comp_pcpu_tfms, cpu) = NULL;
 }
 
+static void zcache_batch_compress_slot(struct zcache_slot *slot)
+{
+	void *pending = (void *)((unsigned long)slot | ZCACHE_PENDING_TAG);
+	struct tmem_pool *pool;
+	void *cdata = NULL;
+	unsigned clen = 0;
+	int ret;
+
+	pool = zcache_get_pool_by_id(slot->client_id, slot->pool_id);
+	if (pool == NULL)
+		return;	/* destroyed, taking the pending page with it */
+	if (zcache_do_preload(pool) == 0) {
+		/* preload does preempt_disable on success */
+		if (!zcache_compress(slot->page, &cdata, &clen))
+			cdata = NULL;
+		ret = tmem_replace_pampd(pool, &slot->oid, slot->index,
+					pending, cdata, clen, true);
+		preempt_enable_no_resched();
+	} else {
+		/* can't compress: drop the page rather than keep it raw */
+		ret = tmem_replace_pampd(pool, &slot->oid, slot->index,
+					pending, NULL, 0, true);
+	}
+	if (ret < 0)
+		zcache_batch_stale++;
+	zcache_put_pool(pool);
+}
+
+static void zcache_batch_work(struct work_struct *work)
+{
+	struct zcache_batch *batch =
+		container_of(work, struct zcache_batch, work);
+	struct zcache_slot *slot;
+	unsigned long flags;
+	unsigned int nr = 0;
+	int i;
+
+	for (i = 0; i < ZCACHE_BATCH_PAGES; i++) {
+		slot = &batch->slot[i];
+		local_irq_save(flags);
+		spin_lock(&batch->lock);
+		if (slot->state != ZCACHE_SLOT_QUEUED) {
+			spin_unlock(&batch->lock);
+			local_irq_restore(flags);
+			continue;
+		}
+		slot->state = ZCACHE_SLOT_BUSY;
+		spin_unlock(&batch->lock);
+
+		zcache_batch_compress_slot(slot);
+
+		spin_lock(&batch->lock);
+		slot->state = ZCACHE_SLOT_FREE;
+		spin_unlock(&batch->lock);
+		local_irq_restore(flags);
+		nr++;
+	}
+	trace_zcache_batch_compress(smp_processor_id(), nr);
+}
+
+/*
+ * Staging pages are allocated the first time a cpu comes up and are kept
+ * when it goes down, since tmem may still point to its queued slots.
+ */
+static void zcache_batch_cpu_up(int cpu)
+{
+	struct zcache_batch *batch = &per_cpu(zcache_batches, cpu);
+	int i;
+
+	if (!zcache_batch_enabled)
+		return;
+	for (i = 0; i < ZCACHE_BATCH_PAGES; i++)
+		if (batch->slot[i].page == NULL)
+			batch->slot[i].page = alloc_page(GFP_KERNEL);
+}
+
+static void zcache_batch_init(void)
+{
+	struct zcache_batch *batch;
+	unsigned int cpu;
+	int i;
+
+	for_each_possible_cpu(cpu) {
+		batch = &per_cpu(zcache_batches, cpu);
+		spin_lock_init(&batch->lock);
+		INIT_WORK(&batch->work, zcache_batch_work);
+		for (i = 0; i < ZCACHE_BATCH_PAGES; i++)
+			batch->slot[i].batch = batch;
+	}
+}
+
 static int zcache_cpu_notifier(struct notifier_block *nb,
 				unsigned long action, void *pcpu)
 {
@@ -1381,6 +1617,7 @@ static int zcache_cpu_notifier(struct notifier_block *nb,
 		}
 		per_cpu(zcache_dstmem, cpu) = (void *)__get_free_pages(
 			GFP_KERNEL | __GFP_REPEAT, ZCACHE_DSTMEM_ORDER);
+		zcache_batch_cpu_up(cpu);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
@@ -1469,6 +1706,9 @@ ZCACHE_SYSFS_RO(failed_alloc);
 ZCACHE_SYSFS_RO(put_to_flush);
 ZCACHE_SYSFS_RO(compress_poor);
 ZCACHE_SYSFS_RO(mean_compress_poor);
+ZCACHE_SYSFS_RO(batch_puts);
+ZCACHE_SYSFS_RO(batch_full);
+ZCACHE_SYSFS_RO(batch_stale);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_raw_pages);
 ZCACHE_SYSFS_RO_ATOMIC(zbud_curr_zpages);
 ZCACHE_SYSFS_RO_ATOMIC(curr_obj_count);
@@ -1495,6 +1735,9 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_failed_pers_puts_attr.attr,
 	&zcache_compress_poor_attr.attr,
 	&zcache_mean_compress_poor_attr.attr,
+	&zcache_batch_puts_attr.attr,
+	&zcache_batch_full_attr.attr,
+	&zcache_batch_stale_attr.attr,
 	&zcache_zbud_curr_raw_pages_attr.attr,
 	&zcache_zbud_curr_zpages_attr.attr,
 	&zcache_zbud_curr_zbytes_attr.attr,
@@ -1570,6 +1813,7 @@ static int zcache_put_page(int cli_id, int pool_id, struct tmem_oid *oidp,
 	int ret = -1;
 
 	BUG_ON(!irqs_disabled());
+	trace_zcache_put(pool_id, index);
 	pool = zcache_get_pool_by_id(cli_id, pool_id);
 	if (unlikely(pool == NULL))
 		goto out;
@@ -1593,6 +1837,7 @@ static int zcache_put_page(int cli_id, int pool_id, struct tmem_oid *oidp,
 		zcache_put_pool(pool);
 	}
 out:
+	trace_zcache_put_done(ret);
 	return ret;
 }
 
@@ -1604,6 +1849,7 @@ static int zcache_get_page(int cli_id, int pool_id, struct tmem_oid *oidp,
 	unsigned long flags;
 	size_t size = PAGE_SIZE;
 
+	trace_zcache_get(pool_id, index);
 	local_irq_save(flags);
 	pool = zcache_get_pool_by_id(cli_id, pool_id);
 	if (likely(pool != NULL)) {
@@ -1613,6 +1859,7 @@ static int zcache_get_page(int cli_id, int pool_id, struct tmem_oid *oidp,
 		zcache_put_pool(pool);
 	}
 	local_irq_restore(flags);
+	trace_zcache_get_done(ret);
 	return ret;
 }
 
@@ -1972,6 +2219,15 @@ static int __init no_frontswap(char *s)
 
 __setup("nofrontswap", no_frontswap);
 
+/* compress cleancache puts synchronously, in the caller */
+static int __init no_zcache_batch(char *s)
+{
+	zcache_batch_enabled = false;
+	return 1;
+}
+
+__setup("nozcachebatch", no_zcache_batch);
+
 static int __init enable_zcache_compressor(char *s)
 {
 	strncpy(zcache_comp_name, s, ZCACHE_COMP_NAME_SZ);
@@ -2027,6 +2283,7 @@ static int __init zcache_init(void)
 
 		tmem_register_hostops(&zcache_hostops);
 		tmem_register_pamops(&zcache_pamops);
+		zcache_batch_init();
 		ret = register_cpu_notifier(&zcache_cpu_notifier_block);
 		if (ret) {
 			pr_err("zcache: can't register cpu notifier\n");
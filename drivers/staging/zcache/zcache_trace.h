@@ -0,0 +1,83 @@
+/*
+ * zcache tracepoints
+ *
+ * Each put and get emits an event on entry and a "_done" event with the
+ * result on return, so latency distributions can be built from the
+ * event timestamps.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM zcache
+
+#if !defined(_ZCACHE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ZCACHE_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(zcache_page_class,
+	TP_PROTO(int pool_id, uint32_t index),
+	TP_ARGS(pool_id, index),
+	TP_STRUCT__entry(
+		__field(int, pool_id)
+		__field(uint32_t, index)
+	),
+	TP_fast_assign(
+		__entry->pool_id = pool_id;
+		__entry->index = index;
+	),
+	TP_printk("pool=%d index=%u", __entry->pool_id, __entry->index)
+);
+
+#define DEFINE_ZCACHE_PAGE_EVENT(name)	\
+DEFINE_EVENT(zcache_page_class, name,	\
+	TP_PROTO(int pool_id, uint32_t index), \
+	TP_ARGS(pool_id, index))
+
+DEFINE_ZCACHE_PAGE_EVENT(zcache_put);
+DEFINE_ZCACHE_PAGE_EVENT(zcache_get);
+
+DECLARE_EVENT_CLASS(zcache_return_class,
+	TP_PROTO(int ret),
+	TP_ARGS(ret),
+	TP_STRUCT__entry(
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->ret = ret;
+	),
+	TP_printk("ret=%d", __entry->ret)
+);
+
+#define DEFINE_ZCACHE_RETURN_EVENT(name)	\
+DEFINE_EVENT(zcache_return_class, name,	\
+	TP_PROTO(int ret), \
+	TP_ARGS(ret))
+
+DEFINE_ZCACHE_RETURN_EVENT(zcache_put_done);
+DEFINE_ZCACHE_RETURN_EVENT(zcache_get_done);
+
+TRACE_EVENT(zcache_batch_compress,
+	TP_PROTO(int cpu, unsigned int nr),
+	TP_ARGS(cpu, nr),
+	TP_STRUCT__entry(
+		__field(int, cpu)
+		__field(unsigned int, nr)
+	),
+	TP_fast_assign(
+		__entry->cpu = cpu;
+		__entry->nr = nr;
+	),
+	TP_printk("cpu=%d nr=%u", __entry->cpu, __entry->nr)
+);
+
+#endif /* _ZCACHE_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE zcache_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,260 @@
+/*
+ * Compressed RAM block device: compression streams
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/*
+ * Algorithms offered in 'comp_algorithm'. Any other compressor known to
+ * the crypto API is accepted as well; these are just the ones we list.
+ */
+static const char * const backends[] = {
+	"lzo",
+	"lz4",
+	"deflate",
+	NULL
+};
+
+bool zcomp_available_algorithm(const char *name)
+{
+	return crypto_has_comp(name, 0, 0);
+}
+
+ssize_t zcomp_available_show(const char *cur, char *buf)
+{
+	bool known = false;
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(cur, backends[i])) {
+			known = true;
+			sz += sprintf(buf + sz, "[%s] ", backends[i]);
+		} else {
+			sz += sprintf(buf + sz, "%s ", backends[i]);
+		}
+	}
+	if (!known)
+		sz += sprintf(buf + sz, "[%s] ", cur);
+
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	/*
+	 * The buffer is 2 pages since some compressors can produce
+	 * output larger than their input for incompressible data.
+	 */
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/*
+ * Get an idle stream, sleeping until another request releases one if
+ * all of them are busy. Streams are never allocated from here: crypto
+ * transforms allocate with GFP_KERNEL, which is not safe on the I/O path.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	/* The pool was shrunk while this stream was in use */
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(zstrm);
+}
+
+/*
+ * Grow or shrink the pool. Streams in use when the pool shrinks are
+ * freed as they are released.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int max_strm)
+{
+	struct zcomp_strm *zstrm;
+	LIST_HEAD(free_list);
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = max_strm;
+	while (comp->avail_strm < max_strm) {
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp);
+
+		spin_lock(&comp->strm_lock);
+		if (!zstrm) {
+			comp->avail_strm--;
+			spin_unlock(&comp->strm_lock);
+			return -ENOMEM;
+		}
+		list_add(&zstrm->list, &comp->idle_strm);
+		wake_up(&comp->strm_wait);
+	}
+
+	while (comp->avail_strm > max_strm &&
+	       !list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_move(&zstrm->list, &free_list);
+		comp->avail_strm--;
+	}
+	spin_unlock(&comp->strm_lock);
+
+	while (!list_empty(&free_list)) {
+		zstrm = list_first_entry(&free_list, struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+
+	return 0;
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	unsigned int dlen = PAGE_SIZE * 2;
+	ktime_t start;
+	int ret;
+
+	start = ktime_get();
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				zstrm->buffer, &dlen);
+	if (unlikely(ret))
+		return ret;
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			&comp->stats.compr_time);
+	atomic64_add(dlen, &comp->stats.compr_data_size);
+	atomic64_inc(&comp->stats.num_compr);
+
+	*dst_len = dlen;
+	return 0;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	unsigned int dlen = PAGE_SIZE;
+	ktime_t start;
+	int ret;
+
+	start = ktime_get();
+	ret = crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dlen);
+	if (unlikely(ret))
+		return ret;
+
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)),
+			&comp->stats.decompr_time);
+	atomic64_inc(&comp->stats.num_decompr);
+
+	return 0;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * All max_strm streams are allocated up front, from process context,
+ * so that the I/O path never has to allocate one.
+ */
+struct zcomp *zcomp_create(const char *name, int max_strm)
+{
+	struct zcomp *comp;
+
+	if (!zcomp_available_algorithm(name))
+		return ERR_PTR(-EINVAL);
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	strlcpy(comp->name, name, sizeof(comp->name));
+
+	if (zcomp_set_max_streams(comp, max_strm)) {
+		zcomp_destroy(comp);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	return comp;
+}
@@ -0,0 +1,72 @@
+/*
+ * Compressed RAM block device: compression streams
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/atomic.h>
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+#define ZCOMP_DEFAULT_ALGORITHM	"lzo"
+
+/*
+ * A compression stream is the private state one I/O needs to compress
+ * or decompress a page: the output buffer and a crypto transform, which
+ * holds the algorithm's working memory. Streams are kept in a pool so
+ * that several requests can run the compressor at once.
+ */
+struct zcomp_strm {
+	/* compression/decompression buffer (2 pages) */
+	void *buffer;
+	struct crypto_comp *tfm;
+	struct list_head list;
+};
+
+/* Per-algorithm statistics, reset along with the device */
+struct zcomp_stats {
+	atomic64_t num_compr;		/* successful compressions */
+	atomic64_t num_decompr;		/* successful decompressions */
+	atomic64_t compr_data_size;	/* bytes produced by the compressor */
+	atomic64_t compr_time;		/* ns spent compressing */
+	atomic64_t decompr_time;	/* ns spent decompressing */
+};
+
+struct zcomp {
+	spinlock_t strm_lock;	/* protects idle_strm and avail_strm */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* streams allocated, idle or in use */
+	int max_strm;		/* upper bound on avail_strm */
+
+	char name[CRYPTO_MAX_ALG_NAME];
+	struct zcomp_stats stats;
+};
+
+bool zcomp_available_algorithm(const char *name);
+ssize_t zcomp_available_show(const char *cur, char *buf);
+
+struct zcomp *zcomp_create(const char *name, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+int zcomp_set_max_streams(struct zcomp *comp, int max_strm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+#endif
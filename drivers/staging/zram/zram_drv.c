@@ -26,10 +26,10 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
 #include <linux/device.h>
+#include <linux/err.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -89,21 +89,52 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Check if the page is one machine word repeated, and if so return that
+ * word in *element. All-zero pages are the most common case.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
+	unsigned long val;
 
 	page = (unsigned long *)ptr;
+	val = page[0];
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	/* Compare the last word first: mismatches usually show up early */
+	if (val != page[PAGE_SIZE / sizeof(*page) - 1])
+		return 0;
+
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page) - 1; pos++) {
+		if (page[pos] != val)
 			return 0;
 	}
 
+	*element = val;
 	return 1;
 }
 
+/*
+ * Fill len bytes (a multiple of sizeof(long)) with a repeated word. If
+ * all bytes of the word are equal this is a plain memset(), which the
+ * architectures implement with their widest stores; otherwise a simple
+ * word loop, which the compiler unrolls and vectorizes.
+ */
+static void zram_fill_page(void *ptr, unsigned int len, unsigned long value)
+{
+	unsigned long *page = ptr;
+	unsigned int pos;
+
+	if (value == (~0UL / 0xff) * (value & 0xff)) {
+		memset(ptr, value & 0xff, len);
+		return;
+	}
+
+	for (pos = 0; pos < len / sizeof(*page); pos++)
+		page[pos] = value;
+}
+
 static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 {
 	if (!zram->disksize) {
@@ -133,21 +164,141 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Block 0 of the backing device is never handed out, so that a written
+ * back page never has a NULL handle and 0 can mean "no free block".
+ */
+static unsigned long alloc_block_bdev(struct zram *zram)
+{
+	unsigned long blk_idx;
+
+	spin_lock(&zram->bitmap_lock);
+	blk_idx = find_next_zero_bit(zram->bitmap, zram->nr_pages, 1);
+	if (blk_idx >= zram->nr_pages) {
+		spin_unlock(&zram->bitmap_lock);
+		return 0;
+	}
+	set_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+
+	return blk_idx;
+}
+
+static void free_block_bdev(struct zram *zram, unsigned long blk_idx)
+{
+	spin_lock(&zram->bitmap_lock);
+	WARN_ON_ONCE(!test_bit(blk_idx, zram->bitmap));
+	clear_bit(blk_idx, zram->bitmap);
+	spin_unlock(&zram->bitmap_lock);
+}
+
+struct zram_bdev_io {
+	struct completion done;
+	int error;
+};
+
+static void zram_bdev_sync_end_io(struct bio *bio, int err)
+{
+	struct zram_bdev_io *io = bio->bi_private;
+
+	io->error = err;
+	complete(&io->done);
+}
+
+static int read_from_bdev(struct zram *zram, struct page *page,
+			unsigned long blk_idx)
+{
+	struct zram_bdev_io io;
+	struct bio *bio;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk_idx << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	init_completion(&io.done);
+	io.error = 0;
+	bio->bi_private = &io;
+	bio->bi_end_io = zram_bdev_sync_end_io;
+	submit_bio(READ, bio);
+	wait_for_completion(&io.done);
+	bio_put(bio);
+
+	if (!io.error)
+		zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return io.error;
+}
+
+/*
+ * Read the written back page at @index into @page. zram->lock is held for
+ * read and is dropped for the I/O, so that writers don't wait for the
+ * backing device. If any block was freed meanwhile, this one may have been
+ * reused, so -EAGAIN tells the caller to look at the slot again.
+ */
+static int zram_read_wb_page(struct zram *zram, struct page *page, u32 index)
+{
+	unsigned long blk_idx = (unsigned long)zram->table[index].handle;
+	unsigned long seq = zram->wb_free_seq;
+	int ret;
+
+	up_read(&zram->lock);
+	ret = read_from_bdev(zram, page, blk_idx);
+	down_read(&zram->lock);
+
+	if (zram->wb_free_seq != seq)
+		return -EAGAIN;
+	return ret;
+}
+
+static void zram_free_wb_page(struct zram *zram, size_t index)
+{
+	free_block_bdev(zram, (unsigned long)zram->table[index].handle);
+	zram->wb_free_seq++;
+	zram_clear_flag(zram, index, ZRAM_WB);
+	zram_stat_dec(&zram->stats.bd_count);
+
+	zram->table[index].handle = NULL;
+	zram->table[index].size = 0;
+}
+#endif
+
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	void *handle = zram->table[index].handle;
 
-	if (unlikely(!handle)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear same page flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		if (!zram->table[index].element)
 			zram_stat_dec(&zram->stats.pages_zero);
-		}
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Let a writeback in progress know that this page changed */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_free_wb_page(zram, index);
 		return;
 	}
+#endif
+
+	if (unlikely(!handle))
+		return;
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		__free_page(handle);
@@ -170,13 +321,13 @@ out:
 	zram->table[index].size = 0;
 }
 
-static void handle_zero_page(struct bio_vec *bvec)
+static void handle_same_page(struct bio_vec *bvec, unsigned long element)
 {
 	struct page *page = bvec->bv_page;
 	void *user_mem;
 
 	user_mem = kmap_atomic(page);
-	memset(user_mem + bvec->bv_offset, 0, bvec->bv_len);
+	zram_fill_page(user_mem + bvec->bv_offset, bvec->bv_len, element);
 	kunmap_atomic(user_mem);
 
 	flush_dcache_page(page);
@@ -198,6 +349,41 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	flush_dcache_page(page);
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+static int handle_wb_page(struct zram *zram, struct bio_vec *bvec,
+			  u32 index, int offset)
+{
+	int ret;
+	struct page *page = bvec->bv_page, *bounce;
+	unsigned char *user_mem, *src;
+
+	bounce = alloc_page(GFP_NOIO);
+	if (!bounce)
+		return -ENOMEM;
+
+	ret = zram_read_wb_page(zram, bounce, index);
+	if (ret == -EAGAIN)
+		goto out;
+	if (ret) {
+		pr_err("Backing device read failed! err=%d, page=%u\n",
+			ret, index);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		goto out;
+	}
+
+	user_mem = kmap_atomic(page);
+	src = kmap_atomic(bounce);
+	memcpy(user_mem + bvec->bv_offset, src + offset, bvec->bv_len);
+	kunmap_atomic(src);
+	kunmap_atomic(user_mem);
+
+	flush_dcache_page(page);
+out:
+	__free_page(bounce);
+	return ret;
+}
+#endif
+
 static inline int is_partial_io(struct bio_vec *bvec)
 {
 	return bvec->bv_len != PAGE_SIZE;
@@ -207,15 +393,16 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
+	struct zcomp_strm *zstrm;
 	struct zobj_header *zheader;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-		handle_zero_page(bvec);
+again:
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		handle_same_page(bvec, zram->table[index].element);
 		return 0;
 	}
 
@@ -223,10 +410,21 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	if (unlikely(!zram->table[index].handle)) {
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
+		handle_same_page(bvec, 0);
 		return 0;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		ret = handle_wb_page(zram, bvec, index, offset);
+		if (ret == -EAGAIN)
+			goto again;
+		return ret;
+	}
+#endif
+
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
@@ -242,16 +440,16 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 		}
 	}
 
+	zstrm = zcomp_strm_find(zram->comp);
 	user_mem = kmap_atomic(page);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				ZS_MM_RO);
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    uncmem, &clen);
+	ret = zcomp_decompress(zram->comp, zstrm, cmem + sizeof(*zheader),
+			       zram->table[index].size, uncmem);
 
 	if (is_partial_io(bvec)) {
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
@@ -261,9 +459,10 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 
 	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 	kunmap_atomic(user_mem);
+	zcomp_strm_release(zram->comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -274,35 +473,65 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	return 0;
 }
 
+/*
+ * Called with zram->lock held. It must be held only for read if the page
+ * may be on the backing device, since the lock is dropped for the read.
+ */
 static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
+	struct zcomp_strm *zstrm;
 	struct zobj_header *zheader;
 	unsigned char *cmem;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].handle) {
+again:
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_fill_page(mem, PAGE_SIZE, zram->table[index].element);
+		return 0;
+	}
+
+	if (!zram->table[index].handle) {
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		struct page *bounce = alloc_page(GFP_NOIO);
+
+		if (!bounce)
+			return -ENOMEM;
+		ret = zram_read_wb_page(zram, bounce, index);
+		if (!ret) {
+			cmem = kmap_atomic(bounce);
+			memcpy(mem, cmem, PAGE_SIZE);
+			kunmap_atomic(cmem);
+		}
+		__free_page(bounce);
+		if (ret == -EAGAIN)
+			goto again;
+		return ret;
+	}
+#endif
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic(zram->table[index].handle);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    zram->table[index].size,
-				    mem, &clen);
+	zstrm = zcomp_strm_find(zram->comp);
+	cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, zstrm, cmem + sizeof(*zheader),
+			       zram->table[index].size, mem);
 	zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+	zcomp_strm_release(zram->comp, zstrm);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -311,19 +540,25 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 	return 0;
 }
 
+/*
+ * Compression runs on a private stream and without zram->lock, so writes
+ * to different pages compress in parallel. The lock is only taken for
+ * write to swap the new object into the table.
+ */
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
 	int ret;
-	u32 store_offset;
 	size_t clen;
 	void *handle;
+	unsigned long element;
+	bool uncompressed = false;
 	struct zobj_header *zheader;
+	struct zcomp_strm *zstrm = NULL;
 	struct page *page, *page_store;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
@@ -336,21 +571,13 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			ret = -ENOMEM;
 			goto out;
 		}
+		down_read(&zram->lock);
 		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		up_read(&zram->lock);
+		if (ret)
 			goto out;
-		}
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].handle ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page);
 
 	if (is_partial_io(bvec))
@@ -359,24 +586,37 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	else
 		uncmem = user_mem;
 
-	if (page_zero_filled(uncmem)) {
+	/* Same filled pages need neither a stream nor any memory */
+	if (page_same_filled(uncmem, &element)) {
 		kunmap_atomic(user_mem);
 		if (is_partial_io(bvec))
 			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
-		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
-		goto out;
+
+		down_write(&zram->lock);
+		zram_free_page(zram, index);
+		if (!element)
+			zram_stat_inc(&zram->stats.pages_zero);
+		zram_stat_inc(&zram->stats.pages_same);
+		zram_set_flag(zram, index, ZRAM_SAME);
+		zram->table[index].element = element;
+		up_write(&zram->lock);
+		return 0;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	/* Getting a stream may sleep */
+	kunmap_atomic(user_mem);
+	zstrm = zcomp_strm_find(zram->comp);
+	user_mem = kmap_atomic(page);
+	if (!is_partial_io(bvec))
+		uncmem = user_mem;
+
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
 	kunmap_atomic(user_mem);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	if (!is_partial_io(bvec))
+		uncmem = NULL;
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -396,13 +636,18 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
+		uncompressed = true;
 		handle = page_store;
-		src = kmap_atomic(page);
 		cmem = kmap_atomic(page_store);
-		goto memstore;
+		if (is_partial_io(bvec)) {
+			memcpy(cmem, uncmem, PAGE_SIZE);
+		} else {
+			src = kmap_atomic(page);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(src);
+		}
+		kunmap_atomic(cmem);
+		goto memstored;
 	}
 
 	handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
@@ -412,39 +657,52 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = -ENOMEM;
 		goto out;
 	}
-	cmem = zs_map_object(zram->mem_pool, handle);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
-memstore:
 #if 0
 	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
+	zheader = (struct zobj_header *)cmem;
+	zheader->table_idx = index;
+	cmem += sizeof(*zheader);
 #endif
 
-	memcpy(cmem, src, clen);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		kunmap_atomic(cmem);
-		kunmap_atomic(src);
-	} else {
-		zs_unmap_object(zram->mem_pool, handle);
-	}
+memstored:
+	zcomp_strm_release(zram->comp, zstrm);
+	zstrm = NULL;
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	down_write(&zram->lock);
+	zram_free_page(zram, index);
 
 	zram->table[index].handle = handle;
 	zram->table[index].size = clen;
+	if (uncompressed) {
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+		zram_stat_inc(&zram->stats.pages_expand);
+	}
 
 	/* Update stats */
 	zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
+	up_write(&zram->lock);
 
 	return 0;
 
 out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
@@ -460,14 +718,277 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
 		up_read(&zram->lock);
 	} else {
-		down_write(&zram->lock);
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
 	}
 
 	return ret;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Max no. of pages a writeback pass keeps in flight at once */
+#define ZRAM_WB_BATCH	32
+
+struct zram_wb_req {
+	struct page *page;
+	u32 index;
+	unsigned long blk_idx;
+	int error;
+	struct zram_wb_batch *batch;
+};
+
+struct zram_wb_batch {
+	struct zram_wb_req reqs[ZRAM_WB_BATCH];
+	int nr;
+	atomic_t pending;
+	struct completion done;
+};
+
+static void zram_wb_end_io(struct bio *bio, int err)
+{
+	struct zram_wb_req *req = bio->bi_private;
+
+	req->error = err;
+	if (atomic_dec_and_test(&req->batch->pending))
+		complete(&req->batch->done);
+	bio_put(bio);
+}
+
+static bool zram_wb_candidate(struct zram *zram, u32 index,
+			enum zram_wb_mode mode)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_SAME) ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return false;
+
+	if (mode == ZRAM_WB_IDLE)
+		return zram_test_flag(zram, index, ZRAM_IDLE);
+	return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+}
+
+/*
+ * Copy a page out and reserve a block for it. The page is flagged
+ * ZRAM_UNDER_WB; if it is overwritten or freed while its bio is in
+ * flight, zram_free_page() drops the flag and the copy is discarded.
+ */
+static int zram_wb_prepare(struct zram *zram, struct zram_wb_req *req,
+			u32 index, enum zram_wb_mode mode)
+{
+	unsigned char *mem;
+	int ret;
+
+	down_write(&zram->lock);
+	if (!zram_wb_candidate(zram, index, mode)) {
+		up_write(&zram->lock);
+		return -ENOENT;
+	}
+
+	mem = kmap(req->page);
+	ret = zram_read_before_write(zram, mem, index);
+	kunmap(req->page);
+	if (!ret)
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+	up_write(&zram->lock);
+	if (ret)
+		return ret;
+
+	req->blk_idx = alloc_block_bdev(zram);
+	if (!req->blk_idx) {
+		down_write(&zram->lock);
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		up_write(&zram->lock);
+		return -ENOSPC;
+	}
+	req->index = index;
+
+	return 0;
+}
+
+static void zram_wb_submit(struct zram *zram, struct zram_wb_batch *batch)
+{
+	struct zram_wb_req *req;
+	struct bio *bio;
+	int i;
+
+	atomic_set(&batch->pending, 1);
+	init_completion(&batch->done);
+
+	for (i = 0; i < batch->nr; i++) {
+		req = &batch->reqs[i];
+		req->error = 0;
+		req->batch = batch;
+
+		bio = bio_alloc(GFP_NOIO, 1);
+		if (!bio) {
+			req->error = -ENOMEM;
+			continue;
+		}
+		bio->bi_bdev = zram->bdev;
+		bio->bi_sector = req->blk_idx << SECTORS_PER_PAGE_SHIFT;
+		bio_add_page(bio, req->page, PAGE_SIZE, 0);
+		bio->bi_private = req;
+		bio->bi_end_io = zram_wb_end_io;
+
+		atomic_inc(&batch->pending);
+		submit_bio(WRITE, bio);
+	}
+
+	if (!atomic_dec_and_test(&batch->pending))
+		wait_for_completion(&batch->done);
+}
+
+static void zram_wb_complete(struct zram *zram, struct zram_wb_batch *batch)
+{
+	struct zram_wb_req *req;
+	int i;
+
+	down_write(&zram->lock);
+	for (i = 0; i < batch->nr; i++) {
+		req = &batch->reqs[i];
+
+		if (req->error ||
+		    !zram_test_flag(zram, req->index, ZRAM_UNDER_WB)) {
+			zram_clear_flag(zram, req->index, ZRAM_UNDER_WB);
+			free_block_bdev(zram, req->blk_idx);
+			continue;
+		}
+
+		zram_free_page(zram, req->index);
+		zram->table[req->index].handle = (void *)req->blk_idx;
+		zram_set_flag(zram, req->index, ZRAM_WB);
+		zram_stat_inc(&zram->stats.bd_count);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+	}
+	up_write(&zram->lock);
+}
+
+static void zram_writeback_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work);
+	struct zram_wb_batch *batch;
+	enum zram_wb_mode mode;
+	size_t index, nr_pages;
+	int i, ret = 0;
+
+	batch = kzalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return;
+	for (i = 0; i < ZRAM_WB_BATCH; i++) {
+		batch->reqs[i].page = alloc_page(GFP_KERNEL);
+		if (!batch->reqs[i].page)
+			goto out;
+	}
+
+	/* Holding init_lock keeps a reset from running under us */
+	down_read(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev)
+		goto out_unlock;
+
+	mode = zram->wb_mode;
+	nr_pages = zram->disksize >> PAGE_SHIFT;
+	for (index = 0; index < nr_pages && ret != -ENOSPC; index++) {
+		ret = zram_wb_prepare(zram, &batch->reqs[batch->nr],
+				index, mode);
+		if (!ret)
+			batch->nr++;
+
+		if (batch->nr == ZRAM_WB_BATCH ||
+		    (batch->nr && (ret == -ENOSPC || index == nr_pages - 1))) {
+			zram_wb_submit(zram, batch);
+			zram_wb_complete(zram, batch);
+			batch->nr = 0;
+			cond_resched();
+		}
+	}
+
+out_unlock:
+	up_read(&zram->init_lock);
+out:
+	for (i = 0; i < ZRAM_WB_BATCH; i++)
+		if (batch->reqs[i].page)
+			__free_page(batch->reqs[i].page);
+	kfree(batch);
+}
+
+/*
+ * Queue a writeback pass. It runs in the background; progress can be
+ * followed through bd_stat.
+ */
+void zram_start_writeback(struct zram *zram, enum zram_wb_mode mode)
+{
+	zram->wb_mode = mode;
+	queue_work(system_unbound_wq, &zram->wb_work);
+}
+
+/* Mark every stored page idle; any later access clears the mark */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	down_write(&zram->lock);
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_SAME) &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+	}
+	up_write(&zram->lock);
+}
+
+static void zram_reset_backing_dev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	vfree(zram->bitmap);
+	kfree(zram->backing_dev);
+
+	zram->bdev = NULL;
+	zram->bitmap = NULL;
+	zram->backing_dev = NULL;
+	zram->nr_pages = 0;
+}
+
+/* Called with init_lock held for write, before the device is set up */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	struct block_device *bdev;
+	unsigned long nr_pages, *bitmap;
+	char *name;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE |
+				FMODE_EXCL, zram);
+	if (IS_ERR(bdev)) {
+		kfree(name);
+		return PTR_ERR(bdev);
+	}
+
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (nr_pages < 2 || !bitmap) {
+		vfree(bitmap);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(name);
+		return nr_pages < 2 ? -EINVAL : -ENOMEM;
+	}
+
+	zram_reset_backing_dev(zram);
+	zram->bdev = bdev;
+	zram->bitmap = bitmap;
+	zram->nr_pages = nr_pages;
+	zram->backing_dev = name;
+	pr_info("setup backing device %s\n", name);
+
+	return 0;
+}
+#endif
+
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 {
 	if (*offset + bvec->bv_len >= PAGE_SIZE)
@@ -583,18 +1104,22 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
 		void *handle = zram->table[index].handle;
-		if (!handle)
+		if (!handle || zram_test_flag(zram, index, ZRAM_SAME))
+			continue;
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Blocks on the backing device go with the bitmap */
+		if (zram_test_flag(zram, index, ZRAM_WB))
 			continue;
+#endif
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
 			__free_page(handle);
@@ -608,6 +1133,10 @@ void __zram_reset_device(struct zram *zram)
 	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	zram_reset_backing_dev(zram);
+#endif
+
 	/* Reset stats */
 	memset(&zram->stats, 0, sizeof(zram->stats));
 
@@ -635,18 +1164,12 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer =
-		(void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (IS_ERR(zram->comp)) {
+		pr_err("Error initializing %s compressor\n",
+			zram->compressor);
+		ret = PTR_ERR(zram->comp);
+		zram->comp = NULL;
 		goto fail_no_table;
 	}
 
@@ -708,6 +1231,15 @@ static int create_device(struct zram *zram, int device_id)
 	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->bitmap_lock);
+	INIT_WORK(&zram->wb_work, zram_writeback_work);
+#endif
+
+	/* Let every online CPU compress at once by default */
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, ZCOMP_DEFAULT_ALGORITHM,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -767,6 +1299,9 @@ out:
 
 static void destroy_device(struct zram *zram)
 {
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_work_sync(&zram->wb_work);
+#endif
 	sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
 			&zram_disk_attr_group);
 
@@ -0,0 +1,203 @@
+/*
+ * zsmalloc microbenchmark
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the license that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Loading this module runs zs_malloc(), zs_map_object() and zs_free()
+ * from 1 up to num_online_cpus() threads, each bound to its own cpu and
+ * working on a shared pool, and reports the aggregate number of
+ * operations per second for each thread count. The module then refuses
+ * to stay loaded.
+ */
+
+#define pr_fmt(fmt) "zsmalloc-bench: " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/err.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+
+static unsigned int nr_objs = 1024;
+module_param(nr_objs, uint, 0);
+MODULE_PARM_DESC(nr_objs, "Objects allocated per thread and iteration");
+
+static unsigned int iterations = 64;
+module_param(iterations, uint, 0);
+MODULE_PARM_DESC(iterations, "Iterations per thread");
+
+enum zs_bench_op {
+	ZS_BENCH_MALLOC,
+	ZS_BENCH_MAP,
+	ZS_BENCH_FREE,
+	NR_ZS_BENCH_OPS,
+};
+
+static const char * const op_names[NR_ZS_BENCH_OPS] = {
+	"malloc", "map", "free",
+};
+
+struct zs_bench {
+	struct zs_pool *pool;
+	struct completion done;
+	/* sum over threads of per-thread ops/s */
+	atomic64_t rate[NR_ZS_BENCH_OPS];
+	atomic_t failed;
+};
+
+/*
+ * Sizes are spread over the classes zram typically uses, so that some
+ * objects span two pages.
+ */
+static size_t zs_bench_size(unsigned int i)
+{
+	return 64 + (i * 97) % (PAGE_SIZE * 3 / 4 - 64);
+}
+
+static void zs_bench_account(struct zs_bench *bench, enum zs_bench_op op,
+			u64 ops, s64 ns)
+{
+	if (ns <= 0)
+		ns = 1;
+	atomic64_add(div64_u64(ops * NSEC_PER_SEC, ns), &bench->rate[op]);
+}
+
+static int zs_bench_thread(void *data)
+{
+	struct zs_bench *bench = data;
+	void **handles;
+	unsigned int i, iter;
+	u64 ops = (u64)nr_objs * iterations;
+	ktime_t t[NR_ZS_BENCH_OPS];
+	s64 ns[NR_ZS_BENCH_OPS] = { 0 };
+	enum zs_bench_op op;
+	void *obj;
+
+	handles = kcalloc(nr_objs, sizeof(*handles), GFP_KERNEL);
+	if (!handles) {
+		atomic_inc(&bench->failed);
+		goto out;
+	}
+
+	for (iter = 0; iter < iterations; iter++) {
+		t[ZS_BENCH_MALLOC] = ktime_get();
+		for (i = 0; i < nr_objs; i++)
+			handles[i] = zs_malloc(bench->pool, zs_bench_size(i));
+		ns[ZS_BENCH_MALLOC] += ktime_to_ns(ktime_sub(ktime_get(),
+						t[ZS_BENCH_MALLOC]));
+
+		t[ZS_BENCH_MAP] = ktime_get();
+		for (i = 0; i < nr_objs; i++) {
+			if (!handles[i])
+				continue;
+			obj = zs_map_object(bench->pool, handles[i], ZS_MM_RW);
+			memset(obj, i, sizeof(long));
+			zs_unmap_object(bench->pool, handles[i]);
+		}
+		ns[ZS_BENCH_MAP] += ktime_to_ns(ktime_sub(ktime_get(),
+						t[ZS_BENCH_MAP]));
+
+		t[ZS_BENCH_FREE] = ktime_get();
+		for (i = 0; i < nr_objs; i++) {
+			if (!handles[i]) {
+				atomic_inc(&bench->failed);
+				continue;
+			}
+			zs_free(bench->pool, handles[i]);
+		}
+		ns[ZS_BENCH_FREE] += ktime_to_ns(ktime_sub(ktime_get(),
+						t[ZS_BENCH_FREE]));
+
+		cond_resched();
+	}
+
+	for (op = 0; op < NR_ZS_BENCH_OPS; op++)
+		zs_bench_account(bench, op, ops, ns[op]);
+	kfree(handles);
+out:
+	complete_and_exit(&bench->done, 0);
+}
+
+static int zs_bench_run(unsigned int nr_threads)
+{
+	struct zs_bench *bench;
+	struct task_struct *task;
+	unsigned int cpu, started = 0;
+	enum zs_bench_op op;
+	int ret = 0;
+
+	bench = kzalloc(sizeof(*bench), GFP_KERNEL);
+	if (!bench)
+		return -ENOMEM;
+
+	bench->pool = zs_create_pool("zs_bench", GFP_KERNEL | __GFP_HIGHMEM);
+	if (!bench->pool) {
+		kfree(bench);
+		return -ENOMEM;
+	}
+	init_completion(&bench->done);
+
+	for_each_online_cpu(cpu) {
+		if (started == nr_threads)
+			break;
+		task = kthread_create(zs_bench_thread, bench,
+				"zs_bench/%u", cpu);
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			break;
+		}
+		kthread_bind(task, cpu);
+		wake_up_process(task);
+		started++;
+	}
+
+	while (started--)
+		wait_for_completion(&bench->done);
+
+	if (!ret) {
+		pr_info("%u thread(s):", nr_threads);
+		for (op = 0; op < NR_ZS_BENCH_OPS; op++)
+			pr_cont(" %s %llu/s", op_names[op],
+				(u64)atomic64_read(&bench->rate[op]));
+		pr_cont("%s\n", atomic_read(&bench->failed) ?
+			" (allocation failures)" : "");
+	}
+
+	zs_destroy_pool(bench->pool);
+	kfree(bench);
+
+	return ret;
+}
+
+static int __init zs_bench_init(void)
+{
+	unsigned int nr_threads;
+	int ret;
+
+	pr_info("%u objects x %u iterations per thread\n",
+		nr_objs, iterations);
+
+	for (nr_threads = 1; nr_threads <= num_online_cpus(); nr_threads++) {
+		ret = zs_bench_run(nr_threads);
+		if (ret)
+			return ret;
+	}
+
+	return -EAGAIN;
+}
+module_init(zs_bench_init);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("zsmalloc microbenchmark");
@@ -16,12 +16,16 @@
 
 #include <linux/module.h>
 #include <linux/kernel.h>
+#include <linux/bit_spinlock.h>
 #include <linux/bitops.h>
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
+#include <linux/uaccess.h>
 #include <asm/tlbflush.h>
 #include <asm/pgtable.h>
 #include <linux/cpumask.h>
@@ -43,6 +47,10 @@
 /* per-cpu VM mapping areas for zspage accesses that cross page boundaries */
 static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
 
+/* Handles for all pools; created along with the first pool */
+static struct kmem_cache *zs_handle_cache;
+static DEFINE_MUTEX(zs_handle_cache_lock);
+
 static int is_first_page(struct page *page)
 {
 	return test_bit(PG_private, &page->flags);
@@ -159,7 +167,7 @@ static enum fullness_group fix_fullness_group(struct zs_pool *pool,
 	if (newfg == currfg)
 		goto out;
 
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	remove_zspage(page, class, currfg);
 	insert_zspage(page, class, newfg);
 	set_zspage_mapping(page, class_idx, newfg);
@@ -230,30 +238,58 @@ static struct page *get_next_page(struct page *page)
 	return next;
 }
 
-/* Encode <page, obj_idx> as a single handle value */
-static void *obj_location_to_handle(struct page *page, unsigned long obj_idx)
+/* Encode <page, obj_idx> as a single obj value */
+static unsigned long location_to_obj(struct page *page, unsigned long obj_idx)
 {
-	unsigned long handle;
+	unsigned long obj;
 
 	if (!page) {
 		BUG_ON(obj_idx);
-		return NULL;
+		return 0;
 	}
 
-	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
-	handle |= (obj_idx & OBJ_INDEX_MASK);
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= (obj_idx & OBJ_INDEX_MASK);
 
-	return (void *)handle;
+	return obj << OBJ_TAG_BITS;
 }
 
-/* Decode <page, obj_idx> pair from the given object handle */
-static void obj_handle_to_location(void *handle, struct page **page,
+/* Decode <page, obj_idx> pair from the given obj value */
+static void obj_to_location(unsigned long obj, struct page **page,
 				unsigned long *obj_idx)
 {
-	unsigned long hval = (unsigned long)handle;
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = obj & OBJ_INDEX_MASK;
+}
+
+static unsigned long handle_to_obj(void *handle)
+{
+	return *(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT);
+}
+
+static void record_obj(void *handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+/*
+ * A pinned handle's object is not moved by compaction. Objects are
+ * pinned while mapped and while being freed.
+ */
+static void pin_tag(void *handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(void *handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
 
-	*page = pfn_to_page(hval >> OBJ_INDEX_BITS);
-	*obj_idx = hval & OBJ_INDEX_MASK;
+static void unpin_tag(void *handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
 }
 
 static unsigned long obj_idx_to_offset(struct page *page,
@@ -330,7 +366,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		for (i = 1; i <= objs_on_page; i++) {
 			off += class->size;
 			if (off < PAGE_SIZE) {
-				link->next = obj_location_to_handle(page, i);
+				link->next = location_to_obj(page, i);
 				link += class->size / sizeof(*link);
 			}
 		}
@@ -341,7 +377,7 @@ static void init_zspage(struct page *first_page, struct size_class *class)
 		 * page (if present)
 		 */
 		next_page = get_next_page(page);
-		link->next = obj_location_to_handle(next_page, 0);
+		link->next = location_to_obj(next_page, 0);
 		kunmap_atomic(link);
 		page = next_page;
 		off = (off + class->size) % PAGE_SIZE;
@@ -396,7 +432,7 @@ static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
 
 	init_zspage(first_page, class);
 
-	first_page->freelist = obj_location_to_handle(first_page, 0);
+	first_page->freelist = (void *)location_to_obj(first_page, 0);
 	/* Maximum number of objects we can store in this zspage */
 	first_page->objects = class->zspage_order * PAGE_SIZE / class->size;
 
@@ -426,27 +462,181 @@ static struct page *find_get_zspage(struct size_class *class)
 }
 
 
+#ifdef ZS_MAP_PTES
+static int zs_cpu_up(struct mapping_area *area)
+{
+	if (area->vm)
+		return 0;
+	area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
+	if (!area->vm)
+		return -ENOMEM;
+	return 0;
+}
+
+static void zs_cpu_down(struct mapping_area *area)
+{
+	if (area->vm)
+		free_vm_area(area->vm);
+	area->vm = NULL;
+}
+
+static void *__zs_map_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	set_pte(area->vm_ptes[0], mk_pte(pages[0], PAGE_KERNEL));
+	set_pte(area->vm_ptes[1], mk_pte(pages[1], PAGE_KERNEL));
+	area->vm_addr = area->vm->addr;
+	return area->vm_addr + off;
+}
+
+static void __zs_unmap_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	set_pte(area->vm_ptes[0], __pte(0));
+	set_pte(area->vm_ptes[1], __pte(0));
+	__flush_tlb_one((unsigned long)area->vm_addr);
+	__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+}
+
+#elif defined(ZS_MAP_VM_AREA)
+static int zs_cpu_up(struct mapping_area *area)
+{
+	if (area->vm)
+		return 0;
+	area->vm = alloc_vm_area(2 * PAGE_SIZE, NULL);
+	if (!area->vm)
+		return -ENOMEM;
+	return 0;
+}
+
+static void zs_cpu_down(struct mapping_area *area)
+{
+	if (area->vm)
+		free_vm_area(area->vm);
+	area->vm = NULL;
+}
+
+static void *__zs_map_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	struct page **page_array = pages;
+
+	/* We pre-allocated the VM area, so mapping cannot fail */
+	BUG_ON(map_vm_area(area->vm, PAGE_KERNEL, &page_array));
+	area->vm_addr = area->vm->addr;
+	return area->vm_addr + off;
+}
+
+static void __zs_unmap_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	unsigned long addr = (unsigned long)area->vm_addr;
+
+	unmap_kernel_range(addr, PAGE_SIZE * 2);
+}
+
+#else /* copy through vm_buf */
+static int zs_cpu_up(struct mapping_area *area)
+{
+	if (area->vm_buf)
+		return 0;
+	area->vm_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!area->vm_buf)
+		return -ENOMEM;
+	return 0;
+}
+
+static void zs_cpu_down(struct mapping_area *area)
+{
+	kfree(area->vm_buf);
+	area->vm_buf = NULL;
+}
+
+static void *__zs_map_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	int sizes[2];
+	void *addr;
+	char *buf = area->vm_buf;
+
+	/* disable page faults to match kmap_atomic() return conditions */
+	pagefault_disable();
+
+	/* no read fastpath */
+	if (area->vm_mm == ZS_MM_WO)
+		goto out;
+
+	sizes[0] = PAGE_SIZE - off;
+	sizes[1] = size - sizes[0];
+
+	/* copy object to per-cpu buffer */
+	addr = kmap_atomic(pages[0]);
+	memcpy(buf, addr + off, sizes[0]);
+	kunmap_atomic(addr);
+	addr = kmap_atomic(pages[1]);
+	memcpy(buf + sizes[0], addr, sizes[1]);
+	kunmap_atomic(addr);
+out:
+	area->vm_addr = area->vm_buf;
+	return area->vm_buf;
+}
+
+static void __zs_unmap_object(struct mapping_area *area,
+				struct page *pages[2], int off, int size)
+{
+	int sizes[2];
+	void *addr;
+	char *buf = area->vm_buf;
+
+	/* no write fastpath */
+	if (area->vm_mm == ZS_MM_RO)
+		goto out;
+
+	/*
+	 * The handle in front of the object is compaction's, and a
+	 * ZS_MM_WO map never copied it in: leave it alone.  It may end
+	 * right at, or past, the end of the first page.
+	 */
+	buf += ZS_HANDLE_SIZE;
+	off += ZS_HANDLE_SIZE;
+	size -= ZS_HANDLE_SIZE;
+
+	sizes[0] = max_t(int, PAGE_SIZE - off, 0);
+	sizes[1] = size - sizes[0];
+
+	/* copy per-cpu buffer to object */
+	if (sizes[0]) {
+		addr = kmap_atomic(pages[0]);
+		memcpy(addr + off, buf, sizes[0]);
+		kunmap_atomic(addr);
+	}
+	addr = kmap_atomic(pages[1]);
+	memcpy(addr + off + sizes[0] - PAGE_SIZE, buf + sizes[0], sizes[1]);
+	kunmap_atomic(addr);
+
+out:
+	/* enable page faults to match kunmap_atomic() return conditions */
+	pagefault_enable();
+}
+#endif
+
 static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
 				void *pcpu)
 {
-	int cpu = (long)pcpu;
+	int ret, cpu = (long)pcpu;
 	struct mapping_area *area;
 
 	switch (action) {
 	case CPU_UP_PREPARE:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			break;
-		area->vm = alloc_vm_area(2 * PAGE_SIZE, area->vm_ptes);
-		if (!area->vm)
-			return notifier_from_errno(-ENOMEM);
+		ret = zs_cpu_up(area);
+		if (ret)
+			return notifier_from_errno(ret);
 		break;
 	case CPU_DEAD:
 	case CPU_UP_CANCELED:
 		area = &per_cpu(zs_map_area, cpu);
-		if (area->vm)
-			free_vm_area(area->vm);
-		area->vm = NULL;
+		zs_cpu_down(area);
 		break;
 	}
 
@@ -461,6 +651,9 @@ static void zs_exit(void)
 {
 	int cpu;
 
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+
 	for_each_online_cpu(cpu)
 		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
 	unregister_cpu_notifier(&zs_cpu_nb);
@@ -482,16 +675,46 @@ fail:
 	return notifier_to_errno(ret);
 }
 
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc);
+
+static int zs_create_handle_cache(void)
+{
+	int ret = 0;
+
+	mutex_lock(&zs_handle_cache_lock);
+	if (!zs_handle_cache) {
+		zs_handle_cache = kmem_cache_create("zs_handle",
+					ZS_HANDLE_SIZE, 0, 0, NULL);
+		if (!zs_handle_cache)
+			ret = -ENOMEM;
+	}
+	mutex_unlock(&zs_handle_cache_lock);
+
+	return ret;
+}
+
+static void zs_free_classes(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		kfree(pool->size_class[i]);
+	kfree(pool);
+}
+
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 {
-	int i, ovhd_size;
+	int i;
 	struct zs_pool *pool;
 
 	if (!name)
 		return NULL;
 
-	ovhd_size = roundup(sizeof(*pool), PAGE_SIZE);
-	pool = kzalloc(ovhd_size, GFP_KERNEL);
+	if (zs_create_handle_cache())
+		return NULL;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
 	if (!pool)
 		return NULL;
 
@@ -503,7 +726,18 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 		if (size > ZS_MAX_ALLOC_SIZE)
 			size = ZS_MAX_ALLOC_SIZE;
 
-		class = &pool->size_class[i];
+		/*
+		 * Classes are allocated one by one so that each lock gets
+		 * its own cacheline: CPUs allocating from different classes
+		 * then never contend.
+		 */
+		class = kzalloc(sizeof(*class), GFP_KERNEL);
+		if (!class) {
+			zs_free_classes(pool);
+			return NULL;
+		}
+		pool->size_class[i] = class;
+
 		class->size = size;
 		class->index = i;
 		spin_lock_init(&class->lock);
@@ -514,6 +748,10 @@ struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
 	pool->flags = flags;
 	pool->name = name;
 
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
 	return pool;
 }
 EXPORT_SYMBOL_GPL(zs_create_pool);
@@ -522,9 +760,11 @@ void zs_destroy_pool(struct zs_pool *pool)
 {
 	int i;
 
+	unregister_shrinker(&pool->shrinker);
+
 	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
 		int fg;
-		struct size_class *class = &pool->size_class[i];
+		struct size_class *class = pool->size_class[i];
 
 		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
 			if (class->fullness_list[fg]) {
@@ -534,38 +774,90 @@ void zs_destroy_pool(struct zs_pool *pool)
 			}
 		}
 	}
-	kfree(pool);
+	zs_free_classes(pool);
 }
 EXPORT_SYMBOL_GPL(zs_destroy_pool);
 
+/*
+ * Take a free object off the given zspage's freelist and record the
+ * handle that owns it. Called with class->lock held.
+ */
+static unsigned long obj_malloc(struct page *first_page,
+		struct size_class *class, void *handle)
+{
+	unsigned long obj;
+	struct link_free *link;
+
+	struct page *m_page;
+	unsigned long m_objidx, m_offset;
+
+	obj = (unsigned long)first_page->freelist;
+	obj_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)kmap_atomic(m_page) +
+					m_offset / sizeof(*link);
+	first_page->freelist = (void *)link->next;
+	link->handle = (unsigned long)handle | OBJ_ALLOCATED_TAG;
+	kunmap_atomic(link);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+
+	return obj;
+}
+
+/* Put an object back on its zspage's freelist. Called with class->lock */
+static void obj_free(struct size_class *class, unsigned long obj)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	obj_to_location(obj, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
+							+ f_offset);
+	link->next = (unsigned long)first_page->freelist;
+	kunmap_atomic(link);
+	first_page->freelist = (void *)obj;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+}
+
 /**
  * zs_malloc - Allocate block of given size from pool.
  * @pool: pool to allocate from
  * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
  *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
+ * On success, handle to the allocated object is returned,
+ * otherwise NULL.
  *
- * Allocation requests with size > ZS_MAX_ALLOC_SIZE will fail.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
  */
 void *zs_malloc(struct zs_pool *pool, size_t size)
 {
-	void *obj;
-	struct link_free *link;
+	void *handle;
+	unsigned long obj;
 	int class_idx;
 	struct size_class *class;
+	struct page *first_page;
 
-	struct page *first_page, *m_page;
-	unsigned long m_objidx, m_offset;
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return NULL;
 
-	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+	handle = kmem_cache_alloc(zs_handle_cache,
+				pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
 		return NULL;
 
+	size += ZS_HANDLE_SIZE;
 	class_idx = get_size_class_index(size);
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	BUG_ON(class_idx != class->index);
 
 	spin_lock(&class->lock);
@@ -574,76 +866,82 @@ void *zs_malloc(struct zs_pool *pool, size_t size)
 	if (!first_page) {
 		spin_unlock(&class->lock);
 		first_page = alloc_zspage(class, pool->flags);
-		if (unlikely(!first_page))
+		if (unlikely(!first_page)) {
+			kmem_cache_free(zs_handle_cache, handle);
 			return NULL;
+		}
 
 		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
 		spin_lock(&class->lock);
 		class->pages_allocated += class->zspage_order;
 	}
 
-	obj = first_page->freelist;
-	obj_handle_to_location(obj, &m_page, &m_objidx);
-	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
-
-	link = (struct link_free *)kmap_atomic(m_page) +
-					m_offset / sizeof(*link);
-	first_page->freelist = link->next;
-	memset(link, POISON_INUSE, sizeof(*link));
-	kunmap_atomic(link);
+	obj = obj_malloc(first_page, class, handle);
+	record_obj(handle, obj);
 
-	first_page->inuse++;
 	/* Now move the zspage to another fullness group, if required */
 	fix_fullness_group(pool, first_page);
 	spin_unlock(&class->lock);
 
-	return obj;
+	return handle;
 }
 EXPORT_SYMBOL_GPL(zs_malloc);
 
-void zs_free(struct zs_pool *pool, void *obj)
+void zs_free(struct zs_pool *pool, void *handle)
 {
-	struct link_free *link;
+	unsigned long obj;
 	struct page *first_page, *f_page;
-	unsigned long f_objidx, f_offset;
+	unsigned long f_objidx;
 
 	int class_idx;
 	struct size_class *class;
 	enum fullness_group fullness;
 
-	if (unlikely(!obj))
+	if (unlikely(!handle))
 		return;
 
-	obj_handle_to_location(obj, &f_page, &f_objidx);
+	/* Keep compaction from moving the object under us */
+	pin_tag(handle);
+	obj = handle_to_obj(handle);
+	obj_to_location(obj, &f_page, &f_objidx);
 	first_page = get_first_page(f_page);
 
 	get_zspage_mapping(first_page, &class_idx, &fullness);
-	class = &pool->size_class[class_idx];
-	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+	class = pool->size_class[class_idx];
 
 	spin_lock(&class->lock);
-
-	/* Insert this object in containing zspage's freelist */
-	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page)
-							+ f_offset);
-	link->next = first_page->freelist;
-	kunmap_atomic(link);
-	first_page->freelist = obj;
-
-	first_page->inuse--;
+	obj_free(class, obj);
 	fullness = fix_fullness_group(pool, first_page);
 
 	if (fullness == ZS_EMPTY)
 		class->pages_allocated -= class->zspage_order;
 
 	spin_unlock(&class->lock);
+	unpin_tag(handle);
 
 	if (fullness == ZS_EMPTY)
 		free_zspage(first_page);
+
+	kmem_cache_free(zs_handle_cache, handle);
 }
 EXPORT_SYMBOL_GPL(zs_free);
 
-void *zs_map_object(struct zs_pool *pool, void *handle)
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: how the object will be accessed, see enum zs_mapmode
+ *
+ * Before using an object allocated from zs_malloc, it must be mapped
+ * using this function. When done with the object, it must be unmapped
+ * using zs_unmap_object. Only one object can be mapped per cpu at a
+ * time, and the cpu may not sleep while it is mapped.
+ *
+ * The handle stays pinned until zs_unmap_object(), so that compaction
+ * cannot move the object while it is in use.
+ */
+void *zs_map_object(struct zs_pool *pool, void *handle,
+			enum zs_mapmode mm)
 {
 	struct page *page;
 	unsigned long obj_idx, off;
@@ -652,34 +950,31 @@ void *zs_map_object(struct zs_pool *pool, void *handle)
 	enum fullness_group fg;
 	struct size_class *class;
 	struct mapping_area *area;
+	struct page *pages[2];
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	pin_tag(handle);
+	obj_to_location(handle_to_obj(handle), &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
 	if (off + class->size <= PAGE_SIZE) {
 		/* this object is contained entirely within a page */
 		area->vm_addr = kmap_atomic(page);
-	} else {
-		/* this object spans two pages */
-		struct page *nextp;
-
-		nextp = get_next_page(page);
-		BUG_ON(!nextp);
-
-
-		set_pte(area->vm_ptes[0], mk_pte(page, PAGE_KERNEL));
-		set_pte(area->vm_ptes[1], mk_pte(nextp, PAGE_KERNEL));
-
-		/* We pre-allocated VM area so mapping can never fail */
-		area->vm_addr = area->vm->addr;
+		return area->vm_addr + off + ZS_HANDLE_SIZE;
 	}
 
-	return area->vm_addr + off;
+	/* this object spans two pages */
+	pages[0] = page;
+	pages[1] = get_next_page(page);
+	BUG_ON(!pages[1]);
+
+	return __zs_map_object(area, pages, off, class->size) +
+			ZS_HANDLE_SIZE;
 }
 EXPORT_SYMBOL_GPL(zs_map_object);
 
@@ -695,31 +990,306 @@ void zs_unmap_object(struct zs_pool *pool, void *handle)
 
 	BUG_ON(!handle);
 
-	obj_handle_to_location(handle, &page, &obj_idx);
+	obj_to_location(handle_to_obj(handle), &page, &obj_idx);
 	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
-	class = &pool->size_class[class_idx];
+	class = pool->size_class[class_idx];
 	off = obj_idx_to_offset(page, obj_idx, class->size);
 
 	area = &__get_cpu_var(zs_map_area);
 	if (off + class->size <= PAGE_SIZE) {
 		kunmap_atomic(area->vm_addr);
 	} else {
-		set_pte(area->vm_ptes[0], __pte(0));
-		set_pte(area->vm_ptes[1], __pte(0));
-		__flush_tlb_one((unsigned long)area->vm_addr);
-		__flush_tlb_one((unsigned long)area->vm_addr + PAGE_SIZE);
+		struct page *pages[2];
+
+		pages[0] = page;
+		pages[1] = get_next_page(page);
+		BUG_ON(!pages[1]);
+
+		__zs_unmap_object(area, pages, off, class->size);
 	}
 	put_cpu_var(zs_map_area);
+	unpin_tag(handle);
 }
 EXPORT_SYMBOL_GPL(zs_unmap_object);
 
+/*
+ * Compaction
+ *
+ * Objects are moved from ZS_ALMOST_EMPTY zspages into the fullest
+ * zspages of the same size class, so that the sparse ones become empty
+ * and can be freed. Both zspages are taken off the fullness lists while
+ * objects move, and class->lock is held throughout so that zs_malloc()
+ * and zs_free() on the class wait for us. Pinned (mapped or being
+ * freed) objects are not moved; we give up on the class when we meet
+ * one and try again on the next pass.
+ */
+
+struct zs_compact_control {
+	/* source sub-page and object index to resume scanning from */
+	struct page *s_page;
+	unsigned long index;
+	/* destination zspage (first page) */
+	struct page *d_page;
+};
+
+/* Copy a whole object, either end of which may span two pages */
+static void zs_object_copy(unsigned long dst, unsigned long src,
+				struct size_class *class)
+{
+	struct page *s_page, *d_page;
+	unsigned long s_objidx, d_objidx;
+	unsigned long s_off, d_off, len;
+	void *s_addr, *d_addr;
+	int remaining = class->size;
+
+	obj_to_location(src, &s_page, &s_objidx);
+	obj_to_location(dst, &d_page, &d_objidx);
+	s_off = obj_idx_to_offset(s_page, s_objidx, class->size);
+	d_off = obj_idx_to_offset(d_page, d_objidx, class->size);
+
+	while (remaining) {
+		len = min(PAGE_SIZE - s_off, PAGE_SIZE - d_off);
+		len = min_t(unsigned long, len, remaining);
+
+		s_addr = kmap_atomic(s_page);
+		d_addr = kmap_atomic(d_page);
+		memcpy(d_addr + d_off, s_addr + s_off, len);
+		kunmap_atomic(d_addr);
+		kunmap_atomic(s_addr);
+
+		remaining -= len;
+		s_off += len;
+		d_off += len;
+		if (s_off == PAGE_SIZE) {
+			s_page = get_next_page(s_page);
+			s_off = 0;
+		}
+		if (d_off == PAGE_SIZE) {
+			d_page = get_next_page(d_page);
+			d_off = 0;
+		}
+	}
+}
+
+/*
+ * Find the next allocated object starting at *obj_idx on the given
+ * sub-page and return its handle, or NULL if there is none left.
+ */
+static void *find_alloced_obj(struct page *page, unsigned long *obj_idx,
+				struct size_class *class)
+{
+	unsigned long off;
+	unsigned long head;
+	void *handle = NULL;
+	void *addr = kmap_atomic(page);
+
+	off = obj_idx_to_offset(page, *obj_idx, class->size);
+	while (off < PAGE_SIZE) {
+		head = *(unsigned long *)(addr + off);
+		if (head & OBJ_ALLOCATED_TAG) {
+			handle = (void *)(head & ~OBJ_ALLOCATED_TAG);
+			break;
+		}
+		off += class->size;
+		(*obj_idx)++;
+	}
+
+	kunmap_atomic(addr);
+	return handle;
+}
+
+/*
+ * Move objects from cc->s_page's zspage to cc->d_page until the source
+ * runs out of objects (0), the destination fills up (-ENOMEM) or we
+ * meet a pinned object (-EBUSY).
+ */
+static int migrate_zspage(struct size_class *class,
+			struct zs_compact_control *cc)
+{
+	struct page *s_page = cc->s_page;
+	struct page *d_page = cc->d_page;
+	unsigned long index = cc->index;
+	unsigned long used_obj, free_obj;
+	void *handle;
+	int ret = 0;
+
+	while (1) {
+		handle = find_alloced_obj(s_page, &index, class);
+		if (!handle) {
+			s_page = get_next_page(s_page);
+			if (!s_page)
+				break;
+			index = 0;
+			continue;
+		}
+
+		if (d_page->inuse == d_page->objects) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (!trypin_tag(handle)) {
+			ret = -EBUSY;
+			break;
+		}
+
+		used_obj = handle_to_obj(handle);
+		free_obj = obj_malloc(d_page, class, handle);
+		zs_object_copy(free_obj, used_obj, class);
+		index++;
+		/* Publish the new location; unpin_tag() clears the pin bit */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, used_obj);
+	}
+
+	cc->s_page = s_page;
+	cc->index = index;
+
+	return ret;
+}
+
+static struct page *isolate_zspage(struct size_class *class,
+				enum fullness_group fg)
+{
+	struct page *first_page = class->fullness_list[fg];
+
+	if (first_page)
+		remove_zspage(first_page, class, fg);
+
+	return first_page;
+}
+
+static struct page *isolate_target_page(struct size_class *class)
+{
+	struct page *first_page;
+
+	first_page = isolate_zspage(class, ZS_ALMOST_FULL);
+	if (!first_page)
+		first_page = isolate_zspage(class, ZS_ALMOST_EMPTY);
+
+	return first_page;
+}
+
+static enum fullness_group putback_zspage(struct size_class *class,
+					struct page *first_page)
+{
+	enum fullness_group fg = get_fullness_group(first_page);
+
+	insert_zspage(first_page, class, fg);
+	set_zspage_mapping(first_page, class->index, fg);
+
+	return fg;
+}
+
+/* No. of zspages the free objects of this class add up to */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long objs_per_zspage, objs_allocated;
+
+	objs_per_zspage = class->zspage_order * PAGE_SIZE / class->size;
+	objs_allocated = (unsigned long)class->pages_allocated /
+				class->zspage_order * objs_per_zspage;
+	if (objs_allocated <= class->objs_inuse)
+		return 0;
+
+	return (objs_allocated - class->objs_inuse) / objs_per_zspage;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zs_compact_control cc;
+	struct page *src_page, *dst_page = NULL;
+	unsigned long pages_freed = 0;
+	int ret = 0;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) &&
+	       (src_page = isolate_zspage(class, ZS_ALMOST_EMPTY))) {
+		cc.s_page = src_page;
+		cc.index = 0;
+
+		while ((dst_page = isolate_target_page(class))) {
+			cc.d_page = dst_page;
+			ret = migrate_zspage(class, &cc);
+			putback_zspage(class, dst_page);
+			if (ret != -ENOMEM)
+				break;
+		}
+
+		if (putback_zspage(class, src_page) == ZS_EMPTY) {
+			class->pages_allocated -= class->zspage_order;
+			pages_freed += class->zspage_order;
+			free_zspage(src_page);
+		}
+
+		if (ret == -EBUSY || !dst_page)
+			break;
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return pages_freed;
+}
+
+/**
+ * zs_compact - Move objects out of sparse zspages and free them
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long pages_freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages_freed += __zs_compact(pool, pool->size_class[i]);
+
+	atomic_long_add(pages_freed, &pool->pages_compacted);
+
+	return pages_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+/* Reports the no. of pages compaction could free, read without locks */
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	int i;
+	unsigned long pages = 0;
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					shrinker);
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = pool->size_class[i];
+
+		pages += zs_can_compact(class) * class->zspage_order;
+	}
+
+	return min_t(unsigned long, pages, INT_MAX);
+}
+
 u64 zs_get_total_size_bytes(struct zs_pool *pool)
 {
 	int i;
 	u64 npages = 0;
 
 	for (i = 0; i < ZS_SIZE_CLASSES; i++)
-		npages += pool->size_class[i].pages_allocated;
+		npages += pool->size_class[i]->pages_allocated;
 
 	return npages << PAGE_SHIFT;
 }
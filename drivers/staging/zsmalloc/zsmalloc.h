@@ -17,15 +17,35 @@
 
 struct zs_pool;
 
+/*
+ * How an object is going to be accessed between zs_map_object() and
+ * zs_unmap_object(). When spanning objects are accessed through a copy,
+ * this tells which copies can be skipped.
+ */
+enum zs_mapmode {
+	ZS_MM_RW,	/* normal read-write mapping */
+	ZS_MM_RO,	/* read-only (no copy-out at unmap time) */
+	ZS_MM_WO	/* write-only (no copy-in at map time) */
+};
+
 struct zs_pool *zs_create_pool(const char *name, gfp_t flags);
 void zs_destroy_pool(struct zs_pool *pool);
 
 void *zs_malloc(struct zs_pool *pool, size_t size);
 void zs_free(struct zs_pool *pool, void *obj);
 
-void *zs_map_object(struct zs_pool *pool, void *handle);
+void *zs_map_object(struct zs_pool *pool, void *handle,
+		enum zs_mapmode mm);
 void zs_unmap_object(struct zs_pool *pool, void *handle);
 
 u64 zs_get_total_size_bytes(struct zs_pool *pool);
 
+struct zs_pool_stats {
+	/* no. of pages freed by compaction */
+	unsigned long pages_compacted;
+};
+
+unsigned long zs_compact(struct zs_pool *pool);
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
 #endif
@@ -14,9 +14,12 @@
 #define _ZS_MALLOC_INT_H_
 
 #include <linux/kernel.h>
+#include <linux/shrinker.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
 
+#include "zsmalloc.h"
+
 /*
  * This must be power of 2 and greater than of equal to sizeof(link_free).
  * These two conditions ensure that any 'struct link_free' itself doesn't
@@ -34,13 +37,17 @@
 
 /*
  * Object location (<PFN>, <obj_idx>) is encoded as
- * as single (void *) handle value.
+ * as single unsigned long 'obj' value.
  *
  * Note that object index <obj_idx> is relative to system
  * page <PFN> it is stored in, so for each sub-page belonging
  * to a zspage, obj_idx starts with 0.
  *
  * This is made more complicated by various memory models and PAE.
+ *
+ * Users do not see obj values: zs_malloc() hands out a handle, which
+ * points to a word holding the obj value. This indirection lets
+ * compaction move objects without telling their owners.
  */
 
 #ifndef MAX_PHYSMEM_BITS
@@ -55,9 +62,24 @@
 #endif
 #endif
 #define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
-#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS)
+
+/*
+ * The low bit of an obj value is kept free: in a handle it is the pin
+ * bit that keeps compaction from moving a mapped or freed object, and
+ * in the first word of an object it tells allocated objects (which
+ * store their handle there) from free ones (which store a freelist
+ * link there).
+ */
+#define OBJ_TAG_BITS	1
+#define HANDLE_PIN_BIT	0
+#define OBJ_ALLOCATED_TAG	1
+
+#define OBJ_INDEX_BITS	(BITS_PER_LONG - _PFN_BITS - OBJ_TAG_BITS)
 #define OBJ_INDEX_MASK	((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
 
+/* Each allocated object starts with a back-pointer to its handle */
+#define ZS_HANDLE_SIZE	(sizeof(unsigned long))
+
 #define MAX(a, b) ((a) >= (b) ? (a) : (b))
 /* ZS_MIN_ALLOC_SIZE must be multiple of ZS_ALIGN */
 #define ZS_MIN_ALLOC_SIZE \
@@ -109,10 +131,36 @@ enum fullness_group {
  */
 static const int fullness_threshold_frac = 4;
 
+/*
+ * Objects that span two pages are accessed through a per-cpu mapping
+ * area. How that area is backed depends on the architecture:
+ *
+ *  - x86: two PTEs of a private VM area are set directly and flushed
+ *    from the local TLB on unmap.
+ *  - ARM (built-in only, since unmap_kernel_range() is not exported):
+ *    the two pages are mapped with map_vm_area(). ARM broadcasts TLB
+ *    maintenance in hardware, so this beats copying the object.
+ *  - elsewhere: the object is copied into a per-cpu buffer, and back
+ *    on unmap unless it was mapped read-only.
+ */
+#if defined(CONFIG_X86)
+#define ZS_MAP_PTES
+#elif defined(CONFIG_ARM) && !defined(MODULE)
+#define ZS_MAP_VM_AREA
+#endif
+
 struct mapping_area {
-	struct vm_struct *vm;
+#if defined(ZS_MAP_PTES) || defined(ZS_MAP_VM_AREA)
+	struct vm_struct *vm;	/* 2 pages of VM for spanning objects */
+#endif
+#ifdef ZS_MAP_PTES
 	pte_t *vm_ptes[2];
-	char *vm_addr;
+#endif
+#if !defined(ZS_MAP_PTES) && !defined(ZS_MAP_VM_AREA)
+	char *vm_buf;		/* copy buffer for spanning objects */
+#endif
+	char *vm_addr;		/* address returned to the user */
+	enum zs_mapmode vm_mm;	/* mapping mode of the current object */
 };
 
 struct size_class {
@@ -126,30 +174,46 @@ struct size_class {
 	/* Number of PAGE_SIZE sized pages to combine to form a 'zspage' */
 	int zspage_order;
 
+	/*
+	 * Protects the freelists of this class's zspages, the fullness
+	 * lists and the stats below, and keeps compaction away from an
+	 * object while it is allocated or freed.  Allocating a zspage,
+	 * freeing an empty one and the handle cache are done without it.
+	 */
 	spinlock_t lock;
 
 	/* stats */
 	u64 pages_allocated;
+	unsigned long objs_inuse;
 
 	struct page *fullness_list[_ZS_NR_FULLNESS_GROUPS];
-};
+} ____cacheline_aligned_in_smp;
 
 /*
  * Placed within free objects to form a singly linked list.
  * For every zspage, first_page->freelist gives head of this list.
+ * Allocated objects store their handle in the same place instead.
  *
  * This must be power of 2 and less than or equal to ZS_ALIGN
  */
 struct link_free {
-	/* Handle of next free chunk (encodes <PFN, obj_idx>) */
-	void *next;
+	union {
+		/* obj value of next free chunk (encodes <PFN, obj_idx>) */
+		unsigned long next;
+		/* handle of this object, tagged with OBJ_ALLOCATED_TAG */
+		unsigned long handle;
+	};
 };
 
 struct zs_pool {
-	struct size_class size_class[ZS_SIZE_CLASSES];
+	struct size_class *size_class[ZS_SIZE_CLASSES];
 
 	gfp_t flags;	/* allocation flags used when growing pool */
 	const char *name;
+
+	/* compacts the pool under memory pressure */
+	struct shrinker shrinker;
+	atomic_long_t pages_compacted;
 };
 
 #endif
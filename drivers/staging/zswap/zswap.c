@@ -0,0 +1,726 @@
+/*
+ * zswap.c - compressed swap cache in front of the swap device
+ *
+ * zswap is a frontswap backend that takes pages being swapped out and
+ * stores them compressed in a zsmalloc pool instead of writing them to
+ * the swap device.  The pool is bounded; once it reaches its limit the
+ * least recently stored pages are decompressed into the swap cache and
+ * written through to the swap device to make room, so that zswap never
+ * has to refuse a store merely because it is full.
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#define KMSG_COMPONENT "zswap"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/atomic.h>
+#include <linux/crypto.h>
+#include <linux/debugfs.h>
+#include <linux/frontswap.h>
+#include <linux/highmem.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/mm_types.h>
+#include <linux/pagemap.h>
+#include <linux/percpu.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/types.h>
+#include <linux/writeback.h>
+
+#include "../zsmalloc/zsmalloc.h"
+
+/* Pages written back per store that finds the pool full */
+#define ZSWAP_WB_BATCH		16
+
+/* Pages compressing to more than this go straight to the swap device */
+#define ZSWAP_MAX_COMPRESSED	(PAGE_SIZE / 4 * 3)
+
+/* Enable/disable zswap (disabled by default, fixed at boot) */
+static bool zswap_enabled;
+module_param_named(enabled, zswap_enabled, bool, 0);
+
+/* Compressor to be used by zswap (fixed at boot) */
+#define ZSWAP_COMPRESSOR_DEFAULT "lzo"
+static char *zswap_compressor = ZSWAP_COMPRESSOR_DEFAULT;
+module_param_named(compressor, zswap_compressor, charp, 0);
+
+/* The maximum percentage of memory that the compressed pool can occupy */
+static unsigned int zswap_max_pool_percent = 20;
+module_param_named(max_pool_percent, zswap_max_pool_percent, uint, 0644);
+
+/*
+ * Statistics, available in debugfs. These are for information only, so
+ * most are not protected against increment races.
+ */
+static atomic_t zswap_stored_pages = ATOMIC_INIT(0);
+static u64 zswap_pool_limit_hit;
+static u64 zswap_written_back_pages;
+static u64 zswap_wb_skipped;
+static u64 zswap_reject_full;
+static u64 zswap_reject_alloc_fail;
+static u64 zswap_reject_compress_poor;
+
+static struct zs_pool *zswap_pool;
+static struct kmem_cache *zswap_entry_cache;
+
+/*
+ * Per-cpu compression transforms and destination buffers. They are set
+ * up for every possible cpu, which keeps hotplug out of the picture at
+ * the cost of a little memory on systems with many absent cpus.
+ */
+static DEFINE_PER_CPU(struct crypto_comp *, zswap_tfm);
+static DEFINE_PER_CPU(u8 *, zswap_dstmem);
+
+/*
+ * One entry per stored page.
+ *
+ * refcount: the tree holds one reference while the entry is in it; a
+ * load or writeback in progress holds another. The entry and its
+ * compressed data are freed when the last one is dropped.
+ * lru: position in the store-order LRU; empty while being written back.
+ */
+struct zswap_entry {
+	struct rb_node rbnode;
+	struct list_head lru;
+	atomic_t refcount;
+	unsigned type;
+	pgoff_t offset;
+	void *handle;
+	unsigned int length;
+};
+
+/* One rb tree of entries per swap device, keyed by offset */
+struct zswap_tree {
+	struct rb_root rbroot;
+	spinlock_t lock;	/* protects rbroot; nests zswap_lru_lock */
+};
+
+static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
+
+/* Newest entries at the head, writeback candidates at the tail */
+static LIST_HEAD(zswap_lru);
+static DEFINE_SPINLOCK(zswap_lru_lock);
+
+/*********************************
+* entry and tree helpers
+**********************************/
+static struct zswap_entry *zswap_entry_alloc(gfp_t gfp)
+{
+	struct zswap_entry *entry;
+
+	entry = kmem_cache_alloc(zswap_entry_cache, gfp);
+	if (!entry)
+		return NULL;
+	RB_CLEAR_NODE(&entry->rbnode);
+	INIT_LIST_HEAD(&entry->lru);
+	atomic_set(&entry->refcount, 1);
+	return entry;
+}
+
+static void zswap_entry_put(struct zswap_entry *entry)
+{
+	if (!atomic_dec_and_test(&entry->refcount))
+		return;
+
+	zs_free(zswap_pool, entry->handle);
+	kmem_cache_free(zswap_entry_cache, entry);
+	atomic_dec(&zswap_stored_pages);
+}
+
+static struct zswap_entry *zswap_rb_search(struct rb_root *root,
+					pgoff_t offset)
+{
+	struct rb_node *node = root->rb_node;
+	struct zswap_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		if (entry->offset > offset)
+			node = node->rb_left;
+		else if (entry->offset < offset)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Insert entry, returning the entry it displaced (if any), which the
+ * caller must unlink from the LRU and put.
+ */
+static struct zswap_entry *zswap_rb_insert(struct rb_root *root,
+					struct zswap_entry *entry)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct zswap_entry *myentry;
+
+	while (*link) {
+		parent = *link;
+		myentry = rb_entry(parent, struct zswap_entry, rbnode);
+		if (myentry->offset > entry->offset) {
+			link = &(*link)->rb_left;
+		} else if (myentry->offset < entry->offset) {
+			link = &(*link)->rb_right;
+		} else {
+			rb_replace_node(&myentry->rbnode, &entry->rbnode,
+					root);
+			return myentry;
+		}
+	}
+	rb_link_node(&entry->rbnode, parent, link);
+	rb_insert_color(&entry->rbnode, root);
+	return NULL;
+}
+
+/* Called with tree->lock held */
+static void zswap_lru_add(struct zswap_entry *entry)
+{
+	spin_lock(&zswap_lru_lock);
+	list_add(&entry->lru, &zswap_lru);
+	spin_unlock(&zswap_lru_lock);
+}
+
+/* Called with tree->lock held */
+static void zswap_lru_del(struct zswap_entry *entry)
+{
+	spin_lock(&zswap_lru_lock);
+	list_del_init(&entry->lru);
+	spin_unlock(&zswap_lru_lock);
+}
+
+/* Remove entry from tree if it is still there, dropping the tree's ref */
+static void zswap_tree_remove(struct zswap_tree *tree,
+			struct zswap_entry *entry)
+{
+	bool found = false;
+
+	spin_lock(&tree->lock);
+	if (zswap_rb_search(&tree->rbroot, entry->offset) == entry) {
+		rb_erase(&entry->rbnode, &tree->rbroot);
+		zswap_lru_del(entry);
+		found = true;
+	}
+	spin_unlock(&tree->lock);
+
+	if (found)
+		zswap_entry_put(entry);
+}
+
+static bool zswap_is_full(void)
+{
+	u64 pool_pages = zs_get_total_size_bytes(zswap_pool) >> PAGE_SHIFT;
+
+	return pool_pages > totalram_pages * zswap_max_pool_percent / 100;
+}
+
+/*********************************
+* compression
+**********************************/
+static void zswap_decompress(struct zswap_entry *entry, struct page *page)
+{
+	unsigned int dlen = PAGE_SIZE;
+	u8 *src, *dst;
+	int ret;
+
+	src = zs_map_object(zswap_pool, entry->handle, ZS_MM_RO);
+	dst = kmap_atomic(page);
+	ret = crypto_comp_decompress(__get_cpu_var(zswap_tfm), src,
+				entry->length, dst, &dlen);
+	kunmap_atomic(dst);
+	zs_unmap_object(zswap_pool, entry->handle);
+	BUG_ON(ret || dlen != PAGE_SIZE);
+}
+
+/*********************************
+* writeback
+**********************************/
+enum zswap_get_swap_ret {
+	ZSWAP_SWAPCACHE_NEW,
+	ZSWAP_SWAPCACHE_EXIST,
+	ZSWAP_SWAPCACHE_FAIL,
+};
+
+/*
+ * Find or add a swap cache page for entry, like read_swap_cache_async()
+ * but without starting a read: on ZSWAP_SWAPCACHE_NEW the page is new,
+ * locked and ours to fill; on ZSWAP_SWAPCACHE_EXIST somebody else has
+ * the page in the swap cache already. Either way a reference is taken.
+ */
+static int zswap_get_swap_cache_page(swp_entry_t entry,
+				struct page **retpage)
+{
+	struct page *found_page, *new_page = NULL;
+	int err;
+
+	*retpage = NULL;
+	do {
+		found_page = find_get_page(&swapper_space, entry.val);
+		if (found_page)
+			break;
+
+		if (!new_page) {
+			new_page = alloc_page(GFP_NOIO | __GFP_NOWARN);
+			if (!new_page)
+				break;
+		}
+
+		err = radix_tree_preload(GFP_NOIO);
+		if (err)
+			break;
+
+		/* Swap entry may have been freed since we found it */
+		err = swapcache_prepare(entry);
+		if (err == -EEXIST) {
+			radix_tree_preload_end();
+			continue;
+		}
+		if (err) {
+			radix_tree_preload_end();
+			break;
+		}
+
+		__set_page_locked(new_page);
+		SetPageSwapBacked(new_page);
+		err = __add_to_swap_cache(new_page, entry);
+		if (likely(!err)) {
+			radix_tree_preload_end();
+			lru_cache_add_anon(new_page);
+			*retpage = new_page;
+			return ZSWAP_SWAPCACHE_NEW;
+		}
+		radix_tree_preload_end();
+		ClearPageSwapBacked(new_page);
+		__clear_page_locked(new_page);
+		swapcache_free(entry, NULL);
+	} while (err != -ENOMEM);
+
+	if (new_page)
+		page_cache_release(new_page);
+	if (!found_page)
+		return ZSWAP_SWAPCACHE_FAIL;
+	*retpage = found_page;
+	return ZSWAP_SWAPCACHE_EXIST;
+}
+
+/*
+ * Decompress entry into the swap cache and write it to the swap device.
+ * The swap cache page then owns the data, so the entry is dropped; a
+ * later load misses and frontswap falls back to reading the device.
+ */
+static int zswap_writeback_entry(struct zswap_tree *tree,
+				struct zswap_entry *entry)
+{
+	swp_entry_t swpentry = swp_entry(entry->type, entry->offset);
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+	struct page *page;
+
+	switch (zswap_get_swap_cache_page(swpentry, &page)) {
+	case ZSWAP_SWAPCACHE_FAIL:
+		/* out of memory, or the swap entry is being freed */
+		return -ENOMEM;
+
+	case ZSWAP_SWAPCACHE_EXIST:
+		/* being swapped in or out right now; leave it be */
+		page_cache_release(page);
+		return -EEXIST;
+
+	case ZSWAP_SWAPCACHE_NEW:
+		/*
+		 * Between taking entry off the lru and getting the page, the
+		 * entry may have been invalidated and the swap slot freed,
+		 * reused and stored again.  The swap cache page now pins the
+		 * slot, so if entry is still in the tree it stays current.
+		 */
+		spin_lock(&tree->lock);
+		if (zswap_rb_search(&tree->rbroot, entry->offset) != entry) {
+			spin_unlock(&tree->lock);
+			delete_from_swap_cache(page);
+			unlock_page(page);
+			page_cache_release(page);
+			return -EEXIST;
+		}
+		spin_unlock(&tree->lock);
+
+		preempt_disable();
+		zswap_decompress(entry, page);
+		preempt_enable();
+		SetPageUptodate(page);
+		break;
+	}
+
+	/* move it to the tail of the inactive list after writeback */
+	SetPageReclaim(page);
+	__swap_writepage(page, &wbc);
+	page_cache_release(page);
+	zswap_written_back_pages++;
+
+	zswap_tree_remove(tree, entry);
+	return 0;
+}
+
+/* Write back up to nr of the least recently stored entries */
+static void zswap_writeback_lru(int nr)
+{
+	struct zswap_entry *entry;
+	struct zswap_tree *tree;
+
+	while (nr-- > 0) {
+		spin_lock(&zswap_lru_lock);
+		if (list_empty(&zswap_lru)) {
+			spin_unlock(&zswap_lru_lock);
+			break;
+		}
+		entry = list_entry(zswap_lru.prev, struct zswap_entry, lru);
+		list_del_init(&entry->lru);
+		/* the tree's reference can't go before we drop the lock */
+		atomic_inc(&entry->refcount);
+		spin_unlock(&zswap_lru_lock);
+
+		tree = zswap_trees[entry->type];
+		if (zswap_writeback_entry(tree, entry)) {
+			zswap_wb_skipped++;
+			/* still stored: give it another round */
+			spin_lock(&tree->lock);
+			if (zswap_rb_search(&tree->rbroot, entry->offset) ==
+			    entry)
+				zswap_lru_add(entry);
+			spin_unlock(&tree->lock);
+		}
+		zswap_entry_put(entry);
+	}
+}
+
+/*********************************
+* frontswap hooks
+**********************************/
+static int zswap_frontswap_put_page(unsigned type, pgoff_t offset,
+				struct page *page)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry, *dupentry;
+	unsigned int dlen = PAGE_SIZE * 2;
+	void *handle;
+	u8 *src, *dst, *buf;
+	int ret;
+
+	if (!tree)
+		return -ENODEV;
+
+	if (zswap_is_full()) {
+		zswap_pool_limit_hit++;
+		zswap_writeback_lru(ZSWAP_WB_BATCH);
+		if (zswap_is_full()) {
+			zswap_reject_full++;
+			return -ENOMEM;
+		}
+	}
+
+	entry = zswap_entry_alloc(GFP_NOIO | __GFP_NOWARN);
+	if (!entry) {
+		zswap_reject_alloc_fail++;
+		return -ENOMEM;
+	}
+
+	dst = get_cpu_var(zswap_dstmem);
+	src = kmap_atomic(page);
+	ret = crypto_comp_compress(__get_cpu_var(zswap_tfm), src, PAGE_SIZE,
+				dst, &dlen);
+	kunmap_atomic(src);
+	if (ret) {
+		ret = -EINVAL;
+		goto put_dstmem;
+	}
+	if (dlen > ZSWAP_MAX_COMPRESSED) {
+		zswap_reject_compress_poor++;
+		ret = -E2BIG;
+		goto put_dstmem;
+	}
+
+	handle = zs_malloc(zswap_pool, dlen);
+	if (!handle) {
+		zswap_reject_alloc_fail++;
+		ret = -ENOMEM;
+		goto put_dstmem;
+	}
+	buf = zs_map_object(zswap_pool, handle, ZS_MM_WO);
+	memcpy(buf, dst, dlen);
+	zs_unmap_object(zswap_pool, handle);
+	put_cpu_var(zswap_dstmem);
+
+	entry->type = type;
+	entry->offset = offset;
+	entry->handle = handle;
+	entry->length = dlen;
+	atomic_inc(&zswap_stored_pages);
+
+	spin_lock(&tree->lock);
+	dupentry = zswap_rb_insert(&tree->rbroot, entry);
+	if (dupentry)
+		zswap_lru_del(dupentry);
+	zswap_lru_add(entry);
+	spin_unlock(&tree->lock);
+
+	if (dupentry)
+		zswap_entry_put(dupentry);
+	return 0;
+
+put_dstmem:
+	put_cpu_var(zswap_dstmem);
+	kmem_cache_free(zswap_entry_cache, entry);
+	return ret;
+}
+
+static int zswap_frontswap_get_page(unsigned type, pgoff_t offset,
+				struct page *page)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return -1;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (entry)
+		atomic_inc(&entry->refcount);
+	spin_unlock(&tree->lock);
+	if (!entry)
+		return -1;	/* written back: read the swap device */
+
+	preempt_disable();
+	zswap_decompress(entry, page);
+	preempt_enable();
+	zswap_entry_put(entry);
+
+	return 0;
+}
+
+/* Called with swap_lock held */
+static void zswap_frontswap_invalidate_page(unsigned type, pgoff_t offset)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (!entry) {
+		spin_unlock(&tree->lock);
+		return;
+	}
+	rb_erase(&entry->rbnode, &tree->rbroot);
+	zswap_lru_del(entry);
+	spin_unlock(&tree->lock);
+
+	zswap_entry_put(entry);
+}
+
+/*
+ * The tree itself is kept: a writeback still holding an entry of this
+ * swap device takes tree->lock when it finishes.
+ */
+static void zswap_frontswap_invalidate_area(unsigned type)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+	struct rb_node *node;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	while ((node = rb_first(&tree->rbroot))) {
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		rb_erase(node, &tree->rbroot);
+		zswap_lru_del(entry);
+		zswap_entry_put(entry);
+	}
+	spin_unlock(&tree->lock);
+}
+
+static void zswap_frontswap_init(unsigned type)
+{
+	struct zswap_tree *tree;
+
+	if (zswap_trees[type])
+		return;
+
+	tree = kzalloc(sizeof(*tree), GFP_KERNEL);
+	if (!tree) {
+		pr_err("alloc failed, zswap disabled for swap type %u\n",
+			type);
+		return;
+	}
+	tree->rbroot = RB_ROOT;
+	spin_lock_init(&tree->lock);
+	zswap_trees[type] = tree;
+}
+
+static struct frontswap_ops zswap_frontswap_ops = {
+	.put_page = zswap_frontswap_put_page,
+	.get_page = zswap_frontswap_get_page,
+	.invalidate_page = zswap_frontswap_invalidate_page,
+	.invalidate_area = zswap_frontswap_invalidate_area,
+	.init = zswap_frontswap_init
+};
+
+/*********************************
+* debugfs functions
+**********************************/
+#ifdef CONFIG_DEBUG_FS
+static struct dentry *zswap_debugfs_root;
+
+static int zswap_pool_pages_get(void *data, u64 *val)
+{
+	*val = zs_get_total_size_bytes(zswap_pool) >> PAGE_SHIFT;
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_pool_pages_fops, zswap_pool_pages_get,
+			NULL, "%llu\n");
+
+static int zswap_stored_pages_get(void *data, u64 *val)
+{
+	*val = atomic_read(&zswap_stored_pages);
+	return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(zswap_stored_pages_fops, zswap_stored_pages_get,
+			NULL, "%llu\n");
+
+static int __init zswap_debugfs_init(void)
+{
+	zswap_debugfs_root = debugfs_create_dir("zswap", NULL);
+	if (!zswap_debugfs_root)
+		return -ENOMEM;
+
+	debugfs_create_u64("pool_limit_hit", S_IRUGO,
+			zswap_debugfs_root, &zswap_pool_limit_hit);
+	debugfs_create_u64("written_back_pages", S_IRUGO,
+			zswap_debugfs_root, &zswap_written_back_pages);
+	debugfs_create_u64("writeback_skipped", S_IRUGO,
+			zswap_debugfs_root, &zswap_wb_skipped);
+	debugfs_create_u64("reject_full", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_full);
+	debugfs_create_u64("reject_alloc_fail", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_alloc_fail);
+	debugfs_create_u64("reject_compress_poor", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_compress_poor);
+	debugfs_create_file("stored_pages", S_IRUGO, zswap_debugfs_root,
+			NULL, &zswap_stored_pages_fops);
+	debugfs_create_file("pool_pages", S_IRUGO, zswap_debugfs_root,
+			NULL, &zswap_pool_pages_fops);
+
+	return 0;
+}
+#else
+static int __init zswap_debugfs_init(void)
+{
+	return 0;
+}
+#endif
+
+/*********************************
+* module init
+**********************************/
+static void zswap_comp_exit(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (!IS_ERR_OR_NULL(per_cpu(zswap_tfm, cpu)))
+			crypto_free_comp(per_cpu(zswap_tfm, cpu));
+		per_cpu(zswap_tfm, cpu) = NULL;
+		free_pages((unsigned long)per_cpu(zswap_dstmem, cpu), 1);
+		per_cpu(zswap_dstmem, cpu) = NULL;
+	}
+}
+
+static int __init zswap_comp_init(void)
+{
+	int cpu;
+
+	if (!crypto_has_comp(zswap_compressor, 0, 0)) {
+		pr_info("%s compressor not available\n", zswap_compressor);
+		zswap_compressor = ZSWAP_COMPRESSOR_DEFAULT;
+		if (!crypto_has_comp(zswap_compressor, 0, 0))
+			return -ENODEV;
+	}
+	pr_info("using %s compressor\n", zswap_compressor);
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm;
+
+		tfm = crypto_alloc_comp(zswap_compressor, 0, 0);
+		if (IS_ERR(tfm))
+			goto fail;
+		per_cpu(zswap_tfm, cpu) = tfm;
+		/* some compressors expand incompressible data */
+		per_cpu(zswap_dstmem, cpu) = (u8 *)__get_free_pages(
+						GFP_KERNEL, 1);
+		if (!per_cpu(zswap_dstmem, cpu))
+			goto fail;
+	}
+	return 0;
+
+fail:
+	zswap_comp_exit();
+	return -ENOMEM;
+}
+
+static int __init init_zswap(void)
+{
+	if (!zswap_enabled)
+		return 0;
+
+	pr_info("loading zswap\n");
+
+	zswap_pool = zs_create_pool("zswap",
+			__GFP_NORETRY | __GFP_NOWARN | __GFP_HIGHMEM);
+	if (!zswap_pool) {
+		pr_err("zsmalloc pool creation failed\n");
+		goto error;
+	}
+
+	zswap_entry_cache = KMEM_CACHE(zswap_entry, 0);
+	if (!zswap_entry_cache) {
+		pr_err("entry cache creation failed\n");
+		goto cachefail;
+	}
+
+	if (zswap_comp_init()) {
+		pr_err("compressor initialization failed\n");
+		goto compfail;
+	}
+
+	frontswap_register_ops(&zswap_frontswap_ops);
+	if (zswap_debugfs_init())
+		pr_warn("debugfs initialization failed\n");
+	return 0;
+
+compfail:
+	kmem_cache_destroy(zswap_entry_cache);
+cachefail:
+	zs_destroy_pool(zswap_pool);
+error:
+	return -ENOMEM;
+}
+/* must be late so crypto and zsmalloc have been initialized */
+late_initcall(init_zswap);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Compressed cache for swap pages");
@@ -47,11 +47,13 @@
 #include <linux/string.h>
 #include <linux/pagemap.h>
 #include <linux/mutex.h>
+#include <linux/blkdev.h>
 
 #include "squashfs_fs.h"
 #include "squashfs_fs_sb.h"
 #include "squashfs_fs_i.h"
 #include "squashfs.h"
+#include "page_actor.h"
 
 /*
  * Locate cache slot in range [offset, index] for specified inode.  If
@@ -371,76 +373,15 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
-static int squashfs_readpage(struct file *file, struct page *page)
+/* Copy data into page cache  */
+static void squashfs_copy_cache(struct page *page,
+	struct squashfs_cache_entry *buffer, int bytes, int offset)
 {
 	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
-	struct squashfs_cache_entry *buffer = NULL;
 	void *pageaddr;
-
-	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
-	int index = page->index >> (msblk->block_log - PAGE_CACHE_SHIFT);
-	int start_index = page->index & ~mask;
-	int end_index = start_index | mask;
-	int file_end = i_size_read(inode) >> msblk->block_log;
-
-	TRACE("Entered squashfs_readpage, page index %lx, start block %llx\n",
-				page->index, squashfs_i(inode)->start);
-
-	if (page->index >= ((i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
-					PAGE_CACHE_SHIFT))
-		goto out;
-
-	if (index < file_end || squashfs_i(inode)->fragment_block ==
-					SQUASHFS_INVALID_BLK) {
-		/*
-		 * Reading a datablock from disk.  Need to read block list
-		 * to get location and block size.
-		 */
-		u64 block = 0;
-		int bsize = read_blocklist(inode, index, &block);
-		if (bsize < 0)
-			goto error_out;
-
-		if (bsize == 0) { /* hole */
-			bytes = index == file_end ?
-				(i_size_read(inode) & (msblk->block_size - 1)) :
-				 msblk->block_size;
-			sparse = 1;
-		} else {
-			/*
-			 * Read and decompress datablock.
-			 */
-			buffer = squashfs_get_datablock(inode->i_sb,
-								block, bsize);
-			if (buffer->error) {
-				ERROR("Unable to read page, block %llx, size %x"
-					"\n", block, bsize);
-				squashfs_cache_put(buffer);
-				goto error_out;
-			}
-			bytes = buffer->length;
-		}
-	} else {
-		/*
-		 * Datablock is stored inside a fragment (tail-end packed
-		 * block).
-		 */
-		buffer = squashfs_get_fragment(inode->i_sb,
-				squashfs_i(inode)->fragment_block,
-				squashfs_i(inode)->fragment_size);
-
-		if (buffer->error) {
-			ERROR("Unable to read page, block %llx, size %x\n",
-				squashfs_i(inode)->fragment_block,
-				squashfs_i(inode)->fragment_size);
-			squashfs_cache_put(buffer);
-			goto error_out;
-		}
-		bytes = i_size_read(inode) & (msblk->block_size - 1);
-		offset = squashfs_i(inode)->fragment_offset;
-	}
+	int i, mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = page->index & ~mask, end_index = start_index | mask;
 
 	/*
 	 * Loop copying datablock into pages.  As the datablock likely covers
@@ -451,7 +392,7 @@ static int squashfs_readpage(struct file *file, struct page *page)
 	for (i = start_index; i <= end_index && bytes > 0; i++,
 			bytes -= PAGE_CACHE_SIZE, offset += PAGE_CACHE_SIZE) {
 		struct page *push_page;
-		int avail = sparse ? 0 : min_t(int, bytes, PAGE_CACHE_SIZE);
+		int avail = buffer ? min_t(int, bytes, PAGE_CACHE_SIZE) : 0;
 
 		TRACE("bytes %d, i %d, available_bytes %d\n", bytes, i, avail);
 
@@ -475,11 +416,185 @@ skip_page:
 		if (i != page->index)
 			page_cache_release(push_page);
 	}
+}
 
-	if (!sparse)
-		squashfs_cache_put(buffer);
 
+/* Read datablock stored packed inside a fragment (tail-end packed block) */
+static int squashfs_readpage_fragment(struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	struct squashfs_cache_entry *buffer = squashfs_get_fragment(inode->i_sb,
+		squashfs_i(inode)->fragment_block,
+		squashfs_i(inode)->fragment_size);
+	int res = buffer->error;
+
+	if (res)
+		ERROR("Unable to read page, block %llx, size %x\n",
+			squashfs_i(inode)->fragment_block,
+			squashfs_i(inode)->fragment_size);
+	else
+		squashfs_copy_cache(page, buffer, i_size_read(inode) &
+			(msblk->block_size - 1),
+			squashfs_i(inode)->fragment_offset);
+
+	squashfs_cache_put(buffer);
+	return res;
+}
+
+
+static int squashfs_readpage_sparse(struct page *page, int index, int file_end)
+{
+	struct inode *inode = page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int bytes = index == file_end ?
+			(i_size_read(inode) & (msblk->block_size - 1)) :
+			 msblk->block_size;
+
+	squashfs_copy_cache(page, NULL, bytes, 0);
 	return 0;
+}
+
+
+/*
+ * Decompress datablock <block> straight into the page cache pages in
+ * page[], which must be locked.  NULL entries are pages which could not
+ * be grabbed without blocking, or which are already uptodate: the page
+ * actor decompresses their part of the block into a scratch page.
+ *
+ * All pages other than skip_page are marked uptodate (or errored),
+ * unlocked and released.  skip_page is only marked uptodate and
+ * unlocked on success, and otherwise left locked for the caller.
+ */
+static int squashfs_read_block_pages(struct inode *inode, struct page **page,
+	int pages, u64 block, int bsize, struct page *skip_page)
+{
+	struct squashfs_page_actor *actor;
+	int i, bytes, res = -ENOMEM;
+	void *pageaddr;
+
+	/*
+	 * Create a "page actor" which will kmap and kunmap the page cache
+	 * pages appropriately within the decompressor
+	 */
+	actor = squashfs_page_actor_init_special(page, pages, 0);
+	if (actor != NULL) {
+		res = squashfs_read_data(inode->i_sb, block, bsize, NULL,
+			actor);
+		squashfs_page_actor_free(actor);
+	}
+
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+	} else {
+		/* Last page may have trailing bytes not filled */
+		bytes = res % PAGE_CACHE_SIZE;
+		if (bytes && page[pages - 1]) {
+			pageaddr = kmap_atomic(page[pages - 1]);
+			memset(pageaddr + bytes, 0, PAGE_CACHE_SIZE - bytes);
+			kunmap_atomic(pageaddr);
+		}
+	}
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || (res < 0 && page[i] == skip_page))
+			continue;
+		flush_dcache_page(page[i]);
+		if (res < 0)
+			SetPageError(page[i]);
+		else
+			SetPageUptodate(page[i]);
+		unlock_page(page[i]);
+		if (page[i] != skip_page)
+			page_cache_release(page[i]);
+	}
+
+	return res < 0 ? res : 0;
+}
+
+
+/*
+ * Read the datablock covering target_page, decompressing it into all the
+ * page cache pages it covers.  On error target_page is left locked for the
+ * caller to deal with.
+ */
+static int squashfs_readpage_block(struct page *target_page, u64 block,
+	int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int file_end = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int i, n, pages, res;
+	struct page **page;
+
+	if (end_index > file_end)
+		end_index = file_end;
+
+	pages = end_index - start_index + 1;
+
+	page = kcalloc(pages, sizeof(void *), GFP_KERNEL);
+	if (page == NULL)
+		return -ENOMEM;
+
+	/* Try to grab all the pages covered by the Squashfs block */
+	for (i = 0, n = start_index; i < pages; i++, n++) {
+		page[i] = (n == target_page->index) ? target_page :
+			grab_cache_page_nowait(target_page->mapping, n);
+
+		if (page[i] == NULL || page[i] == target_page)
+			continue;
+
+		if (PageUptodate(page[i])) {
+			unlock_page(page[i]);
+			page_cache_release(page[i]);
+			page[i] = NULL;
+		}
+	}
+
+	res = squashfs_read_block_pages(inode, page, pages, block, bsize,
+		target_page);
+
+	kfree(page);
+	return res;
+}
+
+
+static int squashfs_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int index = page->index >> (msblk->block_log - PAGE_CACHE_SHIFT);
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	int res;
+	void *pageaddr;
+
+	TRACE("Entered squashfs_readpage, page index %lx, start block %llx\n",
+				page->index, squashfs_i(inode)->start);
+
+	if (page->index >= ((i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+					PAGE_CACHE_SHIFT))
+		goto out;
+
+	if (index < file_end || squashfs_i(inode)->fragment_block ==
+					SQUASHFS_INVALID_BLK) {
+		u64 block = 0;
+		int bsize = read_blocklist(inode, index, &block);
+		if (bsize < 0)
+			goto error_out;
+
+		if (bsize == 0)
+			res = squashfs_readpage_sparse(page, index, file_end);
+		else
+			res = squashfs_readpage_block(page, block, bsize);
+	} else
+		res = squashfs_readpage_fragment(page);
+
+	if (!res)
+		return 0;
 
 error_out:
 	SetPageError(page);
@@ -496,6 +611,104 @@ out:
 }
 
 
+/*
+ * Readahead.  The block list for the whole window is looked up first and
+ * reads are started for the device blocks of every compressed datablock
+ * in it, under one plug so they are merged into as few requests as
+ * possible.  The datablocks are then decompressed in order, each as soon
+ * as its own I/O has completed, while the reads for the later ones are
+ * still in flight.  Holes and fragments go through squashfs_readpage().
+ */
+struct squashfs_ra_block {
+	u64	block;
+	int	bsize;
+};
+
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	int last_page = (i_size_read(inode) - 1) >> PAGE_CACHE_SHIFT;
+	int first = INT_MAX, last = 0, nr_blocks, n, i, count, added;
+	struct squashfs_ra_block *ra;
+	struct page *page, *tmp, **array;
+	struct blk_plug plug;
+
+	list_for_each_entry(page, pages, lru) {
+		first = min_t(int, first, page->index >> shift);
+		last = max_t(int, last, page->index >> shift);
+	}
+	nr_blocks = last - first + 1;
+
+	ra = kcalloc(nr_blocks, sizeof(*ra), GFP_KERNEL);
+	array = kcalloc(1 << shift, sizeof(*array), GFP_KERNEL);
+	if (ra == NULL || array == NULL)
+		goto out;
+
+	blk_start_plug(&plug);
+	for (n = 0; n < nr_blocks; n++) {
+		if (first + n >= file_end && squashfs_i(inode)->fragment_block
+						!= SQUASHFS_INVALID_BLK)
+			continue;
+
+		ra[n].bsize = read_blocklist(inode, first + n, &ra[n].block);
+		if (ra[n].bsize > 0)
+			squashfs_read_data_ahead(inode->i_sb, ra[n].block,
+				ra[n].bsize);
+	}
+	blk_finish_plug(&plug);
+
+	for (n = 0; n < nr_blocks; n++) {
+		int start_index = (first + n) << shift;
+
+		memset(array, 0, sizeof(*array) << shift);
+		count = min(1 << shift, last_page - start_index + 1);
+		added = 0;
+
+		/* Move this datablock's pages from the list to the cache */
+		list_for_each_entry_safe_reverse(page, tmp, pages, lru) {
+			if (page->index >> shift != first + n)
+				continue;
+			list_del(&page->lru);
+			if (page->index > last_page || add_to_page_cache_lru(page,
+					mapping, page->index, GFP_KERNEL)) {
+				page_cache_release(page);
+				continue;
+			}
+			array[page->index - start_index] = page;
+			added++;
+		}
+
+		if (!added)
+			continue;
+
+		if (ra[n].bsize > 0) {
+			squashfs_read_block_pages(inode, array, count,
+				ra[n].block, ra[n].bsize, NULL);
+			continue;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (array[i] == NULL)
+				continue;
+			squashfs_readpage(file, array[i]);
+			page_cache_release(array[i]);
+		}
+	}
+
+out:
+	kfree(array);
+	kfree(ra);
+
+	/* read_pages() releases any pages still on the list */
+	return 0;
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
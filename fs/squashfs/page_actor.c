@@ -0,0 +1,150 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * page_actor.c
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include "page_actor.h"
+
+/*
+ * Actor over an array of kmalloced PAGE_CACHE_SIZE buffers, used for
+ * squashfs_cache entries and tables read at mount time.
+ */
+
+static void *cache_first_page(struct squashfs_page_actor *actor)
+{
+	actor->next_page = 1;
+	return actor->buffer[0];
+}
+
+static void *cache_next_page(struct squashfs_page_actor *actor)
+{
+	if (actor->next_page == actor->pages)
+		return NULL;
+
+	return actor->buffer[actor->next_page++];
+}
+
+static void cache_finish_page(struct squashfs_page_actor *actor)
+{
+	/* empty */
+}
+
+struct squashfs_page_actor *squashfs_page_actor_init(void **buffer,
+	int pages, int length)
+{
+	struct squashfs_page_actor *actor = kmalloc(sizeof(*actor), GFP_KERNEL);
+
+	if (actor == NULL)
+		return NULL;
+
+	actor->length = length ? : pages * PAGE_CACHE_SIZE;
+	actor->buffer = buffer;
+	actor->pages = pages;
+	actor->next_page = 0;
+	actor->pageaddr = NULL;
+	actor->tmp_page = NULL;
+	actor->squashfs_first_page = cache_first_page;
+	actor->squashfs_next_page = cache_next_page;
+	actor->squashfs_finish_page = cache_finish_page;
+	return actor;
+}
+
+/*
+ * Actor over page cache pages, which are kmapped one at a time as the
+ * decompressor reaches them.  NULL entries are pages which could not be
+ * grabbed (already uptodate, or locked by a racing reader); their part
+ * of the block is decompressed into a scratch page and dropped.
+ */
+
+static void *handle_next_page(struct squashfs_page_actor *actor)
+{
+	struct page *page;
+
+	if (actor->pageaddr) {
+		kunmap_atomic(actor->pageaddr);
+		actor->pageaddr = NULL;
+	}
+
+	if (actor->next_page == actor->pages)
+		return NULL;
+
+	page = actor->page[actor->next_page++];
+	if (page == NULL)
+		return actor->tmp_page;
+
+	actor->pageaddr = kmap_atomic(page);
+	return actor->pageaddr;
+}
+
+static void *direct_first_page(struct squashfs_page_actor *actor)
+{
+	actor->next_page = 0;
+	return handle_next_page(actor);
+}
+
+static void direct_finish_page(struct squashfs_page_actor *actor)
+{
+	if (actor->pageaddr) {
+		kunmap_atomic(actor->pageaddr);
+		actor->pageaddr = NULL;
+	}
+}
+
+struct squashfs_page_actor *squashfs_page_actor_init_special(
+	struct page **page, int pages, int length)
+{
+	struct squashfs_page_actor *actor = kmalloc(sizeof(*actor), GFP_KERNEL);
+	int i;
+
+	if (actor == NULL)
+		return NULL;
+
+	actor->tmp_page = NULL;
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL) {
+			actor->tmp_page = kmalloc(PAGE_CACHE_SIZE, GFP_KERNEL);
+			if (actor->tmp_page == NULL) {
+				kfree(actor);
+				return NULL;
+			}
+			break;
+		}
+	}
+
+	actor->length = length ? : pages * PAGE_CACHE_SIZE;
+	actor->page = page;
+	actor->pages = pages;
+	actor->next_page = 0;
+	actor->pageaddr = NULL;
+	actor->squashfs_first_page = direct_first_page;
+	actor->squashfs_next_page = handle_next_page;
+	actor->squashfs_finish_page = direct_finish_page;
+	return actor;
+}
+
+void squashfs_page_actor_free(struct squashfs_page_actor *actor)
+{
+	if (actor) {
+		kfree(actor->tmp_page);
+		kfree(actor);
+	}
+}
@@ -18,6 +18,8 @@
 #include <linux/blkdev.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
 
 /* Possible states of device */
 enum {
@@ -62,6 +64,11 @@ struct loop_device {
 	struct task_struct	*lo_thread;
 	wait_queue_head_t	lo_event;
 
+	/* workqueue mode: one work item per bio instead of lo_thread */
+	struct workqueue_struct	*lo_wq;
+	struct rw_semaphore	lo_wq_sem;	/* held for write to switch */
+	int			lo_workers;
+
 	struct request_queue	*lo_queue;
 	struct gendisk		*lo_disk;
 };
@@ -75,6 +82,7 @@ enum {
 	LO_FLAGS_READ_ONLY	= 1,
 	LO_FLAGS_AUTOCLEAR	= 4,
 	LO_FLAGS_PARTSCAN	= 8,
+	LO_FLAGS_DIRECT_IO	= 16,
 };
 
 #include <asm/posix_types.h>	/* for __kernel_old_dev_t */
@@ -0,0 +1,55 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+/*
+ *  LZ4 Public Kernel Interface
+ *
+ *  Compressor and decompressor for the LZ4 block format: a byte-aligned
+ *  LZ77 coder without entropy stage, trading ratio for decompression
+ *  speed.  Streams are compatible with the reference implementation
+ *  at http://code.google.com/p/lz4/.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#define LZ4_MEM_COMPRESS	(16 * 1024)
+
+/* largest input accepted by lz4_compress() */
+#define LZ4_MAX_INPUT_SIZE	0x7E000000
+
+/* worst-case compressed size of 'isize' bytes */
+#define lz4_compressbound(isize)	((isize) + ((isize) / 255) + 16)
+
+/*
+ * lz4_compress()
+ *	src	: source address of the original data
+ *	src_len	: size of the original data
+ *	dst	: output buffer address of the compressed data
+ *	dst_len	: size of the output buffer on entry, compressed size
+ *		  on successful return
+ *	wrkmem	: scratch space of LZ4_MEM_COMPRESS bytes
+ *
+ *	Returns 0 on success, -E2BIG if the output does not fit in
+ *	*dst_len bytes and -EINVAL if src_len exceeds LZ4_MAX_INPUT_SIZE.
+ *	An output buffer of lz4_compressbound(src_len) bytes always fits.
+ */
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem);
+
+/*
+ * lz4_decompress_safe()
+ *	src	: source address of the compressed data
+ *	src_len	: size of the compressed data
+ *	dst	: output buffer address of the decompressed data
+ *	dst_len	: size of the output buffer on entry, decompressed size
+ *		  on successful return
+ *
+ *	Never reads or writes outside the given buffers, whatever the
+ *	input.  Returns 0 on success and -EINVAL if the input is malformed
+ *	or decompresses to more than *dst_len bytes.
+ */
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len);
+
+#endif
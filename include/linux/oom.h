@@ -43,6 +43,27 @@ enum oom_constraint {
 extern void compare_swap_oom_score_adj(int old_val, int new_val);
 extern int test_set_oom_score_adj(int new_val);
 
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER_ADJ_BUCKETS
+/*
+ * Keep the low memory killer's per-oom_score_adj lists in sync.  Called
+ * with the new thread group leader linked, with the group unhashed, and
+ * after the group's oom_score_adj was written, without task_lock held.
+ */
+extern void lowmem_adj_add(struct task_struct *p);
+extern void lowmem_adj_del(struct task_struct *p);
+extern void lowmem_adj_update(struct task_struct *p);
+#else
+static inline void lowmem_adj_add(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_del(struct task_struct *p)
+{
+}
+static inline void lowmem_adj_update(struct task_struct *p)
+{
+}
+#endif
+
 extern unsigned int oom_badness(struct task_struct *p, struct mem_cgroup *memcg,
 			const nodemask_t *nodemask, unsigned long totalpages);
 extern int try_set_zonelist_oom(struct zonelist *zonelist, gfp_t gfp_flags);
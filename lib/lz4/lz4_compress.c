@@ -0,0 +1,256 @@
+/*
+ *  LZ4 Compressor
+ *
+ *  Greedy single-pass LZ4 block compressor.  Candidate matches are
+ *  found through a hash of the next four input bytes; the table holds
+ *  offsets from the start of the input so it fits in LZ4_MEM_COMPRESS
+ *  regardless of the word size.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+static __always_inline u32 lz4_hash(u32 seq, const bool small)
+{
+	return (seq * 2654435761U) >>
+		(32 - (small ? LZ4_HASHLOG_64K : LZ4_HASHLOG));
+}
+
+static __always_inline u32 lz4_hash_at(const u8 *p, const bool small)
+{
+	return lz4_hash(get_unaligned((const u32 *)p), small);
+}
+
+static __always_inline const u8 *lz4_get_pos(void *table, u32 h,
+		const u8 *base, const bool small)
+{
+	if (small)
+		return base + ((u16 *)table)[h];
+	return base + ((u32 *)table)[h];
+}
+
+static __always_inline void lz4_put_pos(void *table, u32 h, const u8 *p,
+		const u8 *base, const bool small)
+{
+	if (small)
+		((u16 *)table)[h] = p - base;
+	else
+		((u32 *)table)[h] = p - base;
+}
+
+/* number of equal leading bytes given the xor of two words */
+static inline unsigned int lz4_nb_common_bytes(unsigned long diff)
+{
+#ifdef __LITTLE_ENDIAN
+	return __ffs(diff) >> 3;
+#else
+	return (BITS_PER_LONG - 1 - __fls(diff)) >> 3;
+#endif
+}
+
+/* length of the common prefix of ip and match, not reading past limit */
+static inline unsigned int lz4_count(const u8 *ip, const u8 *match,
+		const u8 *limit)
+{
+	const u8 *start = ip;
+
+	while (likely(ip < limit - (sizeof(long) - 1))) {
+		unsigned long diff = get_unaligned((const unsigned long *)match) ^
+				get_unaligned((const unsigned long *)ip);
+
+		if (!diff) {
+			ip += sizeof(long);
+			match += sizeof(long);
+			continue;
+		}
+		return ip - start + lz4_nb_common_bytes(diff);
+	}
+#if BITS_PER_LONG == 64
+	if (ip < limit - 3 && get_unaligned((const u32 *)match) ==
+			get_unaligned((const u32 *)ip)) {
+		ip += 4;
+		match += 4;
+	}
+#endif
+	if (ip < limit - 1 && get_unaligned((const u16 *)match) ==
+			get_unaligned((const u16 *)ip)) {
+		ip += 2;
+		match += 2;
+	}
+	if (ip < limit && *match == *ip)
+		ip++;
+	return ip - start;
+}
+
+static __always_inline int lz4_compress_generic(const u8 *src, size_t src_len,
+		u8 *dst, size_t *dst_len, void *table, const bool small)
+{
+	const u8 *ip = src;
+	const u8 *anchor = src;
+	const u8 * const iend = src + src_len;
+	const u8 * const mflimit = iend - LZ4_MFLIMIT;
+	const u8 * const matchlimit = iend - LZ4_LASTLITERALS;
+	u8 *op = dst;
+	u8 * const oend = dst + *dst_len;
+	size_t last;
+	u32 forward_h;
+
+	if (src_len < LZ4_MINLENGTH)
+		goto last_literals;
+
+	memset(table, 0, LZ4_MEM_COMPRESS);
+	lz4_put_pos(table, lz4_hash_at(ip, small), ip, src, small);
+	ip++;
+	forward_h = lz4_hash_at(ip, small);
+
+	for (;;) {
+		const u8 *match;
+		u8 *token;
+		unsigned int len;
+
+		/* find a match, stepping further the longer we fail */
+		{
+			const u8 *forward_ip = ip;
+			unsigned int step = 1;
+			unsigned int attempts = 1 << LZ4_SKIPSTRENGTH;
+
+			do {
+				u32 h = forward_h;
+
+				ip = forward_ip;
+				forward_ip += step;
+				step = attempts++ >> LZ4_SKIPSTRENGTH;
+				if (unlikely(forward_ip > mflimit))
+					goto last_literals;
+
+				match = lz4_get_pos(table, h, src, small);
+				forward_h = lz4_hash_at(forward_ip, small);
+				lz4_put_pos(table, h, ip, src, small);
+			} while ((!small && match + LZ4_MAX_DISTANCE < ip) ||
+				 get_unaligned((const u32 *)match) !=
+				 get_unaligned((const u32 *)ip));
+		}
+
+		/* extend the match backwards over the pending literals */
+		while (ip > anchor && match > src && ip[-1] == match[-1]) {
+			ip--;
+			match--;
+		}
+
+		/* literal run */
+		len = ip - anchor;
+		token = op++;
+		if (unlikely(op + len + (2 + 1 + LZ4_LASTLITERALS) + len / 255 >
+				oend))
+			return -E2BIG;
+		if (len >= LZ4_RUN_MASK) {
+			unsigned int rest = len - LZ4_RUN_MASK;
+
+			*token = LZ4_RUN_MASK << LZ4_ML_BITS;
+			for (; rest >= 255; rest -= 255)
+				*op++ = 255;
+			*op++ = rest;
+		} else {
+			*token = len << LZ4_ML_BITS;
+		}
+		lz4_wildcopy(op, anchor, op + len);
+		op += len;
+
+next_match:
+		put_unaligned_le16(ip - match, op);
+		op += 2;
+
+		/* match length beyond the guaranteed LZ4_MINMATCH bytes */
+		ip += LZ4_MINMATCH;
+		len = lz4_count(ip, match + LZ4_MINMATCH, matchlimit);
+		ip += len;
+		if (unlikely(op + (1 + LZ4_LASTLITERALS) + (len >> 8) > oend))
+			return -E2BIG;
+		if (len >= LZ4_ML_MASK) {
+			*token += LZ4_ML_MASK;
+			len -= LZ4_ML_MASK;
+			for (; len >= 510; len -= 510) {
+				*op++ = 255;
+				*op++ = 255;
+			}
+			if (len >= 255) {
+				len -= 255;
+				*op++ = 255;
+			}
+			*op++ = len;
+		} else {
+			*token += len;
+		}
+
+		anchor = ip;
+		if (ip > mflimit)
+			break;
+
+		lz4_put_pos(table, lz4_hash_at(ip - 2, small), ip - 2, src,
+			    small);
+
+		/* a match may start right where this one ended */
+		{
+			u32 h = lz4_hash_at(ip, small);
+
+			match = lz4_get_pos(table, h, src, small);
+			lz4_put_pos(table, h, ip, src, small);
+			if ((small || match + LZ4_MAX_DISTANCE >= ip) &&
+			    get_unaligned((const u32 *)match) ==
+			    get_unaligned((const u32 *)ip)) {
+				token = op++;
+				*token = 0;
+				goto next_match;
+			}
+		}
+
+		forward_h = lz4_hash_at(++ip, small);
+	}
+
+last_literals:
+	last = iend - anchor;
+	if (op + 1 + last + (last + 255 - LZ4_RUN_MASK) / 255 > oend)
+		return -E2BIG;
+	if (last >= LZ4_RUN_MASK) {
+		size_t rest = last - LZ4_RUN_MASK;
+
+		*op++ = LZ4_RUN_MASK << LZ4_ML_BITS;
+		for (; rest >= 255; rest -= 255)
+			*op++ = 255;
+		*op++ = rest;
+	} else {
+		*op++ = last << LZ4_ML_BITS;
+	}
+	memcpy(op, anchor, last);
+	op += last;
+
+	*dst_len = op - dst;
+	return 0;
+}
+
+int lz4_compress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len, void *wrkmem)
+{
+	BUILD_BUG_ON((1 << LZ4_HASHLOG) * sizeof(u32) > LZ4_MEM_COMPRESS);
+	BUILD_BUG_ON((1 << LZ4_HASHLOG_64K) * sizeof(u16) > LZ4_MEM_COMPRESS);
+
+	if (unlikely(src_len > LZ4_MAX_INPUT_SIZE))
+		return -EINVAL;
+	if (src_len < LZ4_64KLIMIT)
+		return lz4_compress_generic(src, src_len, dst, dst_len,
+					    wrkmem, true);
+	return lz4_compress_generic(src, src_len, dst, dst_len, wrkmem, false);
+}
+EXPORT_SYMBOL(lz4_compress);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 compressor");
@@ -0,0 +1,177 @@
+/*
+ *  LZ4 Decompressor
+ *
+ *  Literals and matches are copied eight bytes at a time while both
+ *  buffers have room for the overrun; only the tail of the output falls
+ *  back to byte copies.  Every length and offset is validated, so a
+ *  corrupt stream can at worst produce garbage inside 'dst'.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/lz4.h>
+#include <asm/unaligned.h>
+#include "lz4defs.h"
+
+/*
+ * For offsets below 8 the first eight bytes of a match are copied by
+ * hand; these adjust 'match' so that afterwards op - match >= 8 and the
+ * rest can be copied a word at a time.
+ */
+static const int dec32table[] = { 0, 1, 2, 1, 4, 4, 4, 4 };
+static const int dec64table[] = { 0, 0, 0, -1, 0, 1, 2, 3 };
+
+int lz4_decompress_safe(const unsigned char *src, size_t src_len,
+		unsigned char *dst, size_t *dst_len)
+{
+	const u8 *ip = src;
+	const u8 * const iend = src + src_len;
+	u8 *op = dst;
+	u8 * const oend = dst + *dst_len;
+	/* limits for the short sequence fast path below */
+	const u8 * const ishort = iend - (14 + 2);
+	u8 * const oshort = oend - (14 + 18);
+
+	if (unlikely(!src_len))
+		goto fail;
+
+	for (;;) {
+		unsigned int token;
+		size_t len, offset;
+		const u8 *match;
+		u8 *cpy;
+
+		if (unlikely(ip >= iend))
+			goto fail;
+		token = *ip++;
+
+		len = token >> LZ4_ML_BITS;
+
+		/*
+		 * Most sequences have fewer than 15 literals and a short
+		 * match.  Far enough from both ends they can be copied with
+		 * fixed-size moves, without the bounds checks below.
+		 */
+		if (len != LZ4_RUN_MASK && likely(ip < ishort && op <= oshort)) {
+			LZ4_COPY8(op, ip);
+			LZ4_COPY8(op + 8, ip + 8);
+			op += len;
+			ip += len;
+
+			offset = get_unaligned_le16(ip);
+			ip += 2;
+			match = op - offset;
+			len = token & LZ4_ML_MASK;
+			if (len != LZ4_ML_MASK && offset >= 8 && match >= dst) {
+				LZ4_COPY8(op, match);
+				LZ4_COPY8(op + 8, match + 8);
+				put_unaligned(get_unaligned((const u16 *)(match + 16)),
+					      (u16 *)(op + 16));
+				op += len + LZ4_MINMATCH;
+				continue;
+			}
+			goto decode_match;
+		}
+
+		/* literal run */
+		if (len == LZ4_RUN_MASK) {
+			unsigned int s;
+
+			do {
+				if (unlikely(ip >= iend))
+					goto fail;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+			if (unlikely((uintptr_t)op + len < (uintptr_t)op ||
+				     (uintptr_t)ip + len < (uintptr_t)ip))
+				goto fail;
+		}
+
+		cpy = op + len;
+		if (cpy > oend - LZ4_MFLIMIT ||
+		    ip + len > iend - (2 + 1 + LZ4_LASTLITERALS)) {
+			/* only the final run may come this close to the end */
+			if (ip + len != iend || cpy > oend)
+				goto fail;
+			memcpy(op, ip, len);
+			op += len;
+			break;
+		}
+		lz4_wildcopy(op, ip, cpy);
+		ip += len;
+		op = cpy;
+
+		/* match */
+		offset = get_unaligned_le16(ip);
+		ip += 2;
+		match = op - offset;
+		len = token & LZ4_ML_MASK;
+
+decode_match:
+		if (unlikely(!offset || match < dst))
+			goto fail;
+
+		if (len == LZ4_ML_MASK) {
+			unsigned int s;
+
+			do {
+				if (unlikely(ip > iend - LZ4_LASTLITERALS))
+					goto fail;
+				s = *ip++;
+				len += s;
+			} while (s == 255);
+			if (unlikely((uintptr_t)op + len < (uintptr_t)op))
+				goto fail;
+		}
+		len += LZ4_MINMATCH;
+
+		cpy = op + len;
+		if (unlikely(cpy > oend - LZ4_LASTLITERALS))
+			goto fail;
+
+		if (unlikely(offset < 8)) {
+			op[0] = match[0];
+			op[1] = match[1];
+			op[2] = match[2];
+			op[3] = match[3];
+			match += dec32table[offset];
+			memcpy(op + 4, match, 4);
+			match -= dec64table[offset];
+		} else {
+			LZ4_COPY8(op, match);
+			match += 8;
+		}
+		op += 8;
+
+		if (unlikely(cpy > oend - LZ4_MFLIMIT)) {
+			u8 * const olimit = oend - LZ4_COPYLENGTH;
+
+			if (op < olimit) {
+				lz4_wildcopy(op, match, olimit);
+				match += olimit - op;
+				op = olimit;
+			}
+			while (op < cpy)
+				*op++ = *match++;
+		} else if (op < cpy) {
+			lz4_wildcopy(op, match, cpy);
+		}
+		op = cpy;
+	}
+
+	*dst_len = op - dst;
+	return 0;
+
+fail:
+	return -EINVAL;
+}
+EXPORT_SYMBOL(lz4_decompress_safe);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZ4 decompressor");
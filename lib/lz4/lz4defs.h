@@ -0,0 +1,64 @@
+/*
+ *  lz4defs.h -- LZ4 block format constants and copy helpers
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ */
+
+/*
+ * A sequence is a token byte holding the literal run length in its high
+ * nibble and the match length minus LZ4_MINMATCH in its low nibble,
+ * optional 255-continued literal length bytes, the literals, a 16-bit
+ * little-endian match offset and optional match length bytes.  The
+ * last sequence carries only literals.
+ */
+#define LZ4_MINMATCH		4
+#define LZ4_COPYLENGTH		8
+#define LZ4_LASTLITERALS	5
+#define LZ4_MFLIMIT		(LZ4_COPYLENGTH + LZ4_MINMATCH)
+#define LZ4_MINLENGTH		(LZ4_MFLIMIT + 1)
+
+#define LZ4_ML_BITS		4
+#define LZ4_ML_MASK		((1U << LZ4_ML_BITS) - 1)
+#define LZ4_RUN_BITS		(8 - LZ4_ML_BITS)
+#define LZ4_RUN_MASK		((1U << LZ4_RUN_BITS) - 1)
+
+#define LZ4_MAX_DISTANCE	65535
+
+/*
+ * The compressor's hash table fills LZ4_MEM_COMPRESS: 16-bit offsets
+ * for inputs that fit in 64 KiB, 32-bit offsets above that.
+ */
+#define LZ4_HASHLOG		12
+#define LZ4_HASHLOG_64K		(LZ4_HASHLOG + 1)
+#define LZ4_64KLIMIT		(65536 + LZ4_MFLIMIT - 1)
+
+/* how quickly the match finder speeds up over incompressible data */
+#define LZ4_SKIPSTRENGTH	6
+
+#if BITS_PER_LONG == 64
+#define LZ4_COPY8(dst, src)	\
+		put_unaligned(get_unaligned((const u64 *)(src)), (u64 *)(dst))
+#else
+#define LZ4_COPY8(dst, src)						\
+	do {								\
+		put_unaligned(get_unaligned((const u32 *)(src)),	\
+			(u32 *)(dst));					\
+		put_unaligned(get_unaligned((const u32 *)(src) + 1),	\
+			(u32 *)(dst) + 1);				\
+	} while (0)
+#endif
+
+/*
+ * Copy from src to dst in 8-byte steps until dst reaches end.  May write
+ * up to 7 bytes past end, which callers must leave room for.
+ */
+static inline void lz4_wildcopy(u8 *dst, const u8 *src, u8 *end)
+{
+	do {
+		LZ4_COPY8(dst, src);
+		dst += 8;
+		src += 8;
+	} while (dst < end);
+}
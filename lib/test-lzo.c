@@ -0,0 +1,229 @@
+/*
+ * LZO1X self-test and benchmark
+ *
+ * Loading this module round-trips a few data patterns through
+ * lzo1x_1_compress() and lzo1x_decompress_safe(), checks that truncated
+ * streams and short output buffers are rejected, and then reports
+ * compression and decompression throughput in MB/s for page-sized and
+ * 128 KiB inputs.  The module then refuses to stay loaded.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define pr_fmt(fmt) "test-lzo: " fmt
+
+#include <linux/init.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+#include <linux/lzo.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#define LZO_TEST_MAX_LEN	(128 * 1024)
+
+static unsigned int bench_mb = 32;
+module_param(bench_mb, uint, 0);
+MODULE_PARM_DESC(bench_mb, "MiB processed per benchmark case (0 disables)");
+
+enum lzo_test_pattern {
+	LZO_TEST_ZERO,
+	LZO_TEST_TEXT,
+	LZO_TEST_MIXED,
+	LZO_TEST_RANDOM,
+	NR_LZO_TEST_PATTERNS,
+};
+
+static const char * const pattern_names[NR_LZO_TEST_PATTERNS] = {
+	"zero", "text", "mixed", "random",
+};
+
+static const char * const words[] = {
+	"the ", "page ", "cache ", "swap ", "of ", "and ", "kernel ",
+	"memory ", "block ", "device ", "to ", "compressed ", "a ", "data ",
+	"\n", "struct ", "{ ", "} ", "0x0000 ", "return ",
+};
+
+static unsigned char *src, *comp, *out;
+static void *wrkmem;
+
+static void __init lzo_test_fill(enum lzo_test_pattern pattern, size_t len)
+{
+	struct rnd_state rnd;
+	size_t i = 0;
+
+	prandom32_seed(&rnd, 0x6c7a6f);
+
+	switch (pattern) {
+	case LZO_TEST_ZERO:
+		memset(src, 0, len);
+		break;
+	case LZO_TEST_TEXT:
+		while (i < len) {
+			const char *w = words[prandom32(&rnd) % ARRAY_SIZE(words)];
+
+			while (*w && i < len)
+				src[i++] = *w++;
+		}
+		break;
+	case LZO_TEST_MIXED:
+		/* runs of random bytes separated by runs of a repeated byte */
+		while (i < len) {
+			size_t run = min_t(size_t, 16 + prandom32(&rnd) % 256,
+						len - i);
+			bool rnd_run = (i / 256) & 1;
+			unsigned char c = prandom32(&rnd);
+
+			for (; run; run--)
+				src[i++] = rnd_run ? prandom32(&rnd) : c;
+		}
+		break;
+	case LZO_TEST_RANDOM:
+		for (; i < len; i++)
+			src[i] = prandom32(&rnd);
+		break;
+	default:
+		BUG();
+	}
+}
+
+static int __init lzo_test_roundtrip(enum lzo_test_pattern pattern,
+				size_t len)
+{
+	size_t comp_len = lzo1x_worst_compress(len);
+	size_t out_len = len;
+	size_t trunc;
+	int ret;
+
+	ret = lzo1x_1_compress(src, len, comp, &comp_len, wrkmem);
+	if (ret != LZO_E_OK || comp_len > lzo1x_worst_compress(len)) {
+		pr_err("%s/%zu: compress failed (%d, %zu bytes)\n",
+			pattern_names[pattern], len, ret, comp_len);
+		return -EINVAL;
+	}
+
+	ret = lzo1x_decompress_safe(comp, comp_len, out, &out_len);
+	if (ret != LZO_E_OK || out_len != len || memcmp(src, out, len)) {
+		pr_err("%s/%zu: round trip failed (%d, %zu bytes)\n",
+			pattern_names[pattern], len, ret, out_len);
+		return -EINVAL;
+	}
+
+	/* a truncated stream must never decode as complete */
+	for (trunc = 0; trunc < comp_len; trunc += 1 + trunc / 4) {
+		out_len = len;
+		ret = lzo1x_decompress_safe(comp, trunc, out, &out_len);
+		if (ret == LZO_E_OK) {
+			pr_err("%s/%zu: accepted stream truncated to %zu\n",
+				pattern_names[pattern], len, trunc);
+			return -EINVAL;
+		}
+	}
+
+	/* nor may it be decoded into a buffer that is too small */
+	if (len > 1) {
+		out_len = len - 1;
+		ret = lzo1x_decompress_safe(comp, comp_len, out, &out_len);
+		if (ret != LZO_E_OUTPUT_OVERRUN) {
+			pr_err("%s/%zu: short output returned %d\n",
+				pattern_names[pattern], len, ret);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static u64 __init lzo_test_rate(u64 bytes, s64 ns)
+{
+	if (ns <= 0)
+		ns = 1;
+	return div64_u64(bytes * NSEC_PER_SEC, ns) >> 20;
+}
+
+static void __init lzo_test_bench(enum lzo_test_pattern pattern, size_t len)
+{
+	unsigned int i, loops;
+	size_t comp_len = 0, out_len;
+	ktime_t start;
+	s64 comp_ns, decomp_ns;
+
+	loops = max_t(u64, 1, ((u64)bench_mb << 20) / len);
+
+	start = ktime_get();
+	for (i = 0; i < loops; i++) {
+		comp_len = lzo1x_worst_compress(len);
+		lzo1x_1_compress(src, len, comp, &comp_len, wrkmem);
+		cond_resched();
+	}
+	comp_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < loops; i++) {
+		out_len = len;
+		lzo1x_decompress_safe(comp, comp_len, out, &out_len);
+		cond_resched();
+	}
+	decomp_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	pr_info("%-6s %6zu bytes: ratio %3zu%%, compress %5llu MB/s, decompress %5llu MB/s\n",
+		pattern_names[pattern], len, comp_len * 100 / len,
+		lzo_test_rate((u64)loops * len, comp_ns),
+		lzo_test_rate((u64)loops * len, decomp_ns));
+}
+
+static int __init test_lzo_init(void)
+{
+	/* 49152 is where the compressor starts a new dictionary block */
+	static const size_t lens[] __initconst = {
+		1, 3, 4, 17, 18, 21, 255, 256, 1000,
+		PAGE_SIZE, 49152, 49173, LZO_TEST_MAX_LEN,
+	};
+	static const size_t bench_lens[] __initconst = {
+		PAGE_SIZE, LZO_TEST_MAX_LEN,
+	};
+	enum lzo_test_pattern pattern;
+	unsigned int i;
+	int ret = -ENOMEM;
+
+	src = vmalloc(LZO_TEST_MAX_LEN);
+	comp = vmalloc(lzo1x_worst_compress(LZO_TEST_MAX_LEN));
+	out = vmalloc(LZO_TEST_MAX_LEN);
+	wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+	if (!src || !comp || !out || !wrkmem)
+		goto out;
+
+	for (pattern = 0; pattern < NR_LZO_TEST_PATTERNS; pattern++) {
+		for (i = 0; i < ARRAY_SIZE(lens); i++) {
+			lzo_test_fill(pattern, lens[i]);
+			ret = lzo_test_roundtrip(pattern, lens[i]);
+			if (ret)
+				goto out;
+		}
+	}
+	pr_info("all round trip tests passed\n");
+
+	if (bench_mb) {
+		for (pattern = 0; pattern < NR_LZO_TEST_PATTERNS; pattern++) {
+			for (i = 0; i < ARRAY_SIZE(bench_lens); i++) {
+				lzo_test_fill(pattern, bench_lens[i]);
+				lzo_test_bench(pattern, bench_lens[i]);
+			}
+		}
+	}
+	ret = -EAGAIN;
+out:
+	vfree(wrkmem);
+	vfree(out);
+	vfree(comp);
+	vfree(src);
+	return ret;
+}
+module_init(test_lzo_init);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("LZO1X self-test and benchmark");
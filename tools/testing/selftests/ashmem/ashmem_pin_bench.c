@@ -0,0 +1,186 @@
+/*
+ * ashmem pin/unpin benchmark
+ *
+ * Each thread owns an ashmem area and keeps unpinning and re-pinning
+ * chunks of it, touching a chunk again when it comes back purged.  The
+ * number of threads doubles up to the number of online CPUs, first on
+ * its own and then with another thread purging all unpinned memory in a
+ * loop (ASHMEM_PURGE_ALL_CACHES, which needs CAP_SYS_ADMIN), and the
+ * pin/unpin pairs per second are reported for each.  Areas don't share
+ * anything, so the rate should grow with the threads, and reclaim
+ * shouldn't stall the threads it isn't purging.
+ *
+ * If /dev/ashmem doesn't exist, the test is skipped.
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <linux/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../../../drivers/staging/android/ashmem.h"
+
+#define ASHMEM_DEV	"/dev/ashmem"
+#define AREA_PAGES	256
+#define CHUNK_PAGES	16
+#define RUN_SECONDS	2
+#define MAX_THREADS	256
+
+static volatile int stop;
+static long page_size;
+
+struct worker {
+	pthread_t thread;
+	unsigned long pairs;
+	unsigned long purged;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	size_t chunk = CHUNK_PAGES * page_size;
+	size_t size = AREA_PAGES * page_size;
+	struct ashmem_pin pin;
+	unsigned int i = 0;
+	char *map;
+	size_t off;
+	int fd;
+
+	fd = open(ASHMEM_DEV, O_RDWR);
+	if (fd < 0)
+		die("open " ASHMEM_DEV);
+	if (ioctl(fd, ASHMEM_SET_SIZE, size) < 0)
+		die("ASHMEM_SET_SIZE");
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap");
+	for (off = 0; off < size; off += page_size)
+		map[off] = 1;
+
+	while (!stop) {
+		pin.offset = (i++ % (AREA_PAGES / CHUNK_PAGES)) * chunk;
+		pin.len = chunk;
+		if (ioctl(fd, ASHMEM_UNPIN, &pin) < 0)
+			die("ASHMEM_UNPIN");
+		if (ioctl(fd, ASHMEM_PIN, &pin) == ASHMEM_WAS_PURGED) {
+			for (off = 0; off < chunk; off += page_size)
+				map[pin.offset + off] = 1;
+			w->purged++;
+		}
+		w->pairs++;
+	}
+
+	munmap(map, size);
+	close(fd);
+	return NULL;
+}
+
+static void *run_reclaim(void *arg)
+{
+	int fd = *(int *)arg;
+
+	while (!stop)
+		ioctl(fd, ASHMEM_PURGE_ALL_CACHES);
+	return NULL;
+}
+
+/* Returns 0, or -1 if reclaim was asked for but isn't permitted */
+static int run(int threads, int reclaim)
+{
+	struct worker workers[MAX_THREADS];
+	unsigned long pairs = 0, purged = 0;
+	pthread_t reclaimer;
+	int fd = -1;
+	int i;
+
+	if (reclaim) {
+		fd = open(ASHMEM_DEV, O_RDWR);
+		if (fd < 0)
+			die("open " ASHMEM_DEV);
+		if (ioctl(fd, ASHMEM_PURGE_ALL_CACHES) < 0 && errno == EPERM) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	stop = 0;
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker,
+				   &workers[i]))
+			die("pthread_create");
+	}
+	if (reclaim && pthread_create(&reclaimer, NULL, run_reclaim, &fd))
+		die("pthread_create");
+
+	sleep(RUN_SECONDS);
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		pairs += workers[i].pairs;
+		purged += workers[i].purged;
+	}
+	if (reclaim) {
+		pthread_join(reclaimer, NULL);
+		close(fd);
+	}
+
+	printf("%7d %8s %16.0f %16.0f %10lu\n", threads,
+	       reclaim ? "yes" : "no", (double)pairs / RUN_SECONDS,
+	       (double)pairs / RUN_SECONDS / threads, purged);
+	fflush(stdout);
+	return 0;
+}
+
+int main(void)
+{
+	int reclaim, threads;
+	long cpus;
+
+	if (access(ASHMEM_DEV, R_OK | W_OK)) {
+		printf("ashmem_pin_bench: no usable %s, skipping\n",
+		       ASHMEM_DEV);
+		return 0;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+
+	printf("%7s %8s %16s %16s %10s\n", "threads", "reclaim",
+	       "pairs/s", "per thread", "purged");
+	for (reclaim = 0; reclaim <= 1; reclaim++) {
+		for (threads = 1; ; threads *= 2) {
+			if (threads > cpus)
+				threads = cpus;
+			if (run(threads, reclaim)) {
+				printf("ashmem_pin_bench: no CAP_SYS_ADMIN, "
+				       "skipping the runs with reclaim\n");
+				break;
+			}
+			if (threads == cpus)
+				break;
+		}
+	}
+	return 0;
+}
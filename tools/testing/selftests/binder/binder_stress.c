@@ -0,0 +1,439 @@
+/*
+ * Binder stress test
+ *
+ * Runs pairs of client and server processes that do nothing but send each
+ * other empty transactions, and reports transactions per second as the
+ * number of pairs doubles up to the number of online CPUs.  The pairs
+ * share nothing but the driver, so the rate should grow with them until
+ * the CPUs run out; where it stops growing earlier, the driver is what
+ * serializes them.
+ *
+ * A context manager process hands out the servers' objects to the
+ * clients.  If /dev/binder doesn't exist, or already has a context
+ * manager (a running Android userspace), the test is skipped.
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../../../drivers/staging/android/binder.h"
+
+#define BINDER_DEV	"/dev/binder"
+#define MAP_SIZE	(128 * 1024)
+#define RUN_SECONDS	2
+#define MAX_PAIRS	256
+#define MAX_OBJECTS	(2 * MAX_PAIRS)
+
+enum {
+	CODE_ADD = 1,	/* server to manager: register object number n */
+	CODE_GET,	/* client to manager: look up object number n */
+	CODE_PING,	/* client to server */
+};
+
+struct binder {
+	int fd;
+	void *map;
+	size_t wlen;
+	char wbuf[256];
+	char rbuf[256];
+};
+
+struct add_msg {
+	struct flat_binder_object obj;
+	unsigned long n;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void binder_open(struct binder *b)
+{
+	b->fd = open(BINDER_DEV, O_RDWR);
+	if (b->fd < 0)
+		die("open " BINDER_DEV);
+	b->map = mmap(NULL, MAP_SIZE, PROT_READ, MAP_PRIVATE, b->fd, 0);
+	if (b->map == MAP_FAILED)
+		die("mmap");
+	b->wlen = 0;
+}
+
+static void put_cmd(struct binder *b, uint32_t cmd, const void *arg,
+		    size_t size)
+{
+	if (b->wlen + sizeof(cmd) + size > sizeof(b->wbuf)) {
+		fprintf(stderr, "write buffer overflow\n");
+		exit(1);
+	}
+	memcpy(b->wbuf + b->wlen, &cmd, sizeof(cmd));
+	memcpy(b->wbuf + b->wlen + sizeof(cmd), arg, size);
+	b->wlen += sizeof(cmd) + size;
+}
+
+/*
+ * Queues a transaction or reply.  data and offsets must stay valid until
+ * the next binder_io().
+ */
+static void put_transaction(struct binder *b, uint32_t cmd, uint32_t handle,
+			    uint32_t code, const void *data, size_t size,
+			    const size_t *offsets, size_t offsets_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = handle;
+	tr.code = code;
+	tr.data_size = size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	put_cmd(b, cmd, &tr, sizeof(tr));
+}
+
+static void put_free_buffer(struct binder *b,
+			    const struct binder_transaction_data *tr)
+{
+	put_cmd(b, BC_FREE_BUFFER, &tr->data.ptr.buffer,
+		sizeof(tr->data.ptr.buffer));
+}
+
+/*
+ * Writes the queued commands and reads once.  Reference count requests
+ * are acknowledged with the next write.  Returns BR_TRANSACTION or
+ * BR_REPLY, with the transaction in *tr, if one was read, else 0.
+ */
+static uint32_t binder_io(struct binder *b, struct binder_transaction_data *tr)
+{
+	struct binder_write_read bwr;
+	struct binder_ptr_cookie pc;
+	uint32_t got = 0;
+	char *ptr, *end;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_size = b->wlen;
+	bwr.write_buffer = (unsigned long)b->wbuf;
+	bwr.read_size = sizeof(b->rbuf);
+	bwr.read_buffer = (unsigned long)b->rbuf;
+	if (ioctl(b->fd, BINDER_WRITE_READ, &bwr) < 0)
+		die("BINDER_WRITE_READ");
+	b->wlen = 0;
+
+	ptr = b->rbuf;
+	end = ptr + bwr.read_consumed;
+	while (ptr < end) {
+		uint32_t cmd;
+
+		memcpy(&cmd, ptr, sizeof(cmd));
+		ptr += sizeof(cmd);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_TRANSACTION_COMPLETE:
+		case BR_RELEASE:
+		case BR_DECREFS:
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			memcpy(&pc, ptr, sizeof(pc));
+			put_cmd(b, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+			       BC_ACQUIRE_DONE, &pc, sizeof(pc));
+			break;
+		case BR_TRANSACTION:
+		case BR_REPLY:
+			memcpy(tr, ptr, sizeof(*tr));
+			got = cmd;
+			break;
+		default:
+			fprintf(stderr, "unexpected binder return 0x%x\n", cmd);
+			exit(1);
+		}
+		ptr += _IOC_SIZE(cmd);
+	}
+	return got;
+}
+
+static void transact(struct binder *b, uint32_t handle, uint32_t code,
+		     const void *data, size_t size, const size_t *offsets,
+		     size_t offsets_size, struct binder_transaction_data *reply)
+{
+	put_transaction(b, BC_TRANSACTION, handle, code, data, size,
+			offsets, offsets_size);
+	while (binder_io(b, reply) != BR_REPLY)
+		;
+}
+
+static void run_manager(int ready_fd)
+{
+	static uint32_t handles[MAX_OBJECTS];
+	static struct flat_binder_object obj;
+	static size_t off;
+	struct binder_transaction_data tr;
+	struct binder b;
+	char status = 0;
+
+	binder_open(&b);
+	if (ioctl(b.fd, BINDER_SET_CONTEXT_MGR, 0) < 0) {
+		if (errno != EBUSY)
+			die("BINDER_SET_CONTEXT_MGR");
+		status = 1;
+	}
+	if (write(ready_fd, &status, 1) != 1)
+		die("write");
+	if (status)
+		exit(0);
+
+	put_cmd(&b, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		const struct add_msg *msg;
+		unsigned long n;
+
+		if (binder_io(&b, &tr) != BR_TRANSACTION)
+			continue;
+
+		switch (tr.code) {
+		case CODE_ADD:
+			msg = tr.data.ptr.buffer;
+			if (msg->n < MAX_OBJECTS) {
+				handles[msg->n] = msg->obj.handle;
+				/* keep the ref once the buffer is freed */
+				put_cmd(&b, BC_ACQUIRE, &handles[msg->n],
+					sizeof(handles[msg->n]));
+			}
+			put_free_buffer(&b, &tr);
+			put_transaction(&b, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			break;
+		case CODE_GET:
+			n = *(const unsigned long *)tr.data.ptr.buffer;
+			put_free_buffer(&b, &tr);
+			if (n >= MAX_OBJECTS || !handles[n]) {
+				put_transaction(&b, BC_REPLY, 0, 0,
+						NULL, 0, NULL, 0);
+				break;
+			}
+			memset(&obj, 0, sizeof(obj));
+			obj.type = BINDER_TYPE_HANDLE;
+			obj.handle = handles[n];
+			off = 0;
+			put_transaction(&b, BC_REPLY, 0, 0, &obj, sizeof(obj),
+					&off, sizeof(off));
+			break;
+		default:
+			put_free_buffer(&b, &tr);
+			put_transaction(&b, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+			break;
+		}
+	}
+}
+
+static void run_server(unsigned long n)
+{
+	struct binder_transaction_data tr;
+	struct add_msg msg;
+	struct binder b;
+	size_t off = 0;
+
+	binder_open(&b);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.obj.type = BINDER_TYPE_BINDER;
+	msg.obj.binder = &b;
+	msg.n = n;
+	transact(&b, 0, CODE_ADD, &msg, sizeof(msg), &off, sizeof(off), &tr);
+	put_free_buffer(&b, &tr);
+
+	put_cmd(&b, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		if (binder_io(&b, &tr) != BR_TRANSACTION)
+			continue;
+		put_free_buffer(&b, &tr);
+		put_transaction(&b, BC_REPLY, 0, 0, NULL, 0, NULL, 0);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_client(unsigned long n, int ready_fd, int start_fd,
+		       int result_fd)
+{
+	const struct flat_binder_object *obj;
+	struct binder_transaction_data tr;
+	unsigned long count = 0;
+	struct binder b;
+	uint32_t handle;
+	double end;
+	char c = 0;
+	int i;
+
+	binder_open(&b);
+
+	/* the server may not have registered yet */
+	for (;;) {
+		transact(&b, 0, CODE_GET, &n, sizeof(n), NULL, 0, &tr);
+		if (tr.data_size >= sizeof(*obj))
+			break;
+		put_free_buffer(&b, &tr);
+		usleep(1000);
+	}
+	obj = tr.data.ptr.buffer;
+	handle = obj->handle;
+	put_cmd(&b, BC_ACQUIRE, &handle, sizeof(handle));
+	put_free_buffer(&b, &tr);
+	/* flush the commands above with the first ping */
+
+	if (write(ready_fd, &c, 1) != 1 || read(start_fd, &c, 1) != 1)
+		die("pipe");
+
+	end = now() + RUN_SECONDS;
+	do {
+		for (i = 0; i < 64; i++) {
+			transact(&b, handle, CODE_PING, NULL, 0, NULL, 0, &tr);
+			put_free_buffer(&b, &tr);
+		}
+		count += 64;
+	} while (now() < end);
+
+	if (write(result_fd, &count, sizeof(count)) != sizeof(count))
+		die("write");
+	exit(0);
+}
+
+static pid_t spawn(void)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+		die("fork");
+	return pid;
+}
+
+/* Runs @pairs client/server pairs and returns their transactions/s */
+static double run_pairs(int pairs, unsigned long base)
+{
+	int ready[2], start[2], result[2];
+	pid_t servers[MAX_PAIRS], clients[MAX_PAIRS];
+	unsigned long total = 0;
+	int i;
+
+	if (pipe(ready) || pipe(start) || pipe(result))
+		die("pipe");
+
+	for (i = 0; i < pairs; i++) {
+		servers[i] = spawn();
+		if (!servers[i])
+			run_server(base + i);
+		clients[i] = spawn();
+		if (!clients[i])
+			run_client(base + i, ready[1], start[0], result[1]);
+	}
+	close(ready[1]);
+	close(start[0]);
+	close(result[1]);
+
+	for (i = 0; i < pairs; i++) {
+		char c;
+
+		if (read(ready[0], &c, 1) != 1) {
+			fprintf(stderr, "client failed to start\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < pairs; i++) {
+		if (write(start[1], "", 1) != 1)
+			die("write");
+	}
+	for (i = 0; i < pairs; i++) {
+		unsigned long count;
+
+		if (read(result[0], &count, sizeof(count)) != sizeof(count)) {
+			fprintf(stderr, "client failed\n");
+			exit(1);
+		}
+		total += count;
+	}
+
+	for (i = 0; i < pairs; i++) {
+		kill(servers[i], SIGKILL);
+		waitpid(servers[i], NULL, 0);
+		waitpid(clients[i], NULL, 0);
+	}
+	close(ready[0]);
+	close(start[1]);
+	close(result[0]);
+
+	return (double)total / RUN_SECONDS;
+}
+
+int main(void)
+{
+	int ready[2];
+	pid_t manager;
+	long cpus;
+	char status;
+	unsigned long base = 0;
+	int pairs;
+
+	if (access(BINDER_DEV, R_OK | W_OK)) {
+		printf("binder_stress: no usable %s, skipping\n", BINDER_DEV);
+		return 0;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_PAIRS)
+		cpus = MAX_PAIRS;
+
+	if (pipe(ready))
+		die("pipe");
+	manager = spawn();
+	if (!manager)
+		run_manager(ready[1]);
+	if (read(ready[0], &status, 1) != 1) {
+		fprintf(stderr, "context manager failed\n");
+		return 1;
+	}
+	if (status) {
+		printf("binder_stress: %s already has a context manager, skipping\n",
+		       BINDER_DEV);
+		waitpid(manager, NULL, 0);
+		return 0;
+	}
+
+	printf("%5s %16s %16s\n", "pairs", "transactions/s", "per pair");
+	for (pairs = 1; ; pairs *= 2) {
+		double rate;
+
+		if (pairs > cpus)
+			pairs = cpus;
+		rate = run_pairs(pairs, base);
+		base += pairs;
+		printf("%5d %16.0f %16.0f\n", pairs, rate, rate / pairs);
+		fflush(stdout);
+		if (pairs == cpus)
+			break;
+	}
+
+	kill(manager, SIGKILL);
+	waitpid(manager, NULL, 0);
+	return 0;
+}
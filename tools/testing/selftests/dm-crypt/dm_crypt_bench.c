@@ -0,0 +1,153 @@
+/*
+ * dm-crypt throughput benchmark
+ *
+ * Reads, or with -w overwrites, the first 64 MiB of a block device in
+ * 64 KiB O_DIRECT requests from 1, 2, 4, ... up to the number of online
+ * CPUs.  Each CPU runs one thread bound to it which keeps a single request
+ * in flight on its own slice of the range, like a fio job with numjobs set
+ * to the CPU count.  O_DIRECT bypasses the page cache, so on a dm-crypt
+ * device every byte goes through the cipher.  The throughput is reported
+ * for each CPU count, to compare a device set up with and without the
+ * same_cpu_crypt or any_cpu_crypt options.
+ *
+ * Usage: dm_crypt_bench [-w] <device>
+ * Writing destroys the data on the device.  The device is opened with
+ * O_EXCL, so a mounted one is refused.  Without a device the test is
+ * skipped.
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ */
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RANGE		(64 << 20)
+#define REQ_SIZE	(64 << 10)
+#define MAX_THREADS	256
+
+static int fd;
+static int do_write;
+
+struct job {
+	pthread_t thread;
+	int cpu;
+	off_t start;
+	off_t end;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *run_job(void *arg)
+{
+	struct job *job = arg;
+	cpu_set_t mask;
+	ssize_t n;
+	off_t off;
+	void *buf;
+
+	CPU_ZERO(&mask);
+	CPU_SET(job->cpu, &mask);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+		die("pthread_setaffinity_np");
+
+	if (posix_memalign(&buf, 4096, REQ_SIZE))
+		die("posix_memalign");
+	memset(buf, 0x5a, REQ_SIZE);
+
+	for (off = job->start; off < job->end; off += REQ_SIZE) {
+		if (do_write)
+			n = pwrite(fd, buf, REQ_SIZE, off);
+		else
+			n = pread(fd, buf, REQ_SIZE, off);
+		if (n != REQ_SIZE)
+			die(do_write ? "pwrite" : "pread");
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static double run(int *cpus, int nr)
+{
+	struct job jobs[MAX_THREADS];
+	off_t per_job = (off_t)(RANGE / REQ_SIZE / nr) * REQ_SIZE;
+	struct timespec start, end;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr; i++) {
+		jobs[i].cpu = cpus[i];
+		jobs[i].start = i * per_job;
+		jobs[i].end = (i + 1) * per_job;
+		if (pthread_create(&jobs[i].thread, NULL, run_job, &jobs[i]))
+			die("pthread_create");
+	}
+	for (i = 0; i < nr; i++)
+		pthread_join(jobs[i].thread, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (double)(nr * per_job) / (end.tv_sec - start.tv_sec +
+			(end.tv_nsec - start.tv_nsec) / 1e9);
+}
+
+int main(int argc, char *argv[])
+{
+	int cpus[MAX_THREADS];
+	unsigned long long size;
+	cpu_set_t online;
+	int opt, nr_cpus = 0, nr, i;
+
+	while ((opt = getopt(argc, argv, "w")) != -1) {
+		if (opt != 'w') {
+			fprintf(stderr, "usage: %s [-w] <device>\n", argv[0]);
+			return 1;
+		}
+		do_write = 1;
+	}
+	if (optind >= argc) {
+		printf("dm_crypt_bench: no device given, skipping\n");
+		return 0;
+	}
+
+	fd = open(argv[optind], (do_write ? O_RDWR : O_RDONLY) | O_DIRECT |
+		  O_EXCL);
+	if (fd < 0)
+		die(argv[optind]);
+	if (ioctl(fd, BLKGETSIZE64, &size))
+		die("BLKGETSIZE64");
+	if (size < RANGE) {
+		fprintf(stderr, "%s is smaller than %d bytes\n", argv[optind],
+			RANGE);
+		return 1;
+	}
+
+	if (sched_getaffinity(0, sizeof(online), &online))
+		die("sched_getaffinity");
+	for (i = 0; i < CPU_SETSIZE && nr_cpus < MAX_THREADS; i++)
+		if (CPU_ISSET(i, &online))
+			cpus[nr_cpus++] = i;
+
+	printf("%4s %12s\n", "cpus", do_write ? "write MB/s" : "read MB/s");
+	for (nr = 1; nr <= nr_cpus; nr *= 2) {
+		printf("%4d %12.1f\n", nr, run(cpus, nr) / 1e6);
+		fflush(stdout);
+	}
+
+	close(fd);
+	return 0;
+}
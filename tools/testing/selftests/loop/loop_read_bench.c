@@ -0,0 +1,176 @@
+/*
+ * Loop device random read benchmark
+ *
+ * Reads random 4 KiB blocks with O_DIRECT from each loop device given on
+ * the command line, from 1, 2, 4, ... up to twice the number of online
+ * CPUs threads, for a few seconds per run.  Each thread has one read in
+ * flight, so the thread count is the queue depth.  The IOPS of each run
+ * are reported.  The clean page cache of a device's backing file is
+ * dropped before every run, so that no run reads what an earlier one
+ * brought in.
+ *
+ * To compare the two ways a loop device handles bios, bind one device
+ * with the max_workers loop parameter set to 0 (single thread, the
+ * default) and one with a workqueue, e.g.
+ *
+ *	echo 0 > /sys/module/loop/parameters/max_workers
+ *	losetup /dev/loop0 /tmp/a.img
+ *	echo 16 > /sys/module/loop/parameters/max_workers
+ *	losetup /dev/loop1 /tmp/b.img
+ *	loop_read_bench loop0 loop1
+ *
+ * Without a device the test is skipped.
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ */
+
+#define _GNU_SOURCE
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define READ_SIZE	4096
+#define RUN_SECONDS	3
+#define MAX_THREADS	512
+
+static volatile int stop;
+static int dev_fd;
+static unsigned long nr_blocks;
+
+struct reader {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long reads;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static void *run_reader(void *arg)
+{
+	struct reader *r = arg;
+	off_t off;
+	void *buf;
+
+	if (posix_memalign(&buf, READ_SIZE, READ_SIZE))
+		die("posix_memalign");
+
+	while (!stop) {
+		off = (off_t)(rand_r(&r->seed) % nr_blocks) * READ_SIZE;
+		if (pread(dev_fd, buf, READ_SIZE, off) != READ_SIZE)
+			die("pread");
+		r->reads++;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Drop the clean pages of the backing file; the loop driver reads it
+ * through the page cache.
+ */
+static void drop_backing_cache(const char *name)
+{
+	char path[128], file[4096];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/loop/backing_file", name);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	len = read(fd, file, sizeof(file) - 1);
+	close(fd);
+	if (len <= 0)
+		return;
+	file[len] = 0;
+	file[strcspn(file, "\n")] = 0;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+static void bench(const char *name, int max_threads)
+{
+	struct reader readers[MAX_THREADS];
+	unsigned long long size;
+	unsigned long reads;
+	char path[64];
+	int nr, i;
+
+	snprintf(path, sizeof(path), "/dev/%s", name);
+	dev_fd = open(path, O_RDONLY | O_DIRECT);
+	if (dev_fd < 0)
+		die(path);
+	if (ioctl(dev_fd, BLKGETSIZE64, &size))
+		die("BLKGETSIZE64");
+	nr_blocks = size / READ_SIZE;
+	if (nr_blocks > RAND_MAX)
+		nr_blocks = RAND_MAX;
+	if (!nr_blocks) {
+		fprintf(stderr, "%s is smaller than %d bytes\n", path,
+			READ_SIZE);
+		exit(1);
+	}
+
+	for (nr = 1; nr <= max_threads; nr *= 2) {
+		drop_backing_cache(name);
+		stop = 0;
+		memset(readers, 0, sizeof(readers));
+		for (i = 0; i < nr; i++) {
+			readers[i].seed = i + 1;
+			if (pthread_create(&readers[i].thread, NULL,
+					   run_reader, &readers[i]))
+				die("pthread_create");
+		}
+
+		sleep(RUN_SECONDS);
+		stop = 1;
+
+		reads = 0;
+		for (i = 0; i < nr; i++) {
+			pthread_join(readers[i].thread, NULL);
+			reads += readers[i].reads;
+		}
+		printf("%8s %7d %10lu\n", name, nr, reads / RUN_SECONDS);
+		fflush(stdout);
+	}
+
+	close(dev_fd);
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus;
+	int i;
+
+	if (argc < 2) {
+		printf("loop_read_bench: no device given, skipping\n");
+		return 0;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (2 * cpus > MAX_THREADS)
+		cpus = MAX_THREADS / 2;
+
+	printf("%8s %7s %10s\n", "device", "readers", "IOPS");
+	for (i = 1; i < argc; i++)
+		bench(argv[i], 2 * cpus);
+
+	return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * Squashfs parallel read benchmark
+ *
+ * Reads every regular file below a directory of a mounted Squashfs file
+ * system with 1, 2, 4, ... up to the number of online CPUs reader threads,
+ * which take the files from a shared list, and reports the throughput for
+ * each count.  The clean page cache of every file is dropped before each
+ * run, so every run decompresses the whole tree again.  Comparing the
+ * numbers of one image mounted with threads=single, threads=multi and
+ * threads=percpu shows what each decompressor mode buys on a machine.
+ *
+ * Usage: squashfs_read_bench <directory>
+ * Without a directory the test is skipped.
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ */
+
+#define _GNU_SOURCE
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SQUASHFS_MAGIC	0x73717368
+#define READ_SIZE	(128 * 1024)
+#define MAX_THREADS	256
+
+static char **files;
+static unsigned int nr_files;
+static unsigned int next_file;
+static unsigned long long total_bytes;
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int add_file(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	(void)ftw;
+
+	if (flag != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (!(nr_files & (nr_files - 1))) {
+		files = realloc(files, (nr_files ? 2 * nr_files : 1) *
+				sizeof(*files));
+		if (!files)
+			die("realloc");
+	}
+	files[nr_files] = strdup(path);
+	if (!files[nr_files])
+		die("strdup");
+	nr_files++;
+	return 0;
+}
+
+static void drop_cache(void)
+{
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < nr_files; i++) {
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0)
+			die(files[i]);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+}
+
+static void *run_reader(void *arg)
+{
+	unsigned long long bytes = 0;
+	unsigned int i;
+	char *buf;
+	ssize_t n;
+	int fd;
+
+	(void)arg;
+	buf = malloc(READ_SIZE);
+	if (!buf)
+		die("malloc");
+
+	while ((i = __sync_fetch_and_add(&next_file, 1)) < nr_files) {
+		fd = open(files[i], O_RDONLY);
+		if (fd < 0)
+			die(files[i]);
+		while ((n = read(fd, buf, READ_SIZE)) > 0)
+			bytes += n;
+		if (n < 0)
+			die(files[i]);
+		close(fd);
+	}
+
+	__sync_fetch_and_add(&total_bytes, bytes);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t threads[MAX_THREADS];
+	struct timespec start, end;
+	struct statfs sfs;
+	double secs;
+	long cpus;
+	int nr, i;
+
+	if (argc < 2) {
+		printf("squashfs_read_bench: no directory given, skipping\n");
+		return 0;
+	}
+	if (statfs(argv[1], &sfs))
+		die(argv[1]);
+	if (sfs.f_type != SQUASHFS_MAGIC) {
+		fprintf(stderr, "%s is not on a squashfs file system\n",
+			argv[1]);
+		return 1;
+	}
+
+	/* FTW_MOUNT keeps other file systems mounted below out */
+	if (nftw(argv[1], add_file, 16, FTW_PHYS | FTW_MOUNT))
+		die(argv[1]);
+	printf("%u files below %s\n", nr_files, argv[1]);
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+
+	printf("%7s %10s %10s %8s\n", "readers", "MiB", "ms", "MB/s");
+	for (nr = 1; nr <= cpus; nr *= 2) {
+		drop_cache();
+		next_file = 0;
+		total_bytes = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < nr; i++)
+			if (pthread_create(&threads[i], NULL, run_reader, NULL))
+				die("pthread_create");
+		for (i = 0; i < nr; i++)
+			pthread_join(threads[i], NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		secs = end.tv_sec - start.tv_sec +
+		       (end.tv_nsec - start.tv_nsec) / 1e9;
+		printf("%7d %10llu %10.0f %8.1f\n", nr, total_bytes >> 20,
+		       secs * 1000, total_bytes / secs / 1e6);
+		fflush(stdout);
+	}
+
+	return 0;
+}
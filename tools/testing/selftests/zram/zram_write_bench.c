@@ -0,0 +1,217 @@
+/*
+ * zram parallel write benchmark
+ *
+ * Writer threads overwrite their own part of a zram device with
+ * compressible pages using O_DIRECT, the way swap-out reaches zram.  The
+ * number of writers doubles up to the number of online CPUs, and each
+ * count is run twice: with max_comp_streams set to 1, so that all writers
+ * share one compression stream, and with one stream per writer.  The
+ * pages written per second are reported for each, so the second column
+ * should grow with the writers while the first one stays flat.
+ *
+ * The device is reset and resized for every run, so only a device that
+ * isn't initialized (i.e. not in use) is touched.  zram0 is used unless
+ * another one is given, e.g. "zram_write_bench zram1".  If the device
+ * doesn't exist, is in use, or its sysfs files aren't writable, the test
+ * is skipped.
+ *
+ * Licensed under the terms of the GNU GPL License version 2
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REGION_PAGES	4096	/* 16 MiB per writer with 4 KiB pages */
+#define BUF_PAGES	64
+#define RUN_SECONDS	2
+#define MAX_THREADS	256
+
+static volatile int stop;
+static long page_size;
+static char dev_path[64];
+static char sys_path[64];
+
+struct writer {
+	pthread_t thread;
+	int index;
+	unsigned long pages;
+};
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int sys_write(const char *attr, unsigned long val)
+{
+	char path[128], buf[32];
+	int fd, len, ret = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", sys_path, attr);
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	len = snprintf(buf, sizeof(buf), "%lu", val);
+	if (write(fd, buf, len) != len)
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+static int sys_read(const char *attr, unsigned long *val)
+{
+	char path[128], buf[32];
+	int fd, len;
+
+	snprintf(path, sizeof(path), "%s/%s", sys_path, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	*val = strtoul(buf, NULL, 0);
+	return 0;
+}
+
+/*
+ * Half of every page is random and half is zero, so pages compress to
+ * about half their size, and no two pages are alike or a repeated word.
+ */
+static void fill(char *buf, unsigned int seed)
+{
+	long i, j;
+
+	for (i = 0; i < BUF_PAGES; i++) {
+		char *page = buf + i * page_size;
+
+		for (j = 0; j < page_size / 2; j++)
+			page[j] = rand_r(&seed);
+		memset(page + page_size / 2, 0, page_size / 2);
+	}
+}
+
+static void *run_writer(void *arg)
+{
+	struct writer *w = arg;
+	off_t base = (off_t)w->index * REGION_PAGES * page_size;
+	unsigned int i = 0;
+	void *buf;
+	int fd;
+
+	if (posix_memalign(&buf, page_size, BUF_PAGES * page_size))
+		die("posix_memalign");
+	fill(buf, w->index + 1);
+
+	fd = open(dev_path, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		die(dev_path);
+
+	while (!stop) {
+		off_t off = base + (off_t)(i % REGION_PAGES) * page_size;
+		char *page = (char *)buf + (i % BUF_PAGES) * page_size;
+
+		if (pwrite(fd, page, page_size, off) != page_size)
+			die("pwrite");
+		w->pages++;
+		i++;
+	}
+
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static double run(int threads, int streams)
+{
+	struct writer writers[MAX_THREADS];
+	unsigned long pages = 0;
+	int i;
+
+	if (sys_write("reset", 1) ||
+	    sys_write("max_comp_streams", streams) ||
+	    sys_write("disksize",
+		      (unsigned long)threads * REGION_PAGES * page_size))
+		die("configuring zram");
+
+	stop = 0;
+	memset(writers, 0, sizeof(writers));
+	for (i = 0; i < threads; i++) {
+		writers[i].index = i;
+		if (pthread_create(&writers[i].thread, NULL, run_writer,
+				   &writers[i]))
+			die("pthread_create");
+	}
+
+	sleep(RUN_SECONDS);
+	stop = 1;
+
+	for (i = 0; i < threads; i++) {
+		pthread_join(writers[i].thread, NULL);
+		pages += writers[i].pages;
+	}
+	return (double)pages / RUN_SECONDS;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *name = argc > 1 ? argv[1] : "zram0";
+	unsigned long initstate, streams;
+	double one, many;
+	int threads;
+	long cpus;
+
+	snprintf(dev_path, sizeof(dev_path), "/dev/%s", name);
+	snprintf(sys_path, sizeof(sys_path), "/sys/block/%s", name);
+
+	if (sys_read("initstate", &initstate) ||
+	    sys_read("max_comp_streams", &streams) ||
+	    access(dev_path, W_OK)) {
+		printf("zram_write_bench: no usable %s, skipping\n", name);
+		return 0;
+	}
+	if (initstate) {
+		printf("zram_write_bench: %s is in use, skipping\n", name);
+		return 0;
+	}
+	if (sys_write("max_comp_streams", streams)) {
+		printf("zram_write_bench: cannot configure %s, skipping\n",
+		       name);
+		return 0;
+	}
+
+	page_size = sysconf(_SC_PAGESIZE);
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_THREADS)
+		cpus = MAX_THREADS;
+
+	printf("%7s %16s %16s\n", "writers", "1 stream pg/s",
+	       "N streams pg/s");
+	for (threads = 1; ; threads *= 2) {
+		if (threads > cpus)
+			threads = cpus;
+		one = run(threads, 1);
+		many = run(threads, threads);
+		printf("%7d %16.0f %16.0f\n", threads, one, many);
+		fflush(stdout);
+		if (threads == cpus)
+			break;
+	}
+
+	/* Give the memory back and leave the old stream limit */
+	sys_write("reset", 1);
+	sys_write("max_comp_streams", streams);
+	return 0;
+}